@@ -0,0 +1,252 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "impl.h"
+
+/* Lights that can be animated per device */
+#define CTLRA_ANIM_MAX 64
+/* Animations render at 60 Hz, independent of the idle_iter rate */
+#define CTLRA_ANIM_TICK_NS (1000000000 / 60)
+
+struct ctlra_anim_slot_t {
+	uint32_t light_id;
+	/* 0 for a light, else grid id + 1 and *light_id* is the pad */
+	uint32_t grid;
+	/* colour last written to the light */
+	uint32_t last;
+	uint8_t written;
+	/* time and beat the animation started, for fades */
+	double start;
+	double start_beat;
+	struct ctlra_anim_t anim;
+};
+
+struct ctlra_anim_list_t {
+	uint32_t count;
+	struct timespec last_tick;
+	struct ctlra_anim_slot_t slots[CTLRA_ANIM_MAX];
+};
+
+static inline double
+anim_secs(const struct timespec *t)
+{
+	return t->tv_sec + t->tv_nsec * 1e-9;
+}
+
+static double
+anim_beat(struct ctlra_t *ctlra, const struct timespec *now)
+{
+	if(!ctlra || ctlra->tempo_bpm <= 0.f)
+		return ctlra ? ctlra->tempo_beat : 0;
+	double secs = anim_secs(now) - anim_secs(&ctlra->tempo_time);
+	return ctlra->tempo_beat + secs * ctlra->tempo_bpm * (1 / 60.);
+}
+
+/* Mix two light_status values per byte, *t* from 0 (a) to 1 (b). The
+ * blink bit is dropped, brightness mixes like the colours. */
+static uint32_t
+anim_mix(uint32_t a, uint32_t b, float t)
+{
+	uint32_t w = t <= 0.f ? 0 : (t >= 1.f ? 256 : t * 256);
+	uint32_t out = 0;
+	a &= 0x7fffffff;
+	b &= 0x7fffffff;
+	for(int s = 0; s < 32; s += 8) {
+		uint32_t ca = (a >> s) & 0xff;
+		uint32_t cb = (b >> s) & 0xff;
+		out |= ((ca * (256 - w) + cb * w) >> 8) << s;
+	}
+	return out;
+}
+
+/* Colour of *slot* at time *secs* and beat *beat*, *beat_running* is zero
+ * when no tempo is set. Sets *done* when a one-shot animation reached its
+ * end */
+static uint32_t
+anim_render(const struct ctlra_anim_slot_t *slot, double secs, double beat,
+	    int beat_running, int *done)
+{
+	const struct ctlra_anim_t *a = &slot->anim;
+	int tempo = a->flags & CTLRA_ANIM_FLAG_TEMPO;
+
+	if(a->wave == CTLRA_ANIM_FADE) {
+		/* without a running tempo the beat stands still, so count
+		 * the fade in seconds rather than holding the slot forever */
+		double t = tempo && beat_running ? beat - slot->start_beat :
+			   secs - slot->start;
+		double x = t / a->period;
+		*done = x >= 1.;
+		return anim_mix(a->colour_a, a->colour_b, x);
+	}
+
+	/* tempo synced cycles follow the beat, so they line up with each
+	 * other, others start with the animation */
+	double t = tempo ? beat : secs - slot->start;
+	double p = t / a->period + a->phase;
+	p -= (int64_t)p;
+	if(p < 0)
+		p += 1.;
+
+	if(a->wave == CTLRA_ANIM_BLINK) {
+		float duty = a->duty > 0.f ? a->duty : 0.5f;
+		return p < duty ? a->colour_a : a->colour_b;
+	}
+
+	/* pulse */
+	float tri = p < 0.5 ? p * 2 : 2 - p * 2;
+	return anim_mix(a->colour_a, a->colour_b, tri);
+}
+
+int32_t
+ctlra_impl_anim_set(struct ctlra_dev_t *dev, uint32_t grid, uint32_t light_id,
+		    const struct ctlra_anim_t *anim)
+{
+	if(anim && (anim->wave > CTLRA_ANIM_FADE || !(anim->period > 0.f)))
+		return -EINVAL;
+
+	struct ctlra_anim_list_t *l = dev->anim;
+	uint32_t i = 0;
+	if(l) {
+		for(i = 0; i < l->count; i++)
+			if(l->slots[i].light_id == light_id &&
+			   l->slots[i].grid == grid)
+				break;
+	}
+
+	if(!anim) {
+		if(l && i < l->count)
+			l->slots[i] = l->slots[--l->count];
+		return 0;
+	}
+
+	if(!l) {
+		l = calloc(1, sizeof(struct ctlra_anim_list_t));
+		if(!l)
+			return -ENOMEM;
+		dev->anim = l;
+	}
+	if(i == l->count) {
+		if(l->count >= CTLRA_ANIM_MAX)
+			return -ENOSPC;
+		l->count++;
+	}
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+
+	struct ctlra_anim_slot_t *slot = &l->slots[i];
+	slot->light_id = light_id;
+	slot->grid = grid;
+	slot->written = 0;
+	slot->start = anim_secs(&now);
+	slot->start_beat = anim_beat(dev->ctlra_context, &now);
+	slot->anim = *anim;
+	return 0;
+}
+
+int32_t
+ctlra_dev_light_animate(struct ctlra_dev_t *dev, uint32_t light_id,
+			const struct ctlra_anim_t *anim)
+{
+	if(!dev)
+		return -EINVAL;
+	if(!dev->light_set)
+		return -ENOTSUP;
+	return ctlra_impl_anim_set(dev, 0, light_id, anim);
+}
+
+void
+ctlra_tempo_set(struct ctlra_t *ctlra, float bpm, double beat)
+{
+	if(!ctlra)
+		return;
+	ctlra->tempo_bpm = bpm;
+	ctlra->tempo_beat = beat;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &ctlra->tempo_time);
+}
+
+void
+ctlra_impl_anim_tick(struct ctlra_t *ctlra, struct ctlra_dev_t *dev,
+		     const struct timespec *now)
+{
+	struct ctlra_anim_list_t *l = dev->anim;
+	if(!l->count ||
+	   !ctlra_impl_interval_elapsed(&l->last_tick, now,
+					CTLRA_ANIM_TICK_NS))
+		return;
+
+	double secs = anim_secs(now);
+	double beat = anim_beat(ctlra, now);
+	int beat_running = ctlra && ctlra->tempo_bpm > 0.f;
+	int changed = 0;
+
+	uint32_t i = 0;
+	while(i < l->count) {
+		struct ctlra_anim_slot_t *slot = &l->slots[i];
+		int done = 0;
+		uint32_t col = anim_render(slot, secs, beat, beat_running,
+					   &done);
+
+		if(!slot->written || col != slot->last) {
+			if(slot->grid)
+				dev->grid_light_set(dev, slot->grid - 1,
+						    slot->light_id, col);
+			else
+				dev->light_set(dev, slot->light_id, col);
+			slot->last = col;
+			slot->written = 1;
+			changed = 1;
+		}
+
+		/* finished fades leave the light at their last colour */
+		if(done) {
+			l->slots[i] = l->slots[--l->count];
+			continue;
+		}
+		i++;
+	}
+
+	/* the driver writes only the reports that changed */
+	if(changed && dev->light_flush)
+		dev->light_flush(dev, 0);
+}
+
+void
+ctlra_impl_anim_free(struct ctlra_dev_t *dev)
+{
+	free(dev->anim);
+	dev->anim = 0;
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include "colour.h"
+
+void
+ctlra_colour_lut_init(struct ctlra_colour_lut_t *lut,
+		      ctlra_colour_quantise_func quantise)
+{
+	if(lut->ready)
+		return;
+
+	for(uint32_t i = 0; i < CTLRA_COLOUR_LUT_SIZE; i++) {
+		/* expand 5 bits back to 8, so 0x1f becomes 0xff */
+		uint8_t r = (i >> 10) & 0x1f;
+		uint8_t g = (i >>  5) & 0x1f;
+		uint8_t b = (i >>  0) & 0x1f;
+		r = (r << 3) | (r >> 2);
+		g = (g << 3) | (g >> 2);
+		b = (b << 3) | (b >> 2);
+		lut->table[i] = quantise(r, g, b);
+	}
+	lut->grey = quantise(0xff, 0xff, 0xff);
+	lut->ready = 1;
+}
+
+uint8_t
+ctlra_colour_ni_hue(uint8_t r, uint8_t g, uint8_t b)
+{
+	/* if equal components, then set white */
+	if(r == g && r == b)
+		return 0xff;
+
+	uint8_t max = r > g ? r : g;
+	max = b > max ? b : max;
+	uint8_t min = r < g ? r : g;
+	min = b < min ? b : min;
+
+	/* rgb to hsv, only the hue is used by the device */
+	uint8_t h;
+	if (max == r)
+		h = 0 + 43 * (g - b) / (max - min);
+	else if (max == g)
+		h = 85 + 43 * (b - r) / (max - min);
+	else
+		h = 171 + 43 * (r - g) / (max - min);
+
+	return h / 16 + 1;
+}
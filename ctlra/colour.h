@@ -0,0 +1,102 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CTLRA_COLOUR_H
+#define CTLRA_COLOUR_H
+
+#include <stdint.h>
+
+/* Colour quantisation shared by the LED drivers. A light_status holds
+ * 8 bits per RGB channel, which devices map to their own palette. To
+ * keep light_set() cheap the mapping is computed once per device type
+ * into a table indexed by the top 5 bits of each channel (15 bit RGB),
+ * so converting a colour is a single table load.
+ *
+ * The colour is scaled up until its brightest channel uses the top bit
+ * before indexing, so a dim colour keeps its hue rather than collapsing
+ * to grey in 5 bits. Brightness is passed to devices separately. Greys
+ * are tested on the full 8 bits and map to one entry of their own. */
+
+#define CTLRA_COLOUR_LUT_BITS 15
+#define CTLRA_COLOUR_LUT_SIZE (1 << CTLRA_COLOUR_LUT_BITS)
+
+/* Maps one RGB colour to the device encoding, used to fill the table */
+typedef uint8_t (*ctlra_colour_quantise_func)(uint8_t r, uint8_t g,
+					      uint8_t b);
+
+struct ctlra_colour_lut_t {
+	uint8_t ready;
+	/* the device encoding of grey and white */
+	uint8_t grey;
+	uint8_t table[CTLRA_COLOUR_LUT_SIZE];
+};
+
+/* Fill the table, if not already done. A lut is intended to be static
+ * in the driver, shared by all instances of the device type */
+void ctlra_colour_lut_init(struct ctlra_colour_lut_t *lut,
+			   ctlra_colour_quantise_func quantise);
+
+static inline uint8_t
+ctlra_colour_lut_get(const struct ctlra_colour_lut_t *lut,
+		     uint32_t light_status)
+{
+	uint32_t r = (light_status >> 16) & 0xff;
+	uint32_t g = (light_status >>  8) & 0xff;
+	uint32_t b = (light_status >>  0) & 0xff;
+	if(r == g && g == b)
+		return lut->grey;
+
+	/* not grey, so at least one channel is non zero */
+	int shift = __builtin_clz(r | g | b) - 24;
+	r <<= shift;
+	g <<= shift;
+	b <<= shift;
+	uint32_t idx = ((r >> 3) << 10) | ((g >> 3) << 5) | (b >> 3);
+	return lut->table[idx];
+}
+
+/* Hue index of the 16 colour palette of NI devices (MK3, Jam), 1 to
+ * 16. Grey and white colours return 0xff, which selects white */
+uint8_t ctlra_colour_ni_hue(uint8_t r, uint8_t g, uint8_t b);
+
+/* Split a light_status into the 7 bit channels used by devices that
+ * take RGB intensities directly. The top bit of each channel is
+ * dropped, so both 0x7F and 0xFF are full intensity */
+static inline void
+ctlra_colour_rgb7(uint32_t light_status, uint8_t *r, uint8_t *g,
+		  uint8_t *b)
+{
+	*r = (light_status >> 16) & 0x7F;
+	*g = (light_status >>  8) & 0x7F;
+	*b = (light_status >>  0) & 0x7F;
+}
+
+#endif /* CTLRA_COLOUR_H */
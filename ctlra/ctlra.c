@@ -28,23 +28,6 @@ int ctlra_impl_get_id_by_vid_pid(uint32_t vid, uint32_t pid)
 	return -1;
 }
 
-/* Search trough existing instances, and match against first VID/PID */
-int ctlra_impl_dev_get_by_vid_pid(struct ctlra_t *ctlra, int32_t vid,
-				  int32_t pid, struct ctlra_dev_t **out_dev)
-{
-	struct ctlra_dev_t *dev_iter = ctlra->dev_list;
-	*out_dev = 0x0;
-	while(dev_iter) {
-		if(dev_iter->info.vendor_id == vid &&
-		   dev_iter->info.device_id == pid) {
-			*out_dev = dev_iter;
-			return 0;
-		}
-		dev_iter = dev_iter->dev_list_next;
-	}
-	return -1;
-}
-
 struct ctlra_dev_t *ctlra_dev_connect(struct ctlra_t *ctlra,
 				      ctlra_dev_connect_func connect,
 				      ctlra_event_func event_func,
@@ -193,7 +176,8 @@ CTLRA_DEVICE_DECL(avtka);
 
 uint32_t ctlra_dev_poll(struct ctlra_dev_t *dev)
 {
-	if(dev && dev->poll && !dev->banished) {
+	if(dev && dev->poll && !dev->banished &&
+	   dev->usb_recover != CTLRA_USB_RECOVER_ACTIVE) {
 		return dev->poll(dev);
 	}
 	return 0;
@@ -225,6 +209,13 @@ ctlra_dev_set_feedback_func(struct ctlra_dev_t *dev,
 		dev->feedback_func = func;
 }
 
+void
+ctlra_dev_feedback_dirty(struct ctlra_dev_t *dev)
+{
+	if(dev)
+		dev->feedback_dirty = 1;
+}
+
 void
 ctlra_dev_set_screen_feedback_func(struct ctlra_dev_t *dev,
 				   ctlra_screen_redraw_cb func)
@@ -247,6 +238,9 @@ int32_t ctlra_dev_disconnect(struct ctlra_dev_t *dev)
 	struct ctlra_dev_t *dev_iter = ctlra->dev_list;
 
 	if(dev && dev->disconnect) {
+		ctlra_impl_anim_free(dev);
+		ctlra_impl_page_free(dev);
+
 		/* call the application remove_func() to inform app */
 		if(dev->remove_func)
 			dev->remove_func(dev, dev->banished,
@@ -280,6 +274,23 @@ void ctlra_dev_light_set(struct ctlra_dev_t *dev, uint32_t light_id,
 		dev->light_set(dev, light_id, light_status);
 }
 
+void ctlra_dev_lights_set_bulk(struct ctlra_dev_t *dev, uint32_t first_id,
+			       uint32_t count, const uint32_t *colours)
+{
+	if(!dev || !colours)
+		return;
+
+	if(dev->lights_set_bulk) {
+		dev->lights_set_bulk(dev, first_id, count, colours);
+		return;
+	}
+
+	if(dev->light_set) {
+		for(uint32_t i = 0; i < count; i++)
+			dev->light_set(dev, first_id + i, colours[i]);
+	}
+}
+
 void ctlra_dev_feedback_set(struct ctlra_dev_t *dev, uint32_t fb_id,
 			    float value)
 {
@@ -295,10 +306,37 @@ void ctlra_dev_feedback_digits(struct ctlra_dev_t *dev,
 		dev->feedback_digits(dev, feedback_id, value);
 }
 
+int
+ctlra_impl_interval_elapsed(struct timespec *then, const struct timespec *now,
+			    uint64_t ns)
+{
+	time_t secs = now->tv_sec  - then->tv_sec;
+	long nanos  = now->tv_nsec - then->tv_nsec;
+	uint64_t nanos_elapsed = secs * 1e9 + nanos;
+	if(nanos_elapsed < ns)
+		return 0;
+	*then = *now;
+	return 1;
+}
+
 void ctlra_dev_light_flush(struct ctlra_dev_t *dev, uint32_t force)
 {
-	if(dev && dev->light_flush)
-		dev->light_flush(dev, force);
+	if(!dev || !dev->light_flush)
+		return;
+
+	/* Apps often force flush from a feedback func: when feedback is
+	 * scheduled, write everything at most once per force interval
+	 * and only the changed lights otherwise */
+	struct ctlra_t *ctlra = dev->ctlra_context;
+	if(force && ctlra && ctlra->feedback_ns) {
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC_RAW, &now);
+		force = ctlra_impl_interval_elapsed(&dev->light_flush_last_force,
+						    &now,
+						    ctlra->feedback_force_ns);
+	}
+
+	dev->light_flush(dev, force);
 }
 
 void ctlra_dev_grid_light_set(struct ctlra_dev_t *dev, uint32_t grid_id,
@@ -308,6 +346,65 @@ void ctlra_dev_grid_light_set(struct ctlra_dev_t *dev, uint32_t grid_id,
 		dev->grid_light_set(dev, grid_id, light_id, light_status);
 }
 
+/* Looks up the light ids of the pads of a grid. Returns 1 when the pads
+ * are not a light range, and must be set one by one via grid_light_set */
+static int32_t
+ctlra_impl_grid_lights(struct ctlra_dev_t *dev, uint32_t grid_id,
+		       uint32_t *first, uint32_t *count)
+{
+	if(!dev || grid_id >= dev->info.control_count[CTLRA_EVENT_GRID] ||
+	   grid_id >= CTLRA_NUM_GRIDS_MAX)
+		return -EINVAL;
+
+	/* grid info params hold the first and last light id of the pads */
+	const struct ctlra_grid_info_t *grid = &dev->info.grid_info[grid_id];
+	*first = grid->info.params[0];
+	*count = grid->x * grid->y;
+	if(grid->info.params[1] <= *first)
+		return dev->grid_light_set ? 1 : -ENOTSUP;
+
+	if(!dev->lights_set_bulk && !dev->light_set)
+		return -ENOTSUP;
+	return 0;
+}
+
+int32_t ctlra_dev_grid_set(struct ctlra_dev_t *dev, uint32_t grid_id,
+			   const uint32_t *colours)
+{
+	uint32_t first, count;
+	if(!colours)
+		return -EINVAL;
+	int32_t ret = ctlra_impl_grid_lights(dev, grid_id, &first, &count);
+	if(ret < 0)
+		return ret;
+
+	if(ret) {
+		for(uint32_t i = 0; i < count; i++)
+			dev->grid_light_set(dev, grid_id, i, colours[i]);
+		return 0;
+	}
+
+	ctlra_dev_lights_set_bulk(dev, first, count, colours);
+	return 0;
+}
+
+int32_t ctlra_dev_grid_animate(struct ctlra_dev_t *dev, uint32_t grid_id,
+			       uint32_t pos, const struct ctlra_anim_t *anim)
+{
+	uint32_t first, count;
+	int32_t ret = ctlra_impl_grid_lights(dev, grid_id, &first, &count);
+	if(ret < 0)
+		return ret;
+	if(pos >= count)
+		return -EINVAL;
+
+	if(ret)
+		return ctlra_impl_anim_set(dev, grid_id + 1, pos, anim);
+	if(!dev->light_set)
+		return -ENOTSUP;
+	return ctlra_impl_anim_set(dev, 0, first + pos, anim);
+}
+
 int32_t ctlra_screen_get_data(struct ctlra_dev_t *dev,
 				  uint32_t screen_idx,
 				  uint8_t **pixels,
@@ -356,6 +453,7 @@ struct ctlra_t *ctlra_create(const struct ctlra_create_opts_t *opts)
 {
 	struct ctlra_t *c = calloc(1, sizeof(struct ctlra_t));
 	if(!c) return 0;
+	c->hidraw_epoll = -1;
 
 	/* If options were passed, copy them to the instance */
 	if(opts) {
@@ -374,16 +472,23 @@ struct ctlra_t *ctlra_create(const struct ctlra_create_opts_t *opts)
 		CTLRA_INFO(c, "debug level: %d\n", debug_level);
 		CTLRA_INFO(c, "screen redraw target FPS: %d\n",
 			   c->opts.screen_redraw_target_fps);
+		CTLRA_INFO(c, "screen bus budget MB/s: %d\n",
+			   c->opts.screen_bus_mbytes_per_sec);
 	}
 
 	if(ctlra_debug) {
 		CTLRA_INFO(c, "JACK: %s\n", CTLRA_OPT_JACK);
 		CTLRA_INFO(c, "ALSA: %s\n", CTLRA_OPT_ALSA);
 		CTLRA_INFO(c, "Cairo: %s\n", CTLRA_OPT_CAIRO);
+		CTLRA_INFO(c, "io_uring: %s\n", CTLRA_OPT_URING);
 	}
 
 	/* Setup/compute runtime values */
 	c->screen_redraw_ns = 1000000000.f / c->opts.screen_redraw_target_fps;
+	if(c->opts.feedback_max_fps)
+		c->feedback_ns = 1000000000.f / c->opts.feedback_max_fps;
+	c->feedback_force_ns = c->opts.feedback_force_interval_ms ?
+		c->opts.feedback_force_interval_ms * 1000000ull : 1000000000;
 
 	/* register USB hotplug etc */
 	int err = ctlra_dev_impl_usb_init(c);
@@ -409,6 +514,8 @@ int ctlra_impl_accept_dev(struct ctlra_t *ctlra,
 	if(dev) {
 		/* Store the ctlra context into the dev pointer */
 		dev->ctlra_context = ctlra;
+		/* first iteration writes the initial feedback */
+		dev->feedback_dirty = 1;
 
 		/* Application sets function pointers directly to device */
 		int accepted = ctlra->accept_dev_func(ctlra,
@@ -439,9 +546,24 @@ int ctlra_probe(struct ctlra_t *ctlra,
 
 	ctlra->accept_dev_func = accept_func;
 	ctlra->accept_dev_func_userdata = userdata;
+
+	/* drivers look their device up in a single enumeration of the
+	 * bus, instead of each walking the bus */
+	int enumerated = ctlra_impl_usb_enum_begin(ctlra) == 0;
 	for(; i < __ctlra_device_count; i++) {
-		num_accepted += ctlra_impl_accept_dev(ctlra, i);
+		/* each connect opens one device, so connect again for
+		 * every identical device on the bus. Stop when a connect
+		 * took no device, or it would connect forever */
+		uint32_t taken;
+		do {
+			taken = ctlra_impl_usb_enum_taken();
+			num_accepted += ctlra_impl_accept_dev(ctlra, i);
+		} while(enumerated && ctlra_impl_usb_enum_taken() != taken &&
+			ctlra_impl_usb_enum_pending(__ctlra_devices[i].vid,
+						    __ctlra_devices[i].pid));
 	}
+	if(enumerated)
+		ctlra_impl_usb_enum_end();
 
 	/* virtualize device from ENV variable */
 	char *virt_vendor = getenv("CTLRA_VIRTUAL_VENDOR");
@@ -519,37 +641,61 @@ void ctlra_idle_iter(struct ctlra_t *ctlra)
 	/* Then update state of all */
 	dev_iter = ctlra->dev_list;
 	while(dev_iter) {
-		if(dev_iter->banished) {
+		if(dev_iter->banished ||
+		   dev_iter->usb_recover == CTLRA_USB_RECOVER_ACTIVE) {
 			dev_iter = dev_iter->dev_list_next;
 			continue;
 		}
 
-		if(dev_iter->feedback_func) {
-			dev_iter->feedback_func(dev_iter,
-				dev_iter->event_func_userdata);
-		}
-
-		if(dev_iter->screen_redraw_cb) {
-			struct timespec now;
+		int need_clock = dev_iter->screen_redraw_cb || dev_iter->anim ||
+				 (dev_iter->feedback_func && ctlra->feedback_ns);
+		struct timespec now;
+		if(need_clock) {
 			int err = clock_gettime(CLOCK_MONOTONIC_RAW, &now);
 			if(err)
 				CTLRA_ERROR(ctlra, "Error getting MONOTONIC_RAW clock: %d\n",
 					    err);
+		}
 
-			time_t secs = now.tv_sec  - dev_iter->screen_last_redraw.tv_sec;
-			long nanos  = now.tv_nsec - dev_iter->screen_last_redraw.tv_nsec;
-			uint64_t nanos_elapsed = secs * 1e9 + nanos;
+		/* feedback only when marked dirty if the app asked for it,
+		 * and at most feedback_max_fps times per second */
+		int feedback = dev_iter->feedback_func != 0;
+		if(feedback && ctlra->opts.flags_feedback_on_dirty)
+			feedback = dev_iter->feedback_dirty;
+		if(feedback && ctlra->feedback_ns)
+			feedback = ctlra_impl_interval_elapsed(
+					&dev_iter->feedback_last, &now,
+					ctlra->feedback_ns);
+		if(feedback) {
+			dev_iter->feedback_dirty = 0;
+			dev_iter->feedback_func(dev_iter,
+				dev_iter->event_func_userdata);
+		}
 
-			if (ctlra->screen_redraw_ns <= nanos_elapsed) {
-				dev_iter->screen_last_redraw = now;
-				for(int i = 0; i < CTLRA_NUM_SCREENS_MAX; i++) {
-					ctlra_impl_screen_redraw(ctlra, dev_iter, i);
-				}
+		/* animations render over the lights set by feedback */
+		if(dev_iter->anim)
+			ctlra_impl_anim_tick(ctlra, dev_iter, &now);
+
+		/* lights the driver changed while decoding input */
+		if(dev_iter->light_flush_pending && dev_iter->light_flush) {
+			dev_iter->light_flush_pending = 0;
+			dev_iter->light_flush(dev_iter, 0);
+		}
+
+		if(dev_iter->screen_redraw_cb &&
+		   ctlra_impl_interval_elapsed(&dev_iter->screen_last_redraw,
+					       &now, ctlra->screen_redraw_ns)) {
+			for(int i = 0; i < CTLRA_NUM_SCREENS_MAX; i++) {
+				ctlra_impl_screen_redraw(ctlra, dev_iter, i);
 			}
 		}
 		dev_iter = dev_iter->dev_list_next;
 	}
 
+	/* screen frames go out last, after the input reads and LED writes
+	 * of all devices were submitted */
+	ctlra_impl_usb_screen_iter(ctlra);
+
 	/* if any devices were banished (I/O Error, malfunctioned etc)
 	 * then we disconnect them here. The dev_disconnect() call will
 	 * inform the application if it registered a remove() callback */
@@ -558,11 +704,25 @@ void ctlra_idle_iter(struct ctlra_t *ctlra)
 		ctlra_dev_disconnect(ctlra->banished_list);
 		ctlra->banished_list = tmp;
 	}
+
+	/* hotplugged devices are brought up last, one per iteration, so
+	 * the devices already running are not held up by the set up */
+	ctlra_impl_usb_hotplug_iter(ctlra);
 }
 
 void ctlra_dev_impl_banish(struct ctlra_dev_t *dev)
 {
 	struct ctlra_t *ctlra = dev->ctlra_context;
+	/* each failed transfer in flight reports the error */
+	if(dev->banished)
+		return;
+
+	/* try to re-open it first, banished if that fails for too long */
+	if(ctlra->opts.flags_usb_reconnect &&
+	   dev->usb_recover != CTLRA_USB_RECOVER_FAILED &&
+	   ctlra_impl_usb_recover_start(dev) == 0)
+		return;
+
 	dev->banished = 1;
 	if(ctlra->banished_list == 0)
 		ctlra->banished_list = dev;
@@ -587,10 +747,13 @@ void ctlra_exit(struct ctlra_t *ctlra)
 		struct ctlra_dev_t *dev_free = dev_iter;
 		dev_iter = dev_iter->dev_list_next;
 
-		ctlra_dev_usb_stats_debug(dev_free);
 		ctlra_dev_disconnect(dev_free);
 	}
 
+	/* Every device writes its lights off as it disconnects, and the
+	 * USB handles are closed together after, waiting once for all of
+	 * those writes instead of once per device */
+	ctlra_impl_usb_close_all(ctlra);
 	ctlra_impl_usb_shutdown(ctlra);
 
 	free(ctlra);
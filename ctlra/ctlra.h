@@ -94,7 +94,19 @@ struct ctlra_t;
 struct ctlra_create_opts_t {
 	/* creation time flags */
 	uint8_t flags_usb_no_own_context : 1;
-	uint8_t flags_usb_unsued : 7;
+	/* only call the feedback func of a device after the application
+	 * marked it with ctlra_dev_feedback_dirty() */
+	uint8_t flags_feedback_on_dirty : 1;
+	/* also probe HID devices that are not on USB, such as the virtual
+	 * devices of /dev/uhid. They are opened through hidraw, by the
+	 * drivers that support it */
+	uint8_t flags_hidraw_virtual : 1;
+	/* re-open devices that fail a USB transfer or briefly drop off
+	 * the bus, keeping the same ctlra_dev_t and callbacks, and write
+	 * their lights and screens again. The remove func is only called
+	 * if the device did not come back within two seconds */
+	uint8_t flags_usb_reconnect : 1;
+	uint8_t flags_usb_unsued : 4;
 
 	/* debug verbosity */
 	uint8_t debug_level;
@@ -105,8 +117,29 @@ struct ctlra_create_opts_t {
 	 */
 	uint8_t screen_redraw_target_fps;
 
+	/* call the feedback func of each device at most this number of
+	 * times per second. Zero calls feedback on every ctlra_idle_iter().
+	 * When set, a forced light flush is honoured at most once per
+	 * feedback_force_interval_ms, see ctlra_dev_light_flush().
+	 */
+	uint8_t feedback_max_fps;
+
+	/* limit the screen writes of all devices on one USB bus to this
+	 * many megabytes per second, leaving the rest of the bus to input
+	 * and LEDs of the other devices. Zero does not limit.
+	 */
+	uint8_t screen_bus_mbytes_per_sec;
+
+	uint8_t padding_align;
+	/* with feedback_max_fps set, the minimum time in milliseconds
+	 * between two forced light flushes of a device. A forced flush
+	 * within this interval of the previous one only writes the
+	 * changed lights. Zero uses the default of one second.
+	 */
+	uint16_t feedback_force_interval_ms;
+
 	/* reserve lots of space */
-	uint8_t padding[62];
+	uint8_t padding[56];
 };
 
 /** Get the human readable name for *control_id* from *dev*. The
@@ -325,6 +358,12 @@ int ctlra_probe(struct ctlra_t *ctlra, ctlra_accept_dev_func accept_func,
 void ctlra_dev_set_feedback_func(struct ctlra_dev_t *dev,
 				 ctlra_feedback_func func);
 
+/** Mark the feedback of *dev* as out of date, so its feedback func is
+ * called on the next ctlra_idle_iter(). Only required when the
+ * flags_feedback_on_dirty option is set, otherwise the feedback func
+ * is called every iteration, limited by feedback_max_fps. */
+void ctlra_dev_feedback_dirty(struct ctlra_dev_t *dev);
+
 void ctlra_dev_set_callback_userdata(struct ctlra_dev_t *dev,
 				     void *app_userdata);
 
@@ -421,12 +460,24 @@ void ctlra_dev_set_event_func(struct ctlra_dev_t* dev,
  * The brightness (0x7F << 24) is a 0 to 127 brightness value.
  * The remaining 16 bits are encoded as 0xRRGGBB in hex.
  * Controllers should support these inputs as best they can for the given
- * light_id.
+ * light_id. The light is only stored: it is sent by the next
+ * *ctlra_dev_light_flush*, or by the next *ctlra_idle_iter* when the
+ * driver flushes lights itself (eg: the generic MIDI device).
  */
 void ctlra_dev_light_set(struct ctlra_dev_t *dev,
 			uint32_t light_id,
 			uint32_t light_status);
 
+/** Write *count* lights starting at *first_id* in one call, where
+ * *colours* holds a *light_status* for each light. See
+ * *ctlra_dev_light_set* for the format. Devices convert the whole array
+ * in one pass where supported, otherwise each light is set in turn.
+ */
+void ctlra_dev_lights_set_bulk(struct ctlra_dev_t *dev,
+			       uint32_t first_id,
+			       uint32_t count,
+			       const uint32_t *colours);
+
 /** Feedback item set: sets the value for a feedback item */
 void ctlra_dev_feedback_set(struct ctlra_dev_t *dev,
 			    uint32_t fb_id,
@@ -440,6 +491,11 @@ void ctlra_dev_feedback_digits(struct ctlra_dev_t *dev,
 /** Flush the bytes with the Lights/LEDs info over the cable. The device
  * implementation must track which lights are actually dirty, and only
  * flush the bytes needed. If *force* is set, force flush everything.
+ * When feedback_max_fps is set, a forced flush within
+ * feedback_force_interval_ms (default one second) of the previous
+ * forced flush of the device is downgraded to a normal flush, which
+ * only writes the dirty lights. Apps forcing a flush from every
+ * feedback func call are limited this way.
  */
 void ctlra_dev_light_flush(struct ctlra_dev_t *dev, uint32_t force);
 
@@ -453,6 +509,112 @@ void ctlra_dev_grid_light_set(struct ctlra_dev_t *dev,
 			     uint32_t light_id,
 			     uint32_t light_status);
 
+/** Set every light of a grid in one call. The *colours* array holds one
+ * *light_status* per pad, *x* times *y* as described by the grid info.
+ * @retval 0 Success
+ * @retval -EINVAL The device has no grid with *grid_id*
+ * @retval -ENOTSUP The grid lights cannot be set
+ */
+int32_t ctlra_dev_grid_set(struct ctlra_dev_t *dev,
+			   uint32_t grid_id,
+			   const uint32_t *colours);
+
+/** Animation waveforms, see *struct ctlra_anim_t* */
+enum ctlra_anim_wave_t {
+	/** *colour_a* for *duty* of the period, then *colour_b*. Chases
+	 * are blinks with a short duty and a phase per light. */
+	CTLRA_ANIM_BLINK = 0,
+	/** Triangle from *colour_a* to *colour_b* and back each period */
+	CTLRA_ANIM_PULSE,
+	/** One-shot fade from *colour_a* to *colour_b* over one period,
+	 * after which the light stays *colour_b* and the animation ends */
+	CTLRA_ANIM_FADE,
+};
+
+/** The period is in beats of the tempo set by *ctlra_tempo_set*. While
+ * no tempo is running, tempo fades count the period in seconds so they
+ * still end. */
+#define CTLRA_ANIM_FLAG_TEMPO (1 << 0)
+
+/** Describes the animation of one light. Colours use the *light_status*
+ * format of *ctlra_dev_light_set*. */
+struct ctlra_anim_t {
+	/** One of *enum ctlra_anim_wave_t* */
+	uint8_t wave;
+	/** Bitmask of CTLRA_ANIM_FLAG_* */
+	uint8_t flags;
+	uint32_t colour_a;
+	uint32_t colour_b;
+	/** Length of one cycle in seconds, or beats with the tempo flag */
+	float period;
+	/** Offset into the cycle, 0 to 1 */
+	float phase;
+	/** Part of the cycle a blink shows *colour_a*, 0 means half */
+	float duty;
+};
+
+/** Animate a light of *dev* inside Ctlra. Animations are rendered on a
+ * fixed tick from *ctlra_idle_iter*, and only changed lights are
+ * written and flushed. Passing NULL for *anim* stops the animation,
+ * leaving the light as last rendered. A light is only written when its
+ * rendered colour changes, so a *ctlra_dev_light_set* of an animated
+ * light shows until the animation next changes colour: stop the
+ * animation before setting the light.
+ * @retval 0 Success
+ * @retval -EINVAL Invalid device or animation
+ * @retval -ENOTSUP The device has no lights
+ * @retval -ENOSPC Too many lights are animated on this device
+ * @retval -ENOMEM Out of memory
+ */
+int32_t ctlra_dev_light_animate(struct ctlra_dev_t *dev,
+				uint32_t light_id,
+				const struct ctlra_anim_t *anim);
+
+/** Animate the pad at *pos* of a grid, see *ctlra_dev_light_animate*.
+ * @retval -ENOTSUP The grid lights cannot be set
+ */
+int32_t ctlra_dev_grid_animate(struct ctlra_dev_t *dev,
+			       uint32_t grid_id,
+			       uint32_t pos,
+			       const struct ctlra_anim_t *anim);
+
+/** Function that sets the lights of a page, see *ctlra_dev_page_build*.
+ * It may call any of the light and grid set functions on *dev*, but
+ * must not flush. */
+typedef void (*ctlra_page_build_func)(struct ctlra_dev_t *dev,
+				      void *userdata);
+
+/** Build a feedback page: a copy of the lights of *dev* in the format of
+ * the device, so switching to it later is a single bulk write. The
+ * page starts as the current lights, then *func* sets the lights of
+ * the page. The device itself is not changed. Building a page with an
+ * existing *name* replaces it.
+ * @retval >=0 The index of the page, to pass to *ctlra_dev_page_show*
+ * @retval -EINVAL Invalid device, name or function
+ * @retval -ENOTSUP The driver does not support pages
+ * @retval -ENOMEM Out of memory
+ */
+int32_t ctlra_dev_page_build(struct ctlra_dev_t *dev, const char *name,
+			     ctlra_page_build_func func, void *userdata);
+
+/** Find a page built by *ctlra_dev_page_build* by its *name*.
+ * @retval >=0 The index of the page
+ * @retval -ENOENT No page with that name
+ */
+int32_t ctlra_dev_page_find(struct ctlra_dev_t *dev, const char *name);
+
+/** Switch the lights of *dev* to a prebuilt page, and flush. Only the
+ * reports that differ from the device are written.
+ * @retval 0 Success
+ * @retval -EINVAL No page with index *page*
+ */
+int32_t ctlra_dev_page_show(struct ctlra_dev_t *dev, int32_t page);
+
+/** Set the tempo for animations with CTLRA_ANIM_FLAG_TEMPO. *beat* is the
+ * beat position of the application right now, so animations line up
+ * with its bars: a period of 1 blinks on every beat. */
+void ctlra_tempo_set(struct ctlra_t *ctlra, float bpm, double beat);
+
 /** @warning
  * @b DEPRECATED: this API has been superseeded, use the screen update
  * callback APIs instead.
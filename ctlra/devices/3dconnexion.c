@@ -255,6 +255,8 @@ ctlra_spacemouse_connect(ctlra_event_func event_func, void *userdata,
 	if(err)
 		goto fail;
 
+	/* hidraw only for virtual devices, real ones keep async libusb */
+	dev->base.usb_hidraw = CTLRA_USB_HIDRAW_VIRTUAL;
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 						USB_INTERFACE_ID,
 						USB_HANDLE_IDX);
@@ -77,6 +77,7 @@ int akai_apc_midi_input_cb(uint8_t nbytes, uint8_t * buf, void *ud)
 					.id = buf[0] - 0xb0,
 					.value = buf[2] / 127.f
 				},
+				.timestamp = ctlra_midi_input_time(dev->midi),
 			};
 			struct ctlra_event_t *e = {&event};
 			dev->base.event_func(&dev->base, 1, &e,
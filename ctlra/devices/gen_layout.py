@@ -0,0 +1,232 @@
+#!/usr/bin/env python3
+#
+# Copyright (c) 2017, OpenAV Productions,
+# Harry van Haaren <harryhaaren@gmail.com>
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions are
+# met:
+#
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+# 3. Neither the name of the copyright holder nor the names of its
+#    contributors may be used to endorse or promote products derived from
+#    this software without specific prior written permission.
+#
+# THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+# IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+# TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+# PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+# HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+# SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+# TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+# PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+# LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+# NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+# SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+# Generates the report decoder of a device from its .layout file.
+#
+# The output header contains the control names, the ctlra_item_info_t
+# tables and straight-line decode functions with every offset and mask
+# a constant, so the compiler fully specialises the hot path. See
+# ni_kontrol_f1.layout for the file format.
+#
+# Usage: gen_layout.py <input.layout> <output.h>
+
+import shlex
+import sys
+
+INFO_KEYS = ['x', 'y', 'w', 'h', 'flags', 'colour', 'fb_id']
+
+
+def fail(path, lineno, msg):
+    sys.exit('%s:%d: error: %s' % (path, lineno, msg))
+
+
+def parse(path):
+    layout = {'prefix': None, 'report': None,
+              'slider': [], 'button': [], 'grid': []}
+    with open(path) as f:
+        for lineno, line in enumerate(f, 1):
+            tok = shlex.split(line, comments=True)
+            if not tok:
+                continue
+            kind, args = tok[0], tok[1:]
+            if kind in ('prefix', 'report'):
+                if len(args) != 1:
+                    fail(path, lineno, '%s takes one value' % kind)
+                layout[kind] = args[0]
+                continue
+            if kind not in ('slider', 'button', 'grid'):
+                fail(path, lineno, 'unknown item "%s"' % kind)
+            if len(args) < 3:
+                fail(path, lineno, '%s needs id, offset and mask' % kind)
+
+            item = {'id': args[0], 'offset': int(args[1], 0),
+                    'mask': int(args[2], 0), 'line': lineno}
+            for kv in args[3:]:
+                if '=' not in kv:
+                    fail(path, lineno, 'expected key=value, got "%s"' % kv)
+                k, v = kv.split('=', 1)
+                item[k] = v
+
+            if kind != 'slider' and item['mask'] > 0xff:
+                fail(path, lineno, '%s mask must fit in one byte' % kind)
+            if kind == 'slider' and 'range' not in item:
+                fail(path, lineno, 'slider needs range=')
+            layout[kind].append(item)
+
+    if not layout['prefix'] or not layout['report']:
+        sys.exit('%s: error: prefix and report are required' % path)
+    for kind in ('slider', 'button', 'grid'):
+        for item in layout[kind]:
+            end = item['offset'] + (2 if kind == 'slider' else 1)
+            if end > int(layout['report'], 0):
+                fail(path, item['line'], 'offset outside of report')
+    # the bit decoders share the previous report, one byte per decoder
+    btn_bytes = set(it['offset'] for it in layout['button'])
+    for item in layout['grid']:
+        if item['offset'] in btn_bytes:
+            fail(path, item['line'], 'grid and buttons share a byte')
+    return layout
+
+
+def gen_names(out, prefix, kind, items):
+    out.append('static const char *%s_names_%ss[] = {' % (prefix, kind))
+    for it in items:
+        out.append('\t"%s",' % it.get('name', ''))
+    out.append('};')
+    out.append('')
+
+
+def gen_info(out, prefix, kind, items):
+    out.append('static struct ctlra_item_info_t %s_%ss_info[] = {'
+               % (prefix, kind))
+    for it in items:
+        fields = ['.%s = %s' % (k, it[k]) for k in INFO_KEYS if k in it]
+        out.append('\t{%s},' % ', '.join(fields))
+    out.append('};')
+    out.append('')
+
+
+def gen_sliders(out, prefix, items):
+    out.append('/* Decode the sliders, updating the raw *values* and writing')
+    out.append(' * an event for each change. Returns the number of events */')
+    out.append('static inline uint32_t')
+    out.append('%s_decode_sliders(const uint8_t *buf, uint16_t *values,'
+               % prefix)
+    out.append('\t\t\tstruct ctlra_event_t *ev)')
+    out.append('{')
+    out.append('\tuint32_t n = 0;')
+    out.append('\tuint16_t v;')
+    for i, it in enumerate(items):
+        o = it['offset']
+        out.append('')
+        out.append('\tv = (buf[%d] | (buf[%d] << 8)) & 0x%x;'
+                   % (o, o + 1, it['mask'] & 0xffff))
+        out.append('\tif(v != values[%d]) {' % i)
+        out.append('\t\tvalues[%d] = v;' % i)
+        out.append('\t\tev[n++] = (struct ctlra_event_t) {')
+        out.append('\t\t\t.type = CTLRA_EVENT_SLIDER,')
+        out.append('\t\t\t.slider = {')
+        out.append('\t\t\t\t.id = %s,' % it['id'])
+        out.append('\t\t\t\t.value = v * (1 / %s.f)},' % it['range'])
+        out.append('\t\t};')
+        out.append('\t}')
+    out.append('\treturn n;')
+    out.append('}')
+    out.append('')
+
+
+def gen_bits(out, prefix, kind, items):
+    # group by byte, so unchanged bytes cost a single compare
+    by_offset = {}
+    for it in items:
+        by_offset.setdefault(it['offset'], []).append(it)
+
+    out.append('/* Decode the %ss by diffing against *prev*, the previous'
+               % kind)
+    out.append(' * report. Returns the number of events written to *ev* */')
+    out.append('static inline uint32_t')
+    out.append('%s_decode_%s(const uint8_t *buf, uint8_t *prev,'
+               % (prefix, kind if kind == 'grid' else kind + 's'))
+    out.append('\t\t\tstruct ctlra_event_t *ev)')
+    out.append('{')
+    out.append('\tuint32_t n = 0;')
+    out.append('\tuint8_t x;')
+    for o in sorted(by_offset):
+        out.append('')
+        out.append('\tx = buf[%d] ^ prev[%d];' % (o, o))
+        out.append('\tif(x) {')
+        out.append('\t\tprev[%d] = buf[%d];' % (o, o))
+        for it in by_offset[o]:
+            m = it['mask']
+            out.append('\t\tif(x & 0x%02x)' % m)
+            if kind == 'button':
+                out.append('\t\t\tev[n++] = (struct ctlra_event_t) {')
+                out.append('\t\t\t\t.type = CTLRA_EVENT_BUTTON,')
+                out.append('\t\t\t\t.button = {')
+                out.append('\t\t\t\t\t.id = %s,' % it['id'])
+                out.append('\t\t\t\t\t.pressed = (buf[%d] & 0x%02x) != 0},'
+                           % (o, m))
+            else:
+                out.append('\t\t\tev[n++] = (struct ctlra_event_t) {')
+                out.append('\t\t\t\t.type = CTLRA_EVENT_GRID,')
+                out.append('\t\t\t\t.grid = {')
+                out.append('\t\t\t\t\t.flags = CTLRA_EVENT_GRID_FLAG_BUTTON,')
+                out.append('\t\t\t\t\t.pos = %s,' % it['id'])
+                out.append('\t\t\t\t\t.pressed = (buf[%d] & 0x%02x) != 0},'
+                           % (o, m))
+            out.append('\t\t\t};')
+        out.append('\t}')
+    out.append('\treturn n;')
+    out.append('}')
+    out.append('')
+
+
+def generate(layout, src):
+    prefix = layout['prefix']
+    upper = prefix.upper()
+    guard = 'OPENAV_CTLRA_%s_LAYOUT_H' % upper
+    out = ['/* Generated by gen_layout.py from %s, do not edit */' % src,
+           '',
+           '#ifndef %s' % guard,
+           '#define %s' % guard,
+           '',
+           '#define %s_REPORT_SIZE (%s)' % (upper, layout['report'])]
+    for kind, size in (('slider', 'SLIDERS'), ('button', 'BUTTONS'),
+                       ('grid', 'GRID')):
+        out.append('#define %s_%s_SIZE (%d)'
+                   % (upper, size, len(layout[kind])))
+    out.append('')
+
+    for kind in ('slider', 'button'):
+        if layout[kind]:
+            gen_names(out, prefix, kind, layout[kind])
+            gen_info(out, prefix, kind, layout[kind])
+    if layout['slider']:
+        gen_sliders(out, prefix, layout['slider'])
+    for kind in ('button', 'grid'):
+        if layout[kind]:
+            gen_bits(out, prefix, kind, layout[kind])
+
+    out.append('#endif /* %s */' % guard)
+    return '\n'.join(out) + '\n'
+
+
+def main():
+    if len(sys.argv) != 3:
+        sys.exit('usage: %s <input.layout> <output.h>' % sys.argv[0])
+    layout = parse(sys.argv[1])
+    src = sys.argv[1].replace('\\', '/').split('/')[-1]
+    with open(sys.argv[2], 'w') as f:
+        f.write(generate(layout, src))
+
+
+if __name__ == '__main__':
+    main()
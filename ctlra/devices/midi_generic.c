@@ -36,9 +36,12 @@
 
 #include "impl.h"
 #include "midi.h"
+#include "led_shadow.h"
 
 #define CONTROLS_SIZE 512
 #define LIGHTS_SIZE 512
+/* light ids are note numbers */
+#define NOTES_SIZE 128
 
 #define GENERIC 0x1
 
@@ -51,6 +54,9 @@ struct midi_generic_t {
 	struct ctlra_dev_t base;
 	/* midi i/o */
 	struct ctlra_midi_t *midi;
+	/* velocity of each note, written out on flush */
+	uint8_t notes[NOTES_SIZE];
+	struct ctlra_led_shadow_t leds;
 };
 
 static uint32_t
@@ -58,6 +64,8 @@ midi_generic_poll(struct ctlra_dev_t *base)
 {
 	struct midi_generic_t *dev = (struct midi_generic_t *)base;
 	ctlra_midi_input_poll(dev->midi);
+	/* raw messages written since the last iteration */
+	ctlra_midi_output_flush(dev->midi);
 	return 0;
 }
 
@@ -77,6 +85,7 @@ midi_generic_midi_input_cb(uint8_t nbytes, uint8_t * buf, void *ud)
 				.has_pressure = 1,
 				.pressure = buf[2] / 127.f,
 			},
+			.timestamp = ctlra_midi_input_time(dev->midi),
 		};
 		struct ctlra_event_t *e = {&event};
 		dev->base.event_func(&dev->base, 1, &e,
@@ -90,6 +99,7 @@ midi_generic_midi_input_cb(uint8_t nbytes, uint8_t * buf, void *ud)
 				.id = buf[1],
 				.value = buf[2] / 127.f
 			},
+			.timestamp = ctlra_midi_input_time(dev->midi),
 		};
 		struct ctlra_event_t *e = {&event};
 		dev->base.event_func(&dev->base, 1, &e,
@@ -114,30 +124,61 @@ static void midi_generic_light_set(struct ctlra_dev_t *base,
 {
 	struct midi_generic_t *dev = (struct midi_generic_t *)base;
 
-	uint8_t out[3];
-
+	/* raw messages are passed through as is */
 	if(light_id == -1) {
+		uint8_t out[3];
 		out[2] = (light_status >> 16) & 0xff;
 		out[1] = (light_status >>  8) & 0xff;
 		out[0] = (light_status >>  0) & 0xff;
-	} else {
-		uint8_t b3 = 0;
-		b3 |= light_status >> 24;
-		b3 |= light_status >> 16;
-		b3 |= light_status >>  8;
-
-		out[0] = 0x90;
-		out[1] = light_id;
-		out[2] = b3;
+		ctlra_midi_output_write(dev->midi, 3, out);
+		return;
+	}
+
+	if(light_id >= NOTES_SIZE) {
+		CTLRA_WARN(base->ctlra_context,
+			   "light id %u is not a note number\n", light_id);
+		return;
 	}
 
-	ctlra_midi_output_write(dev->midi, 3, out);
+	uint8_t b3 = 0;
+	b3 |= light_status >> 24;
+	b3 |= light_status >> 16;
+	b3 |= light_status >>  8;
+	if(dev->notes[light_id] == b3)
+		return;
+	dev->notes[light_id] = b3;
+	/* sent by the next idle iter if the app does not flush first */
+	base->light_flush_pending = 1;
 }
 
 void
 midi_generic_light_flush(struct ctlra_dev_t *base, uint32_t force)
 {
 	struct midi_generic_t *dev = (struct midi_generic_t *)base;
+	struct ctlra_led_report_t *r = &dev->leds.reports[0];
+	uint32_t first, end;
+
+	if(force)
+		ctlra_led_shadow_invalidate(&dev->leds);
+	if(!ctlra_led_shadow_dirty(&dev->leds, 0, &first, &end))
+		return;
+
+	/* one note on for each note that changed, using running status
+	 * after the first, and sent in one write */
+	uint8_t status = 0;
+	for(uint32_t i = first; i < end; i++) {
+		if(r->valid && r->data[i] == r->sent[i])
+			continue;
+		uint8_t out[3] = {0x90, i, r->data[i]};
+		int skip = status == 0x90;
+		status = 0x90;
+		if(ctlra_midi_output_write(dev->midi, 3 - skip,
+					   &out[skip]) < 0)
+			return;
+	}
+	if(ctlra_midi_output_flush(dev->midi) < 0)
+		return;
+	ctlra_led_shadow_commit(&dev->leds, 0);
 }
 
 static int32_t
@@ -160,12 +201,22 @@ ctlra_midi_generic_connect(ctlra_event_func event_func, void *userdata,
 	if(!dev)
 		goto fail;
 
-	dev->midi = ctlra_midi_open("Ctlra Generic",
-				    midi_generic_midi_input_cb, dev);
+	/* a hardware device can be used directly, bypassing the
+	 * sequencer: eg CTLRA_MIDI_GENERIC_RAWMIDI=hw:1,0,0 */
+	char *rawmidi = getenv("CTLRA_MIDI_GENERIC_RAWMIDI");
+	if(rawmidi)
+		dev->midi = ctlra_midi_open_raw(rawmidi,
+						midi_generic_midi_input_cb,
+						dev);
+	else
+		dev->midi = ctlra_midi_open("Ctlra Generic",
+					    midi_generic_midi_input_cb, dev);
 	if(dev->midi == 0) {
 		printf("Ctlra: error opening midi i/o\n");
 		goto fail;
 	}
+	/* drained in poll and light flush */
+	ctlra_midi_output_buffered(dev->midi, 256);
 
 	dev->base.info = ctlra_midi_generic_info;
 
@@ -177,6 +228,10 @@ ctlra_midi_generic_connect(ctlra_event_func event_func, void *userdata,
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
+	ctlra_led_shadow_init(&dev->leds);
+	ctlra_led_shadow_add(&dev->leds, dev->notes, NOTES_SIZE);
+	dev->base.leds = &dev->leds;
+
 	return (struct ctlra_dev_t *)dev;
 fail:
 	free(dev);
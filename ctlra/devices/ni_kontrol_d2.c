@@ -36,6 +36,7 @@
 
 #include "ni_kontrol_d2.h"
 #include "impl.h"
+#include "report_diff.h"
 
 #define CTLRA_DRIVER_VENDOR       (0x17cc)
 #define CTLRA_DRIVER_DEVICE       (0x1400)
@@ -153,7 +154,7 @@ static const char *ni_kontrol_d2_encoder_names[] = {
 /* Sliders are calulated on the fly, not using pre-set bitmasks */
 #define SLIDERS_SIZE (12)
 
-static const struct ni_kontrol_d2_ctlra_t buttons[] = {
+static const struct ctlra_report_diff_ctlra_t buttons[] = {
 	{NI_KONTROL_D2_BTN_DECK_A  , 5, 0x01},
 	{NI_KONTROL_D2_BTN_DECK_B  , 5, 0x02},
 	{NI_KONTROL_D2_BTN_DECK_C  , 5, 0x04},
@@ -283,6 +284,8 @@ struct ni_kontrol_d2_t {
 	struct ctlra_dev_t base;
 	/* current value of each controller is stored here */
 	float hw_values[CONTROLS_SIZE];
+	/* previous button report, for diff decoding */
+	struct ctlra_report_diff_t btn_diff;
 
 	/* track the touch of the touchstrip seperatly, so we can send
 	 * a button-event when a the touch-strip is pressed/released. The
@@ -402,26 +405,20 @@ void ni_kontrol_d2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 	}
 
 	case 17: {
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
-			int id     = buttons[i].event_id;
-			int offset = buttons[i].buf_byte_offset;
-			int mask   = buttons[i].mask;
-			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-			int value_idx = SLIDERS_SIZE + i;
-
-			if(dev->hw_values[value_idx] != v) {
-				dev->hw_values[value_idx] = v;
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_BUTTON,
-					.button  = {
-						.id = id,
-						.pressed = v > 0
-					},
-				};
-				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
-			}
+		struct ctlra_report_diff_change_t changes[BUTTONS_SIZE];
+		uint32_t nchanges = ctlra_report_diff_process(&dev->btn_diff,
+						buf, size, changes, BUTTONS_SIZE);
+		for(uint32_t i = 0; i < nchanges; i++) {
+			struct ctlra_event_t event = {
+				.type = CTLRA_EVENT_BUTTON,
+				.button  = {
+					.id = buttons[changes[i].idx].event_id,
+					.pressed = changes[i].pressed
+				},
+			};
+			struct ctlra_event_t *e = {&event};
+			dev->base.event_func(&dev->base, 1, &e,
+					     dev->base.event_func_userdata);
 		}
 		/* Browse / Loop Encoders */
 		struct ctlra_event_t event = {
@@ -712,19 +709,30 @@ ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
 	if(!dev)
 		goto fail;
 
+	/* a table entry that does not fit is a driver bug */
+	int err = ctlra_report_diff_add_table(&dev->btn_diff, buttons,
+					      BUTTONS_SIZE);
+	if(err) {
+		CTLRA_ERROR(dev->base.ctlra_context,
+			    "button table error %d\n", err);
+		goto fail;
+	}
+
 	snprintf(dev->base.info.vendor, sizeof(dev->base.info.vendor),
 	         "%s", "Native Instruments");
 	snprintf(dev->base.info.device, sizeof(dev->base.info.device),
 	         "%s", "Kontrol D2");
 
 	/* Open buttons / leds handle */
-	int err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
+	err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
 					  CTLRA_DRIVER_DEVICE);
 	if(err) {
 		//printf("%s: failed to open button usb interface\n", __func__);
 		goto fail;
 	}
 
+	/* the HID interface uses hidraw on uhid devices of the rig */
+	dev->base.usb_hidraw = CTLRA_USB_HIDRAW_VIRTUAL;
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 	                                        USB_INTERFACE_BTNS,
 	                                        USB_INTERFACE_BTNS);
@@ -733,6 +741,7 @@ ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
 		goto fail;
 	}
 
+	dev->base.usb_hidraw = CTLRA_USB_HIDRAW_OFF;
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 	                                        USB_INTERFACE_SCREEN,
 	                                        USB_INTERFACE_SCREEN);
@@ -756,6 +765,7 @@ ctlra_ni_kontrol_d2_connect(ctlra_event_func event_func,
 	dev->base.disconnect = ni_kontrol_d2_disconnect;
 	dev->base.light_set = ni_kontrol_d2_light_set;
 	dev->base.light_flush = ni_kontrol_d2_light_flush;
+
 	dev->base.usb_read_cb = ni_kontrol_d2_usb_read_cb;
 	dev->base.screen_get_data = ni_kontrol_d2_screen_get_data;
 
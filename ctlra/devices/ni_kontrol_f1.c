@@ -36,6 +36,8 @@
 
 #include "ni_kontrol_f1.h"
 #include "impl.h"
+#include "colour.h"
+#include "led_shadow.h"
 
 #define CTLRA_DRIVER_VENDOR (0x17cc)
 #define CTLRA_DRIVER_DEVICE (0x1120)
@@ -44,129 +46,31 @@
 #define USB_ENDPOINT_READ  (0x81)
 #define USB_ENDPOINT_WRITE (0x01)
 
-/* This struct is a generic struct to identify hw controls */
-struct ni_kontrol_f1_ctlra_t {
-	int event_id;
-	int buf_byte_offset;
-	uint32_t mask;
-};
-
-static const char *ni_kontrol_f1_names_sliders[] = {
-	"Filter 1",
-	"Filter 2",
-	"Filter 3",
-	"Filter 4",
-	"Fader 1",
-	"Fader 2",
-	"Fader 3",
-	"Fader 4",
-};
-#define CONTROL_NAMES_SLIDERS_SIZE (sizeof(ni_kontrol_f1_names_sliders) /\
-				    sizeof(ni_kontrol_f1_names_sliders[0]))
-
-static const char *ni_kontrol_f1_names_buttons[] = {
-	"Shift",
-	"Reverse",
-	"Type",
-	"Size",
-	"Browse",
-	"Enc. Press",
-	"Stop 1",
-	"Stop 2",
-	"Stop 3",
-	"Stop 4",
-	"Sync",
-	"Quantize",
-	"Capture",
-};
-#define CONTROL_NAMES_BUTTONS_SIZE (sizeof(ni_kontrol_f1_names_buttons) /\
-				    sizeof(ni_kontrol_f1_names_buttons[0]))
-#define CONTROL_NAMES_SIZE (CONTROL_NAMES_SLIDERS_SIZE + \
-			    CONTROL_NAMES_BUTTONS_SIZE)
-
-static const struct ni_kontrol_f1_ctlra_t sliders[] = {
-	/* Left */
-	{NI_KONTROL_F1_SLIDER_FILTER_1,  6, UINT32_MAX},
-	{NI_KONTROL_F1_SLIDER_FILTER_2,  8, UINT32_MAX},
-	{NI_KONTROL_F1_SLIDER_FILTER_3, 10, UINT32_MAX},
-	{NI_KONTROL_F1_SLIDER_FILTER_4, 12, UINT32_MAX},
-	{NI_KONTROL_F1_SLIDER_FADER_1 , 14, UINT32_MAX},
-	{NI_KONTROL_F1_SLIDER_FADER_2 , 16, UINT32_MAX},
-	{NI_KONTROL_F1_SLIDER_FADER_3 , 18, UINT32_MAX},
-	{NI_KONTROL_F1_SLIDER_FADER_4 , 20, UINT32_MAX},
-};
-#define SLIDERS_SIZE (sizeof(sliders) / sizeof(sliders[0]))
-
 #define DIAL_CENTER (CTLRA_ITEM_DIAL | CTLRA_ITEM_CENTER_NOTCH)
-static struct ctlra_item_info_t sliders_info[] = {
-	/* Filter dials up top */
-	{.x =  8, .y = 22, .w = 22, .h = 22, .flags = DIAL_CENTER},
-	{.x = 35, .y = 22, .w = 22, .h = 22, .flags = DIAL_CENTER},
-	{.x = 62, .y = 22, .w = 22, .h = 22, .flags = DIAL_CENTER},
-	{.x = 90, .y = 22, .w = 22, .h = 22, .flags = DIAL_CENTER},
-	/* sliders */
-	{.x =  8, .y = 56, .w = 22, .h = 56, .flags = CTLRA_ITEM_FADER},
-	{.x = 35, .y = 56, .w = 22, .h = 56, .flags = CTLRA_ITEM_FADER},
-	{.x = 62, .y = 56, .w = 22, .h = 56, .flags = CTLRA_ITEM_FADER},
-	{.x = 90, .y = 56, .w = 22, .h = 56, .flags = CTLRA_ITEM_FADER},
-};
-
-static const struct ni_kontrol_f1_ctlra_t buttons[] = {
-	{NI_KONTROL_F1_BTN_SHIFT        , 3, 0x80},
-	{NI_KONTROL_F1_BTN_REVERSE      , 3, 0x40},
-	{NI_KONTROL_F1_BTN_TYPE         , 3, 0x20},
-	{NI_KONTROL_F1_BTN_SIZE         , 3, 0x10},
-	{NI_KONTROL_F1_BTN_BROWSE       , 3, 0x08},
-	{NI_KONTROL_F1_BTN_ENCODER_PRESS, 3, 0x04},
-	{NI_KONTROL_F1_BTN_STOP_1       , 4, 0x80},
-	{NI_KONTROL_F1_BTN_STOP_2       , 4, 0x40},
-	{NI_KONTROL_F1_BTN_STOP_3       , 4, 0x20},
-	{NI_KONTROL_F1_BTN_STOP_4       , 4, 0x10},
-	{NI_KONTROL_F1_BTN_SYNC         , 4, 0x08},
-	{NI_KONTROL_F1_BTN_QUANT        , 4, 0x04},
-	{NI_KONTROL_F1_BTN_CAPTURE      , 4, 0x02},
-};
-#define BUTTONS_SIZE (sizeof(buttons) / sizeof(buttons[0]))
-
 #define F1_BTN (CTLRA_ITEM_BUTTON | CTLRA_ITEM_LED_INTENSITY | CTLRA_ITEM_HAS_FB_ID)
-static struct ctlra_item_info_t buttons_info[] = {
-	/* shift */
-	{.x =   8, .y = 147, .w = 16,  .h = 8, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 19},
-	/* reverse, type, size */
-	{.x =  30, .y = 147, .w = 16,  .h = 8, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 18},
-	{.x =  52, .y = 147, .w = 16,  .h = 8, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 17},
-	{.x =  74, .y = 147, .w = 16,  .h = 8, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 16},
-	/* browse */
-	{.x =  96, .y = 147, .w = 16,  .h = 8, .flags = F1_BTN, .colour = 0x000000ff, .fb_id = 15},
-	/* enc press */
-	{.x =  96, .y = 126, .w = 16,  .h = 16, .flags = CTLRA_ITEM_BUTTON},
-	/* stop left -> right */
-	{.x =  8, .y = 260, .w = 22,  .h = 6, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 42},
-	{.x = 35, .y = 260, .w = 22,  .h = 6, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 41},
-	{.x = 62, .y = 260, .w = 22,  .h = 6, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 40},
-	{.x = 90, .y = 260, .w = 22,  .h = 6, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 39},
-	/* sync, quant, capture */
-	{.x =   8, .y = 126, .w = 16,  .h = 8, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 22},
-	{.x =  30, .y = 126, .w = 16,  .h = 8, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 21},
-	{.x =  52, .y = 126, .w = 16,  .h = 8, .flags = F1_BTN, .colour = 0xff000000, .fb_id = 20},
-};
 
-#define GRID_SIZE 16
+/* Names, item info and the report decoders are generated at build time
+ * from ni_kontrol_f1.layout */
+#include "ni_kontrol_f1_layout.h"
 
-#define CONTROLS_SIZE (SLIDERS_SIZE + BUTTONS_SIZE + GRID_SIZE)
+#define SLIDERS_SIZE NI_KONTROL_F1_SLIDERS_SIZE
+#define BUTTONS_SIZE NI_KONTROL_F1_BUTTONS_SIZE
+#define GRID_SIZE    NI_KONTROL_F1_GRID_SIZE
 
 /* Represents the the hardware device */
 struct ni_kontrol_f1_t {
 	/* base handles usb i/o etc */
 	struct ctlra_dev_t base;
-	/* current value of each controller is stored here */
-	float hw_values[CONTROLS_SIZE];
-	/* current state of the lights, only flush on dirty */
-	uint8_t lights_dirty;
+	/* current value of each slider is stored here */
+	uint16_t slider_values[SLIDERS_SIZE];
+	/* previous report, the grid and buttons are diffed against it */
+	uint8_t prev[NI_KONTROL_F1_REPORT_SIZE];
+	/* state of the lights last written, only flush changes */
+	struct ctlra_led_shadow_t leds;
 	uint8_t encoder;
 
 	/* LED SIZE is the number of bytes to the device */
-#define LED_SIZE 79
+#define LED_SIZE 80
 	uint8_t lights_interface;
 	uint8_t lights[LED_SIZE];
 };
@@ -177,11 +81,11 @@ ni_kontrol_f1_control_get_name(enum ctlra_event_type_t type,
 {
 	switch(type) {
 	case CTLRA_EVENT_SLIDER:
-		if(control >= CONTROL_NAMES_SLIDERS_SIZE)
+		if(control >= SLIDERS_SIZE)
 			return 0;
 		return ni_kontrol_f1_names_sliders[control];
 	case CTLRA_EVENT_BUTTON:
-		if(control >= CONTROL_NAMES_BUTTONS_SIZE)
+		if(control >= BUTTONS_SIZE)
 			return 0;
 		return ni_kontrol_f1_names_buttons[control];
 	case CTLRA_EVENT_ENCODER:
@@ -204,6 +108,18 @@ static uint32_t ni_kontrol_f1_poll(struct ctlra_dev_t *base)
 	return 0;
 }
 
+static inline void
+ni_kontrol_f1_send_events(struct ni_kontrol_f1_t *dev,
+			  struct ctlra_event_t *events, uint32_t n)
+{
+	if(!n)
+		return;
+	struct ctlra_event_t *e[n];
+	for(uint32_t i = 0; i < n; i++)
+		e[i] = &events[i];
+	dev->base.event_func(&dev->base, n, e,
+			     dev->base.event_func_userdata);
+}
 
 void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				uint8_t *data, uint32_t size)
@@ -212,26 +128,12 @@ void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 	uint8_t *buf = data;
 
 	switch(size) {
-	case 22: {
-		for(uint32_t i = 0; i < SLIDERS_SIZE; i++) {
-			int id     = sliders[i].event_id;
-			int offset = sliders[i].buf_byte_offset;
-			int mask   = sliders[i].mask;
-
-			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-			if(dev->hw_values[i] != v) {
-				dev->hw_values[i] = v;
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_SLIDER,
-					.slider  = {
-						.id = id,
-						.value = v / 4096.f},
-				};
-				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
-			}
-		}
+	case NI_KONTROL_F1_REPORT_SIZE: {
+		struct ctlra_event_t events[SLIDERS_SIZE];
+		uint32_t n = ni_kontrol_f1_decode_sliders(buf,
+							  dev->slider_values,
+							  events);
+		ni_kontrol_f1_send_events(dev, events, n);
 
 		/* encoder: uses 0xff bits, result is same with just 0xf,
 		 * so simplify the implementation to just 0xf */
@@ -254,74 +156,26 @@ void ni_kontrol_f1_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 		}
 
 		/* Grid */
-		static uint8_t grid_masks[] = {
-			0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01,
-			0x80, 0x40, 0x20, 0x10, 0x08, 0x04, 0x02, 0x01
-		};
-		for(uint32_t i = 0; i < GRID_SIZE; i++) {
-			int offset = 1 + i / 8;
-			int mask   = grid_masks[i];
-
-			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-			int value_idx = SLIDERS_SIZE + BUTTONS_SIZE + i;
-			if(dev->hw_values[value_idx] != v) {
-				dev->hw_values[value_idx] = v;
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_GRID,
-					.grid  = {
-						.id = 0,
-						.flags = CTLRA_EVENT_GRID_FLAG_BUTTON,
-						.pos = i,
-						.pressed = v > 0,
-					},
-				};
-				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
-			}
-		}
+		struct ctlra_event_t grid[GRID_SIZE];
+		n = ni_kontrol_f1_decode_grid(buf, dev->prev, grid);
+		ni_kontrol_f1_send_events(dev, grid, n);
 
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
-			int id     = buttons[i].event_id;
-			int offset = buttons[i].buf_byte_offset;
-			int mask   = buttons[i].mask;
-
-			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-			int value_idx = SLIDERS_SIZE + i;
-
-			if(dev->hw_values[value_idx] != v) {
-				dev->hw_values[value_idx] = v;
-
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_BUTTON,
-					.button  = {
-						.id = id,
-						.pressed = v > 0},
-				};
-				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
-			}
-		}
+		struct ctlra_event_t btns[BUTTONS_SIZE];
+		n = ni_kontrol_f1_decode_buttons(buf, dev->prev, btns);
+		ni_kontrol_f1_send_events(dev, btns, n);
 		break;
 		}
 	}
 }
 
-static void ni_kontrol_f1_light_set(struct ctlra_dev_t *base,
-				    uint32_t light_id,
-				    uint32_t light_status)
-{
-	struct ni_kontrol_f1_t *dev = (struct ni_kontrol_f1_t *)base;
-	int ret;
-
-	/* zero-th byte seems useless, so skip it :) */
-	light_id += 1;
-
 #define NUM_LED_IN (23 + 16 + 4)
-	if(!dev || light_id > NUM_LED_IN)
-		return;
 
+/* Converts and stores one light, light_id is the report byte and must
+ * be valid */
+static inline void ni_kontrol_f1_light_store(struct ni_kontrol_f1_t *dev,
+					     uint32_t light_id,
+					     uint32_t light_status)
+{
 	/* Lights:
 	 * 0 ..15: digit displays, 8 is * in the top left.
 	 * 16..23 Browse, Size, Type, Reverse, Shift, capture, quant, sync
@@ -332,20 +186,19 @@ static void ni_kontrol_f1_light_set(struct ctlra_dev_t *base,
 	uint32_t bright = (light_status >> 24) & 0x7F;
 	if(light_id < 24) {
 		dev->lights[light_id] = bright;
-		goto fin;
+		return;
 	};
 	/* pad buttons, 24 .. 71 */
 	if(light_id >= 24 && light_id < 40) {
-		uint32_t r      = (light_status >> 16) & 0x7F;
-		uint32_t g      = (light_status >>  8) & 0x7F;
-		uint32_t b      = (light_status >>  0) & 0x7F;
+		uint8_t r, g, b;
+		ctlra_colour_rgb7(light_status, &r, &g, &b);
 		/* amend ID to skip over red/green bytes per pad */
 		light_id += (light_id - 24) * 2;
 		/* Pads are BRG ordered */
 		dev->lights[light_id  ] = b;
 		dev->lights[light_id+1] = r;
 		dev->lights[light_id+2] = g;
-		goto fin;
+		return;
 	}
 	/* lowest buttons "double up" on bytes */
 	if(light_id >= 40) {
@@ -353,28 +206,45 @@ static void ni_kontrol_f1_light_set(struct ctlra_dev_t *base,
 		dev->lights[idx  ] = bright;
 		dev->lights[idx+1] = bright;
 	}
+}
+
+static void ni_kontrol_f1_light_set(struct ctlra_dev_t *base,
+				    uint32_t light_id,
+				    uint32_t light_status)
+{
+	struct ni_kontrol_f1_t *dev = (struct ni_kontrol_f1_t *)base;
 
-fin:
-	dev->lights_dirty = 1;
+	/* zero-th byte seems useless, so skip it :) */
+	light_id += 1;
+
+	if(!dev || light_id > NUM_LED_IN)
+		return;
+
+	ni_kontrol_f1_light_store(dev, light_id, light_status);
 }
 
-void
-ni_kontrol_f1_light_flush(struct ctlra_dev_t *base, uint32_t force)
+static void ni_kontrol_f1_lights_set_bulk(struct ctlra_dev_t *base,
+					  uint32_t first_id, uint32_t count,
+					  const uint32_t *colours)
 {
 	struct ni_kontrol_f1_t *dev = (struct ni_kontrol_f1_t *)base;
-	if(!dev->lights_dirty && !force)
+	uint32_t first = first_id + 1;
+
+	if(!dev || first > NUM_LED_IN)
 		return;
+	if(count > NUM_LED_IN + 1 - first)
+		count = NUM_LED_IN + 1 - first;
 
-	dev->lights_interface = 0x80;
-	uint8_t *data = &dev->lights_interface;
+	for(uint32_t i = 0; i < count; i++)
+		ni_kontrol_f1_light_store(dev, first + i, colours[i]);
+}
 
-	dev->lights[0] = 0x80;
-	int ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     data, 81);
-	if(ret < 0) {
-		//base->usb_xfer_counts[USB_XFER_ERROR]++;
-	}
+void
+ni_kontrol_f1_light_flush(struct ctlra_dev_t *base, uint32_t force)
+{
+	struct ni_kontrol_f1_t *dev = (struct ni_kontrol_f1_t *)base;
+	ctlra_led_shadow_flush(&dev->leds, base, USB_HANDLE_IDX,
+			       USB_ENDPOINT_WRITE, force);
 }
 
 static int32_t
@@ -412,6 +282,8 @@ ctlra_ni_kontrol_f1_connect(ctlra_event_func event_func, void *userdata,
 		return 0;
 	}
 
+	/* HID reports only, read and written on /dev/hidrawX */
+	dev->base.usb_hidraw = 1;
 	err = ctlra_dev_impl_usb_open_interface(&dev->base, USB_INTERFACE_ID, USB_HANDLE_IDX);
 	if(err) {
 		free(dev);
@@ -423,9 +295,18 @@ ctlra_ni_kontrol_f1_connect(ctlra_event_func event_func, void *userdata,
 	dev->base.poll = ni_kontrol_f1_poll;
 	dev->base.disconnect = ni_kontrol_f1_disconnect;
 	dev->base.light_set = ni_kontrol_f1_light_set;
+	dev->base.lights_set_bulk = ni_kontrol_f1_lights_set_bulk;
 	dev->base.light_flush = ni_kontrol_f1_light_flush;
+
 	dev->base.usb_read_cb = ni_kontrol_f1_usb_read_cb;
 
+	dev->lights_interface = 0x80;
+	dev->lights[0] = 0x80;
+	ctlra_led_shadow_init(&dev->leds);
+	ctlra_led_shadow_add(&dev->leds, &dev->lights_interface,
+			     LED_SIZE + 1);
+	dev->base.leds = &dev->leds;
+
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
@@ -445,9 +326,9 @@ struct ctlra_dev_info_t ctlra_ni_kontrol_f1_info = {
 
 	/* TODO: expose info */
 	.control_count[CTLRA_EVENT_BUTTON] = BUTTONS_SIZE,
-	.control_info[CTLRA_EVENT_BUTTON] = buttons_info,
+	.control_info[CTLRA_EVENT_BUTTON] = ni_kontrol_f1_buttons_info,
 	.control_count[CTLRA_EVENT_SLIDER] = SLIDERS_SIZE,
-	.control_info[CTLRA_EVENT_SLIDER] = sliders_info,
+	.control_info[CTLRA_EVENT_SLIDER] = ni_kontrol_f1_sliders_info,
 #if 0
 	.control_count[CTLRA_FEEDBACK_ITEM] = FEEDBACK_SIZE,
 	.control_info[CTLRA_FEEDBACK_ITEM] = feedback_info,
@@ -36,6 +36,8 @@
 
 #include "ni_kontrol_s2_mk2.h"
 #include "impl.h"
+#include "report_diff.h"
+#include "led_shadow.h"
 
 #define CTLRA_DRIVER_VENDOR (0x17cc)
 #define CTLRA_DRIVER_DEVICE (0x1320)
@@ -219,7 +221,7 @@ static struct ctlra_item_info_t sliders_info[] = {
 	{.x = 250, .y = 166, .w =  18, .h  = 18, .flags = DIAL_CENTER},
 };
 
-static const struct ni_kontrol_s2_mk2_ctlra_t buttons[] = {
+static const struct ctlra_report_diff_ctlra_t buttons[] = {
 	{NI_KONTROL_S2_MK2_BTN_DECKB_PLAY , 9, 0x01},
 	{NI_KONTROL_S2_MK2_BTN_DECKB_CUE  , 9, 0x02},
 	{NI_KONTROL_S2_MK2_BTN_DECKB_SYNC , 9, 0x04},
@@ -385,14 +387,16 @@ struct ni_kontrol_s2_mk2_t {
 	struct ctlra_dev_t base;
 	/* current value of each controller is stored here */
 	float hw_values[CONTROLS_SIZE];
+	/* previous button report, for diff decoding */
+	struct ctlra_report_diff_t btn_diff;
 	uint8_t jog_wheels[2];
 	uint8_t jog_wheels_value[2];
 	uint32_t jog_wheels_quadrant[2];
 	uint32_t jog_wheels_1024_value[2];
 	/* current values for stepped encoders */
 	uint8_t encoder_values[ENCODER_COUNT];
-	/* current state of the lights, only flush on dirty */
-	uint8_t lights_dirty;
+	/* state of the lights last written, only flush changes */
+	struct ctlra_led_shadow_t leds;
 
 	uint8_t lights_interface;
 	uint8_t lights[LED_COUNT];
@@ -490,27 +494,20 @@ void ni_kontrol_s2_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 			}
 		}
 
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
-			int id     = i;
-			int offset = buttons[i].buf_byte_offset;
-			int mask   = buttons[i].mask;
-
-			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-			int value_idx = SLIDERS_SIZE + i;
-
-			if(dev->hw_values[value_idx] != v) {
-				dev->hw_values[value_idx] = v;
-
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_BUTTON,
-					.button  = {
-						.id = id,
-						.pressed = v > 0},
-				};
-				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
-			}
+		struct ctlra_report_diff_change_t changes[BUTTONS_SIZE];
+		uint32_t nchanges = ctlra_report_diff_process(&dev->btn_diff,
+						buf, size, changes, BUTTONS_SIZE);
+		for(uint32_t i = 0; i < nchanges; i++) {
+			struct ctlra_event_t event = {
+				.type = CTLRA_EVENT_BUTTON,
+				.button  = {
+					.id = changes[i].idx,
+					.pressed = changes[i].pressed
+				},
+			};
+			struct ctlra_event_t *e = {&event};
+			dev->base.event_func(&dev->base, 1, &e,
+					     dev->base.event_func_userdata);
 		}
 		} break;
 
@@ -589,42 +586,14 @@ static void ni_kontrol_s2_mk2_light_set(struct ctlra_dev_t *base,
 	}
 	if(light_id >= 44 && light_id < 52)
 		dev->deck_lights[light_id - 36 + 16] = bright;
-
-	dev->lights_dirty = 1;
-	return ;
 }
 
 void
 ni_kontrol_s2_mk2_light_flush(struct ctlra_dev_t *base, uint32_t force)
 {
 	struct ni_kontrol_s2_mk2_t *dev = (struct ni_kontrol_s2_mk2_t *)base;
-	if(!dev->lights_dirty && !force)
-		return;
-	/* technically interface 3, testing showed 0 works but 3 doesnt */
-	uint8_t *data = &dev->lights_interface;
-
-	/* all normal single-colour (brightness) leds */
-	dev->lights_interface = 0x80;
-
-	int ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     data,
-						     LED_COUNT+1);
-	if(ret < 0) {
-		//printf("%s write failed!\n", __func__);
-	}
-
-	/* Cue / Remix slots, shift0sync-cue-play for both decks */
-	data = &dev->deck_lights_interface;
-	dev->deck_lights_interface = 0x81;
-	ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     data,
-						     LED_DECK_COUNT+1);
-	if(ret < 0) {
-		//printf("%s write failed!\n", __func__);
-	}
-
+	ctlra_led_shadow_flush(&dev->leds, base, USB_HANDLE_IDX,
+			       USB_ENDPOINT_WRITE, force);
 }
 
 static int32_t
@@ -655,9 +624,18 @@ ctlra_ni_kontrol_s2_mk2_connect(ctlra_event_func event_func,
 	if(!dev)
 		goto fail;
 
+	/* a table entry that does not fit is a driver bug */
+	int err = ctlra_report_diff_add_table(&dev->btn_diff, buttons,
+					      BUTTONS_SIZE);
+	if(err) {
+		CTLRA_ERROR(dev->base.ctlra_context,
+			    "button table error %d\n", err);
+		goto fail;
+	}
+
 	dev->base.info = ctlra_ni_kontrol_s2_mk2_info;
 
-	int err = ctlra_dev_impl_usb_open(&dev->base,
+	err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
 					  CTLRA_DRIVER_DEVICE);
 	if(err) {
@@ -676,8 +654,20 @@ ctlra_ni_kontrol_s2_mk2_connect(ctlra_event_func event_func,
 	dev->base.disconnect = ni_kontrol_s2_mk2_disconnect;
 	dev->base.light_set = ni_kontrol_s2_mk2_light_set;
 	dev->base.light_flush = ni_kontrol_s2_mk2_light_flush;
+
 	dev->base.usb_read_cb = ni_kontrol_s2_mk2_usb_read_cb;
 
+	/* all normal single-colour (brightness) leds on 0x80, cue / remix
+	 * slots and shift-sync-cue-play for both decks on 0x81 */
+	dev->lights_interface = 0x80;
+	dev->deck_lights_interface = 0x81;
+	ctlra_led_shadow_init(&dev->leds);
+	ctlra_led_shadow_add(&dev->leds, &dev->lights_interface,
+			     LED_COUNT + 1);
+	ctlra_led_shadow_add(&dev->leds, &dev->deck_lights_interface,
+			     LED_DECK_COUNT + 1);
+	dev->base.leds = &dev->leds;
+
 	dev->base.event_func = event_func;
 	dev->base.event_func_userdata = userdata;
 
@@ -36,6 +36,8 @@
 
 #include "ni_kontrol_x1_mk2.h"
 #include "impl.h"
+#include "report_diff.h"
+#include "led_shadow.h"
 
 #define CTLRA_DRIVER_VENDOR (0x17cc)
 #define CTLRA_DRIVER_DEVICE (0x1220)
@@ -212,7 +214,7 @@ static const struct ni_kontrol_x1_mk2_ctlra_t sliders[] = {
 };
 #define SLIDERS_SIZE (sizeof(sliders) / sizeof(sliders[0]))
 
-static const struct ni_kontrol_x1_mk2_ctlra_t buttons[] = {
+static const struct ctlra_report_diff_ctlra_t buttons[] = {
 	/* Top left buttons */
 	{NI_KONTROL_X1_MK2_BTN_LEFT_FX_1 , 19, 0x80},
 	{NI_KONTROL_X1_MK2_BTN_LEFT_FX_2 , 19, 0x40},
@@ -298,13 +300,15 @@ struct ni_kontrol_x1_mk2_t {
 	struct ctlra_dev_t base;
 	/* current value of each controller is stored here */
 	float hw_values[CONTROLS_SIZE];
+	/* previous button report, for diff decoding */
+	struct ctlra_report_diff_t btn_diff;
 
 	/* Encoders */
 	uint8_t encoder_values[3];
 	uint32_t touchstrip_value;
 
-	/* current state of the lights, only flush on dirty */
-	uint8_t lights_dirty;
+	/* state of the lights last written, only flush changes */
+	struct ctlra_led_shadow_t leds;
 
 	uint8_t lights_interface;
 	uint8_t lights[LIGHTS_SIZE];
@@ -401,27 +405,20 @@ void ni_kontrol_x1_mk2_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 			}
 		}
 
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
-			int id     = buttons[i].event_id;
-			int offset = buttons[i].buf_byte_offset;
-			int mask   = buttons[i].mask;
-
-			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-			int value_idx = SLIDERS_SIZE + i;
-
-			if(dev->hw_values[value_idx] != v) {
-				dev->hw_values[value_idx] = v;
-
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_BUTTON,
-					.button  = {
-						.id = id,
-						.pressed = v > 0},
-				};
-				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						dev->base.event_func_userdata);
-			}
+		struct ctlra_report_diff_change_t changes[BUTTONS_SIZE];
+		uint32_t nchanges = ctlra_report_diff_process(&dev->btn_diff,
+						buf, size, changes, BUTTONS_SIZE);
+		for(uint32_t i = 0; i < nchanges; i++) {
+			struct ctlra_event_t event = {
+				.type = CTLRA_EVENT_BUTTON,
+				.button  = {
+					.id = buttons[changes[i].idx].event_id,
+					.pressed = changes[i].pressed
+				},
+			};
+			struct ctlra_event_t *e = {&event};
+			dev->base.event_func(&dev->base, 1, &e,
+					     dev->base.event_func_userdata);
 		}
 
 		/* Handle touchstrip */
@@ -483,31 +480,14 @@ ni_kontrol_x1_mk2_light_set(struct ctlra_dev_t *base,
 	}
 
 	/* TODO: 7 digit displays, and touch strip leds to lights_81 */
-
-	dev->lights_dirty = 1;
 }
 
 static void
 ni_kontrol_x1_mk2_light_flush(struct ctlra_dev_t *base, uint32_t force)
 {
 	struct ni_kontrol_x1_mk2_t *dev = (struct ni_kontrol_x1_mk2_t *)base;
-	if(!dev->lights_dirty && !force)
-		return;
-
-	uint8_t *data = &dev->lights_interface;
-	dev->lights_interface = 0x80;
-	const uint32_t size = LIGHTS_SIZE + 1;
-	ctlra_dev_impl_usb_interrupt_write(base,
-					   USB_HANDLE_IDX,
-					   USB_ENDPOINT_WRITE,
-					   data, size);
-
-	dev->lights_81[0] = 0x81;
-	ctlra_dev_impl_usb_interrupt_write(base,
-					   USB_HANDLE_IDX,
-					   USB_ENDPOINT_WRITE,
-					   dev->lights_81,
-					   IFACE_Ox81_TOTAL);
+	ctlra_led_shadow_flush(&dev->leds, base, USB_HANDLE_IDX,
+			       USB_ENDPOINT_WRITE, force);
 }
 
 void ni_kontrol_x1_mk2_feedback_digits(struct ctlra_dev_t *base,
@@ -586,7 +566,7 @@ ni_kontrol_x1_mk2_disconnect(struct ctlra_dev_t *base)
 
 	/* Turn off all lights */
 	memset(dev->lights, 0, NI_KONTROL_X1_MK2_LED_COUNT);
-	memset(dev->lights_81, 0, sizeof(dev->lights_81));
+	memset(&dev->lights_81[1], 0, sizeof(dev->lights_81) - 1);
 	if(!base->banished)
 		ni_kontrol_x1_mk2_light_flush(base, 1);
 
@@ -608,7 +588,17 @@ ctlra_ni_kontrol_x1_mk2_connect(ctlra_event_func event_func,
 	if(!dev)
 		return 0;
 
-	int err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
+	/* a table entry that does not fit is a driver bug */
+	int err = ctlra_report_diff_add_table(&dev->btn_diff, buttons,
+					      BUTTONS_SIZE);
+	if(err) {
+		CTLRA_ERROR(dev->base.ctlra_context,
+			    "button table error %d\n", err);
+		free(dev);
+		return 0;
+	}
+
+	err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
 					  CTLRA_DRIVER_DEVICE);
 	if(err) {
 		free(dev);
@@ -629,6 +619,7 @@ ctlra_ni_kontrol_x1_mk2_connect(ctlra_event_func event_func,
 	dev->base.disconnect = ni_kontrol_x1_mk2_disconnect;
 	dev->base.light_set = ni_kontrol_x1_mk2_light_set;
 	dev->base.light_flush = ni_kontrol_x1_mk2_light_flush;
+
 	dev->base.usb_read_cb = ni_kontrol_x1_mk2_usb_read_cb;
 	dev->base.feedback_digits = ni_kontrol_x1_mk2_feedback_digits;
 
@@ -646,6 +637,15 @@ ctlra_ni_kontrol_x1_mk2_connect(ctlra_event_func event_func,
 		dev->lights_81[j+1] = 0x0; /* blue */
 	}
 
+	/* buttons on 0x80, digits and touchstrip on 0x81 */
+	dev->lights_interface = 0x80;
+	dev->lights_81[0] = 0x81;
+	ctlra_led_shadow_init(&dev->leds);
+	ctlra_led_shadow_add(&dev->leds, &dev->lights_interface,
+			     LIGHTS_SIZE + 1);
+	ctlra_led_shadow_add(&dev->leds, dev->lights_81, IFACE_Ox81_TOTAL);
+	dev->base.leds = &dev->leds;
+
 	return (struct ctlra_dev_t *)dev;
 }
 
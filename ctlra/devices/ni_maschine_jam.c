@@ -29,6 +29,7 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdint.h>
@@ -36,6 +37,9 @@
 #include <unistd.h>
 
 #include "impl.h"
+#include "report_diff.h"
+#include "led_shadow.h"
+#include "colour.h"
 #include "ni_maschine_jam.h"
 
 #define CTLRA_DRIVER_VENDOR (0x17cc)
@@ -273,7 +277,7 @@ enum BTN_T {
 	NI_MASCHINE_JAM_BTN_COUNT
 };
 
-static const struct ni_maschine_jam_ctlra_t buttons[] = {
+static const struct ctlra_report_diff_ctlra_t buttons[] = {
 	{NI_MASCHINE_JAM_BTN_SONG       , 2, 0x01},
 	{NI_MASCHINE_JAM_BTN_STEP       , 3, 0x02},
 	{NI_MASCHINE_JAM_BTN_PAD_MODE   , 3, 0x04},
@@ -356,21 +360,30 @@ struct ni_maschine_jam_t {
 	/* base handles usb i/o etc */
 	struct ctlra_dev_t base;
 
-	/* the hidraw file descriptor */
-	int fd;
-
 	/* current value of each controller is stored here */
 	float hw_values[CONTROLS_SIZE];
-	/* current state of the lights, only flush on dirty */
-	uint8_t lights_dirty;
+	/* previous button report, for diff decoding */
+	struct ctlra_report_diff_t btn_diff;
+	/* state of the lights last written, only flush changes */
+	struct ctlra_led_shadow_t leds;
+	int32_t leds_buttons;
+	int32_t leds_grid;
+	int32_t leds_touchstrips;
 
 	uint8_t encoder;
 
 	uint8_t lights_interface;
 	uint8_t lights[NI_MASCHINE_JAM_LED_COUNT*2];
 
+	/* grid LED report: id, top lights, pads, bottom lights */
 	uint8_t grid[GRID_SIZE];
+	/* pressed state of the pads, kept apart from the LED report */
+	uint8_t pad_state[64];
 	uint8_t touchstrips[TOUCHSTRIP_LEDS_SIZE];
+	/* single and double touch of each strip, rendered to the
+	 * touchstrip LEDs on flush for strips in touch_dirty */
+	uint16_t touch[8][2];
+	uint8_t touch_dirty;
 };
 
 static const char *
@@ -428,6 +441,26 @@ ni_maschine_jam_touchstrip_led(struct ctlra_dev_t *base,
 		dev->touchstrips[1+touchstrip_id*11+i] = values[i];
 }
 
+/* Light the touched strips up to their touch points */
+static void
+ni_maschine_jam_touchstrips_render(struct ni_maschine_jam_t *dev)
+{
+	for(int s = 0; s < 8; s++) {
+		if(!(dev->touch_dirty & (1 << s)))
+			continue;
+
+		float f1 = dev->touch[s][0] / 1023.f;
+		float f2 = dev->touch[s][1] / 1023.f;
+		uint8_t lights[11] = {0};
+		for(int i = 0; i < 11; i++)
+			lights[i] = (11 * f1 > i) * 30;
+		for(int i = 11 * f1; i < 11; i++)
+			lights[i] = (11 * f2 > i) * 20;
+		ni_maschine_jam_touchstrip_led(&dev->base, s, lights);
+	}
+	dev->touch_dirty = 0;
+}
+
 void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				uint8_t *data, uint32_t size)
 {
@@ -469,19 +502,17 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				//printf("%d\t%d\t%d\n", ts, t1, t2);
 				e->slider.id    = i;
 				e->slider.value = t1 / 1023.f;
-				float f2 = t2 / 1023.f;
 				dev->hw_values[offset  ] = ts;
 				dev->hw_values[offset+1] = t1;
 				dev->hw_values[offset+2] = t2;
 				dev->base.event_func(&dev->base, 1, &e,
 						     dev->base.event_func_userdata);
 
-				uint8_t lights[11] = {0};
-				for(int i = 0; i < 11; i++)
-					lights[i] = (11 * e->slider.value > i) * 30;
-				for(int i = 11 * e->slider.value; i < 11; i++)
-					lights[i] = (11 * f2 > i) * 20;
-				ni_maschine_jam_touchstrip_led(base, i, lights);
+				/* LEDs follow the touch, drawn on flush */
+				dev->touch[i][0] = t1;
+				dev->touch[i][1] = t2;
+				dev->touch_dirty |= 1 << i;
+				dev->base.light_flush_pending = 1;
 			}
 		}
 		break;
@@ -513,8 +544,8 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 			/* columns */
 			for(int c = 0; c < 6; c++) {
 				uint8_t p = d & col_mask[c];
-				if(p != dev->grid[r*8+c]) {
-					dev->grid[r*8+c] = p;
+				if(p != dev->pad_state[r*8+c]) {
+					dev->pad_state[r*8+c] = p;
 					e->grid.pos = (r * 8) + c;
 					e->grid.pressed = p;
 					printf("%d %d = %d\n", r, c, p > 0);
@@ -523,18 +554,18 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 				}
 			}
 			uint8_t p = data[4+1+r] & 0x1;
-			if(p != dev->grid[r*8+6]) {
+			if(p != dev->pad_state[r*8+6]) {
 				e->grid.pos = (r * 8) + 6;
 				e->grid.pressed = p;
-				dev->grid[r*8+6] = p;
+				dev->pad_state[r*8+6] = p;
 				printf("%d %d = %d\n", r, 6, p);
 				dev->base.event_func(&dev->base, 1, &e,
 						     dev->base.event_func_userdata);
 			}
 			p = data[4+1+r] & 0x2;
-			if(p != dev->grid[r*8+7]) {
+			if(p != dev->pad_state[r*8+7]) {
 				printf("%d %d = %d\n", r, 7, p);
-				dev->grid[r*8+7] = p;
+				dev->pad_state[r*8+7] = p;
 				e->grid.pressed = p;
 				e->grid.pos = (r * 8) + 7;
 				dev->base.event_func(&dev->base, 1, &e,
@@ -543,38 +574,20 @@ void ni_machine_jam_usb_read_cb(struct ctlra_dev_t *base, uint32_t endpoint,
 		}
 
 		/* buttons */
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
-			int id     = buttons[i].event_id;
-			int offset = buttons[i].buf_byte_offset;
-			int mask   = buttons[i].mask;
-
-			uint16_t v = *((uint16_t *)&data[offset]) & mask;
-			int value_idx = SLIDERS_SIZE + i;
-
-			if(dev->hw_values[value_idx] != v) {
-				dev->hw_values[value_idx] = v;
-
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_BUTTON,
-					.button  = {
-						.id = id,
-						.pressed = v > 0},
-				};
-				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
-
-#if 0
-				/* debug surrounding lights */
-				something_presssed = !something_presssed;
-				int col = 0x30 * something_presssed;
-				if(value_idx == 0)
-					col = 0xe;
-				for(int i = 0; i < 86; i++)
-					dev->lights[i] = col;
-				ni_maschine_jam_light_flush(base, 1);
-#endif
-			}
+		struct ctlra_report_diff_change_t changes[BUTTONS_SIZE];
+		uint32_t nchanges = ctlra_report_diff_process(&dev->btn_diff,
+						data, size, changes, BUTTONS_SIZE);
+		for(uint32_t i = 0; i < nchanges; i++) {
+			struct ctlra_event_t event = {
+				.type = CTLRA_EVENT_BUTTON,
+				.button  = {
+					.id = buttons[changes[i].idx].event_id,
+					.pressed = changes[i].pressed
+				},
+			};
+			struct ctlra_event_t *e = {&event};
+			dev->base.event_func(&dev->base, 1, &e,
+					     dev->base.event_func_userdata);
 		}
 
 		/* encoder */
@@ -613,8 +626,29 @@ static void ni_maschine_jam_light_set(struct ctlra_dev_t *base,
 	uint32_t bright = (light_status >> 24) & 0x7F;
 /* base brightness */
 	dev->lights[light_id] = bright | 0x2;
+}
+
+/* RGB to palette hue, shared by all Jam devices */
+static struct ctlra_colour_lut_t ni_maschine_jam_colours;
+
+static int32_t
+ni_maschine_jam_grid_light_set(struct ctlra_dev_t *base, uint32_t grid_id,
+			       uint32_t light_id, uint32_t light_status)
+{
+	struct ni_maschine_jam_t *dev = (struct ni_maschine_jam_t *)base;
+	if(!dev || grid_id != 0 || light_id >= 64)
+		return -EINVAL;
 
-	dev->lights_dirty = 1;
+	/* palette hue in the top 6 bits, brightness in the low 2 */
+	uint8_t hue = ctlra_colour_lut_get(&ni_maschine_jam_colours,
+					   light_status);
+	uint8_t v = (hue << 2) | ((light_status >> 30) & 0x3);
+	if(light_status == 0)
+		v = 0;
+
+	/* 1st is usb endpoint, next 8 are top lights */
+	dev->grid[9 + light_id] = v;
+	return 0;
 }
 
 uint8_t *
@@ -625,15 +659,32 @@ ni_maschine_jam_grid_get_data(struct ctlra_dev_t *base)
 	return &dev->grid[9];
 }
 
+static int
+ni_maschine_jam_report_write(struct ni_maschine_jam_t *dev, int32_t report)
+{
+	struct ctlra_led_report_t *r = &dev->leds.reports[report];
+	int ret = ctlra_dev_impl_usb_interrupt_write(&dev->base, USB_HANDLE_IDX,
+						     USB_ENDPOINT_WRITE,
+						     r->data, r->size);
+	if(ret < 0)
+		printf("%s write 0x%02x failed, ret %d\n", __func__,
+		       r->data[0], ret);
+	/* dropped writes stay dirty, and retry on the next flush */
+	if(ret > 0)
+		ctlra_led_shadow_commit(&dev->leds, report);
+	return ret;
+}
+
 static void
 ni_maschine_jam_light_flush(struct ctlra_dev_t *base, uint32_t force)
 {
 	struct ni_maschine_jam_t *dev = (struct ni_maschine_jam_t *)base;
-	if(!dev->lights_dirty && !force)
-		return;
-	/* technically interface 3, testing showed 0 works but 3 doesnt */
-	uint8_t *data = &dev->lights_interface;
-	dev->lights_interface = 0x80;
+	if(force)
+		ctlra_led_shadow_invalidate(&dev->leds);
+
+	if(dev->touch_dirty)
+		ni_maschine_jam_touchstrips_render(dev);
+
 #ifdef NOPE
 	0x04 == dark red
 	0x06 == bright red
@@ -653,44 +704,22 @@ ni_maschine_jam_light_flush(struct ctlra_dev_t *base, uint32_t force)
 	82: touch leds
 #endif
 
-	int ret;
-
-	data[0] = 0x80;
-	ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     data,
-						     64+2);
-	if(ret < 0)
-		printf("%s write failed, ret %d\n", __func__, ret);
-
-	/* touchstrips */
-	dev->touchstrips[0] = 0x82;
-	ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     dev->touchstrips,
-						     88+2);
-	if(ret < 0)
-		printf("%s touchstrip write failed, ret %d\n", __func__, ret);
-
-	/* writing the LED button a *second time* (see above) allows grid
-	 * messages to work afterwards. If this 2nd button data is removed,
-	 * the grid message later is ignored for some reason */
-	data[0] = 0x80;
-	ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     data,
-						     64+2);
-	if(ret < 0)
-		printf("%s 2nd btn write failed, ret %d\n", __func__, ret);
-
-	/* grid */
-	dev->touchstrips[0] = 0x81;
-	ret = ctlra_dev_impl_usb_interrupt_write(base, USB_HANDLE_IDX,
-						     USB_ENDPOINT_WRITE,
-						     dev->touchstrips,
-						     79+2);
-	if(ret < 0)
-		printf("%s grid write failed, ret %d\n", __func__, ret);
+	int strips = ctlra_led_shadow_dirty(&dev->leds, dev->leds_touchstrips,
+					    0, 0);
+	int buttons = ctlra_led_shadow_dirty(&dev->leds, dev->leds_buttons,
+					     0, 0);
+	int grid = ctlra_led_shadow_dirty(&dev->leds, dev->leds_grid, 0, 0);
+
+	/* A grid message written after a touchstrip message is ignored,
+	 * unless the buttons message is written in between. Order the
+	 * writes so the buttons report sits in between, writing it even if
+	 * unchanged when both of the others are dirty. */
+	if(strips)
+		ni_maschine_jam_report_write(dev, dev->leds_touchstrips);
+	if(buttons || (strips && grid))
+		ni_maschine_jam_report_write(dev, dev->leds_buttons);
+	if(grid)
+		ni_maschine_jam_report_write(dev, dev->leds_grid);
 }
 
 static int32_t
@@ -700,8 +729,9 @@ ni_maschine_jam_disconnect(struct ctlra_dev_t *base)
 
 	/* Turn off all lights, flush and allow to retire */
 	memset(dev->lights, 0, sizeof(dev->lights));
-	memset(dev->grid, 0, sizeof(dev->grid));
-	memset(dev->touchstrips, 0, sizeof(dev->touchstrips));
+	memset(&dev->grid[1], 0, sizeof(dev->grid) - 1);
+	memset(&dev->touchstrips[1], 0, sizeof(dev->touchstrips) - 1);
+	dev->touch_dirty = 0;
 	if(!base->banished)
 		ni_maschine_jam_light_flush(base, 1);
 
@@ -722,11 +752,22 @@ ctlra_ni_maschine_jam_connect(ctlra_event_func event_func,
 	if(!dev)
 		goto fail;
 
-	int err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
+	/* a table entry that does not fit is a driver bug */
+	int err = ctlra_report_diff_add_table(&dev->btn_diff, buttons,
+					      BUTTONS_SIZE);
+	if(err) {
+		CTLRA_ERROR(dev->base.ctlra_context,
+			    "button table error %d\n", err);
+		goto fail;
+	}
+
+	err = ctlra_dev_impl_usb_open(&dev->base, CTLRA_DRIVER_VENDOR,
 					  CTLRA_DRIVER_DEVICE);
 	if(err)
 		goto fail;
 
+	/* HID reports only, read and written on /dev/hidrawX */
+	dev->base.usb_hidraw = 1;
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 					 USB_INTERFACE_ID, USB_HANDLE_IDX);
 	if(err)
@@ -737,7 +778,9 @@ ctlra_ni_maschine_jam_connect(ctlra_event_func event_func,
 	dev->base.poll = ni_maschine_jam_poll;
 	dev->base.disconnect = ni_maschine_jam_disconnect;
 	dev->base.light_set = ni_maschine_jam_light_set;
+	dev->base.grid_light_set = ni_maschine_jam_grid_light_set;
 	dev->base.light_flush = ni_maschine_jam_light_flush;
+
 	dev->base.usb_read_cb = ni_machine_jam_usb_read_cb;
 
 	dev->base.event_func = event_func;
@@ -748,6 +791,20 @@ ctlra_ni_maschine_jam_connect(ctlra_event_func event_func,
 		data[i] = 0x06;
 	}
 
+	/* report ids, see the light flush */
+	dev->lights_interface = 0x80;
+	dev->grid[0] = 0x81;
+	ctlra_colour_lut_init(&ni_maschine_jam_colours, ctlra_colour_ni_hue);
+	dev->touchstrips[0] = 0x82;
+	ctlra_led_shadow_init(&dev->leds);
+	dev->leds_buttons = ctlra_led_shadow_add(&dev->leds, data, 64+2);
+	dev->leds_grid = ctlra_led_shadow_add(&dev->leds, dev->grid,
+					      GRID_SIZE);
+	dev->leds_touchstrips = ctlra_led_shadow_add(&dev->leds,
+						     dev->touchstrips,
+						     TOUCHSTRIP_LEDS_SIZE);
+	dev->base.leds = &dev->leds;
+
 	return (struct ctlra_dev_t *)dev;
 fail:
 	free(dev);
@@ -792,7 +849,8 @@ struct ctlra_dev_info_t ctlra_ni_maschine_jam_info = {
 			.y = 39,
 			.w = 215,
 			.h = 100,
-			/* TODO: Figure out the light mappings */
+			/* the pads are not light ids, they are set
+			 * through grid_light_set */
 			/* start light id */
 			.params[0] = 255,
 			/* end light id */
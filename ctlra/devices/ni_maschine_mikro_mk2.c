@@ -47,6 +47,10 @@
 
 #include "ni_maschine_mikro_mk2.h"
 #include "impl.h"
+#include "colour.h"
+#include "report_diff.h"
+#include "pad_filter.h"
+#include "led_shadow.h"
 
 #define CTLRA_DRIVER_VENDOR (0x17cc)
 #define CTLRA_DRIVER_DEVICE (0x1200)
@@ -100,7 +104,7 @@ static const char *ni_maschine_mikro_mk2_control_names[] = {
 #define CONTROL_NAMES_SIZE (sizeof(ni_maschine_mikro_mk2_control_names) /\
 			    sizeof(ni_maschine_mikro_mk2_control_names[0]))
 
-static const struct ni_maschine_mikro_mk2_ctlra_t buttons[] = {
+static const struct ctlra_report_diff_ctlra_t buttons[] = {
 	{NI_MASCHINE_MIKRO_MK2_BTN_RESTART    , 1, 0x80},
 	{NI_MASCHINE_MIKRO_MK2_BTN_LEFT_ARROW , 1, 0x40},
 	{NI_MASCHINE_MIKRO_MK2_BTN_RIGHT_ARROW, 1, 0x20},
@@ -200,10 +204,9 @@ static struct ctlra_item_info_t feedback_info[] = {
 #define LIGHTS_SIZE (80)
 
 #define NPADS                  (16)
-/* KERNEL_LENGTH must be a power of 2 for masking */
-#define KERNEL_LENGTH          (8)
-#define KERNEL_MASK            (KERNEL_LENGTH-1)
 #define PAD_SENSITIVITY        (650)
+#define PAD_ON_THRES           (550)
+#define PAD_OFF_THRES          (100)
 /* Screen: 1 byte endpoint, 8 bytes header, 256 bytes binary data */
 #define SCREEN_XFER_SIZE (1 + 8 + 256)
 
@@ -214,8 +217,10 @@ struct ni_maschine_mikro_mk2_t {
 	struct ctlra_dev_t base;
 	/* current value of each controller is stored here */
 	float hw_values[CONTROLS_SIZE];
-	/* current state of the lights, only flush on dirty */
-	uint8_t lights_dirty;
+	/* previous button report, for diff decoding */
+	struct ctlra_report_diff_t btn_diff;
+	/* state of the lights last written, only flush changes */
+	struct ctlra_led_shadow_t leds;
 
 	/* Lights endpoint used to transfer with hidapi */
 	uint8_t lights_endpoint;
@@ -224,10 +229,7 @@ struct ni_maschine_mikro_mk2_t {
 	/* Store the current encoder value */
 	uint8_t encoder_value;
 	/* Pressure filtering for note-onset detection */
-	uint8_t pad_idx[NPADS];
-	uint16_t pads[NPADS];
-	uint16_t pad_avg[NPADS];
-	uint16_t pad_pressures[NPADS*KERNEL_LENGTH];
+	struct ctlra_pad_filter_t pad_filter;
 
 	uint8_t screen_data[SCREEN_XFER_SIZE*4];
 };
@@ -251,22 +253,6 @@ static uint32_t ni_maschine_mikro_mk2_poll(struct ctlra_dev_t *base)
 	return 0;
 }
 
-void
-ni_maschine_mikro_mk2_light_flush(struct ctlra_dev_t *base, uint32_t force);
-
-typedef uint16_t elem_type;
-
-int compare(const void *f1, const void *f2)
-{
-	return ( *(elem_type*)f1 > *(elem_type*)f2) ? 1 : -1;
-}
-
-elem_type qsort_median(elem_type * array, int n)
-{
-	qsort(array, n, sizeof(elem_type), compare);
-	return array[n/2];
-}
-
 void
 ni_maschine_mikro_mk2_usb_read_cb(struct ctlra_dev_t *base,
 				  uint32_t endpoint, uint8_t *data,
@@ -284,61 +270,50 @@ ni_maschine_mikro_mk2_usb_read_cb(struct ctlra_dev_t *base,
 
 		switch(nbytes) {
 		case 65: {
+			struct ctlra_pad_filter_t *f = &dev->pad_filter;
 			int i;
-			for (i = 0; i < NPADS; i++) {
-				uint16_t new = ((data[i*2+2] & 0xf) << 8) |
-						 data[i*2+1];
+			for (i = 0; i < NPADS; i++)
+				f->input[i] = ((data[i*2+2] & 0xf) << 8) |
+					      data[i*2+1];
 
-				uint8_t idx = dev->pad_idx[i]++ & KERNEL_MASK;
-
-				uint16_t total = 0;
-				for(int j = 0; j < KERNEL_LENGTH; j++) {
-					int idx = i*KERNEL_LENGTH + j;
-					total += dev->pad_pressures[idx];
-				}
-
-				dev->pad_avg[i] = total / KERNEL_LENGTH;
-				dev->pad_pressures[i*KERNEL_LENGTH + idx] = new;
-
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_GRID,
-					.grid  = {
-						.id = 0,
-						.flags = CTLRA_EVENT_GRID_FLAG_BUTTON,
-						.pos = i,
-						.pressed = 1
-					},
-				};
-				struct ctlra_event_t *e = {&event};
+			uint32_t hits, releases;
+			ctlra_pad_filter_process(f, &hits, &releases);
 
-				uint16_t med = qsort_median(
-					&dev->pad_pressures[i*KERNEL_LENGTH],
-					KERNEL_LENGTH);
+			struct ctlra_event_t event = {
+				.type = CTLRA_EVENT_GRID,
+				.grid  = {
+					.id = 0,
+					.flags = CTLRA_EVENT_GRID_FLAG_BUTTON,
+				},
+			};
+			struct ctlra_event_t *e = {&event};
 
-				if(med > 550 && dev->pads[i] == 0) {
+			for (i = 0; i < NPADS && (hits | releases); i++) {
+				uint32_t bit = 1 << i;
+				event.grid.pos = i;
+				if(hits & bit) {
 					/* TODO: improve velocity linearity */
-					float velo = (med - 550) / 3500.f;
+					float velo = (f->median[i] - PAD_ON_THRES) / 3500.f;
 					float v2 = velo * velo * velo * velo;
 					float fin = (velo - v2) * 3;
 					fin = fin > 1.0f ? 1.0f : fin;
 					fin = fin < 0.0f ? 0.0f : fin;
-					e->grid.pressure = fin;
+					event.grid.pressed = 1;
+					event.grid.pressure = fin;
 					dev->base.event_func(&dev->base, 1, &e,
 					                     dev->base.event_func_userdata);
 					dev->lights[NI_MASCHINE_MIKRO_MK2_LED_PAD_1+3+i*3] = 0x7f;
-					dev->lights_dirty = 1;
-					ni_maschine_mikro_mk2_light_flush(&dev->base, 1);
-					dev->pads[i] = 2000;
-				} else if(med < 100 && dev->pads[i] > 0) {
+					dev->base.light_flush_pending = 1;
+				} else if(releases & bit) {
 					dev->lights[NI_MASCHINE_MIKRO_MK2_LED_PAD_1+3+i*3] = 0;
-					dev->lights_dirty = 1;
-					ni_maschine_mikro_mk2_light_flush(&dev->base, 1);
-					dev->pads[i] = 0;
+					dev->base.light_flush_pending = 1;
 					event.grid.pressed = 0;
 					event.grid.pressure = 0.f;
 					dev->base.event_func(&dev->base, 1, &e,
 					                     dev->base.event_func_userdata);
 				}
+				hits &= ~bit;
+				releases &= ~bit;
 			}
 		}
 		break;
@@ -363,30 +338,20 @@ ni_maschine_mikro_mk2_usb_read_cb(struct ctlra_dev_t *base,
 			}
 
 			/* Buttons */
-			for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
-				int id     = buttons[i].event_id;
-				int offset = buttons[i].buf_byte_offset;
-				int mask   = buttons[i].mask;
-
-				uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-				int value_idx = i;
-
-				if(dev->hw_values[value_idx] != v) {
-					//printf("%s %d\n",
-					//ni_maschine_mikro_mk2_control_names[i], i);
-					dev->hw_values[value_idx] = v;
-
-					struct ctlra_event_t event = {
-						.type = CTLRA_EVENT_BUTTON,
-						.button  = {
-							.id = id,
-							.pressed = v > 0
-						},
-					};
-					struct ctlra_event_t *e = {&event};
-					dev->base.event_func(&dev->base, 1, &e,
-					                     dev->base.event_func_userdata);
-				}
+			struct ctlra_report_diff_change_t changes[BUTTONS_SIZE];
+			uint32_t nchanges = ctlra_report_diff_process(&dev->btn_diff,
+							buf, size, changes, BUTTONS_SIZE);
+			for(uint32_t i = 0; i < nchanges; i++) {
+				struct ctlra_event_t event = {
+					.type = CTLRA_EVENT_BUTTON,
+					.button  = {
+						.id = buttons[changes[i].idx].event_id,
+						.pressed = changes[i].pressed
+					},
+				};
+				struct ctlra_event_t *e = {&event};
+				dev->base.event_func(&dev->base, 1, &e,
+						     dev->base.event_func_userdata);
 			}
 			break;
 		}
@@ -400,28 +365,22 @@ ni_maschine_mikro_mk2_usb_read_cb(struct ctlra_dev_t *base,
 	} while (nbytes > 0);
 }
 
-static void ni_maschine_mikro_mk2_light_set(struct ctlra_dev_t *base,
-                uint32_t light_id,
-                uint32_t light_status)
-{
-	struct ni_maschine_mikro_mk2_t *dev = (struct ni_maschine_mikro_mk2_t *)base;
-	int ret;
-
-	if(!dev)
-		return;
-	if(light_id > LIGHTS_SIZE) {
-		return;
-	}
+/* highest light_id, the LED past the last pad */
+#define LIGHTS_MAX_ID (NI_MASCHINE_MIKRO_MK2_LED_PAD_1 + 16)
 
+/* Converts and stores one light, the light_id must be valid */
+static inline void
+ni_maschine_mikro_mk2_light_store(struct ni_maschine_mikro_mk2_t *dev,
+				  uint32_t light_id, uint32_t light_status)
+{
 	/* TODO: can we clean up the light_id handling somehow?
 	 * There's a lot of branching / strange math per LED here */
 	int idx = light_id;
 
 	/* Group takes up 3 bytes, so add 2 if we're past the group */
 	idx += 2 * (light_id > NI_MASCHINE_MIKRO_MK2_LED_GROUP);
-	uint32_t r = (light_status >> 16) & 0x7F;
-	uint32_t g = (light_status >>  8) & 0x7F;
-	uint32_t b = (light_status >>  0) & 0x7F;
+	uint8_t r, g, b;
+	ctlra_colour_rgb7(light_status, &r, &g, &b);
 
 	/* Group btn and all pads */
 	if(light_id == NI_MASCHINE_MIKRO_MK2_LED_GROUP) {
@@ -437,32 +396,47 @@ static void ni_maschine_mikro_mk2_light_set(struct ctlra_dev_t *base,
 		dev->lights[p+1] = g;
 		dev->lights[p+2] = b;
 	} else {
-		 if(light_id > NI_MASCHINE_MIKRO_MK2_LED_PAD_1 + 16)
-			return;
 		/* write brighness to all LEDs */
 		uint32_t bright = (light_status >> 24) & 0x7F;
 		dev->lights[idx] = bright;
 	}
+}
 
-	dev->lights_dirty = 1;
+static void ni_maschine_mikro_mk2_light_set(struct ctlra_dev_t *base,
+                uint32_t light_id,
+                uint32_t light_status)
+{
+	struct ni_maschine_mikro_mk2_t *dev = (struct ni_maschine_mikro_mk2_t *)base;
+
+	if(!dev || light_id > LIGHTS_MAX_ID)
+		return;
+
+	ni_maschine_mikro_mk2_light_store(dev, light_id, light_status);
 }
 
-void
-ni_maschine_mikro_mk2_light_flush(struct ctlra_dev_t *base, uint32_t force)
+static void
+ni_maschine_mikro_mk2_lights_set_bulk(struct ctlra_dev_t *base,
+				      uint32_t first_id, uint32_t count,
+				      const uint32_t *colours)
 {
 	struct ni_maschine_mikro_mk2_t *dev = (struct ni_maschine_mikro_mk2_t *)base;
-	if(!dev->lights_dirty && !force)
+
+	if(!dev || first_id > LIGHTS_MAX_ID)
 		return;
+	if(count > LIGHTS_MAX_ID + 1 - first_id)
+		count = LIGHTS_MAX_ID + 1 - first_id;
 
-	uint8_t *data = &dev->lights_endpoint;
-	dev->lights_endpoint = 0x80;
+	for(uint32_t i = 0; i < count; i++)
+		ni_maschine_mikro_mk2_light_store(dev, first_id + i,
+						  colours[i]);
+}
 
-	/* error handling in USB subsystem */
-	ctlra_dev_impl_usb_interrupt_write(base,
-					   USB_HANDLE_IDX,
-					   USB_ENDPOINT_WRITE,
-					   data,
-					   LIGHTS_SIZE + 1);
+void
+ni_maschine_mikro_mk2_light_flush(struct ctlra_dev_t *base, uint32_t force)
+{
+	struct ni_maschine_mikro_mk2_t *dev = (struct ni_maschine_mikro_mk2_t *)base;
+	ctlra_led_shadow_flush(&dev->leds, base, USB_HANDLE_IDX,
+			       USB_ENDPOINT_WRITE, force);
 }
 
 static void
@@ -562,7 +536,16 @@ ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 	if(!dev)
 		goto fail;
 
-	int err = ctlra_dev_impl_usb_open(&dev->base,
+	/* a table entry that does not fit is a driver bug */
+	int err = ctlra_report_diff_add_table(&dev->btn_diff, buttons,
+					      BUTTONS_SIZE);
+	if(err) {
+		CTLRA_ERROR(dev->base.ctlra_context,
+			    "button table error %d\n", err);
+		goto fail;
+	}
+
+	err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
 					  CTLRA_DRIVER_DEVICE);
 	if(err) {
@@ -570,6 +553,8 @@ ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 		return 0;
 	}
 
+	/* HID reports only, read and written on /dev/hidrawX */
+	dev->base.usb_hidraw = 1;
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 					 USB_INTERFACE_ID, USB_HANDLE_IDX);
 	if(err) {
@@ -580,8 +565,17 @@ ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 
 	dev->base.info = ctlra_ni_maschine_mikro_mk2_info;
 
+	ctlra_pad_filter_init(&dev->pad_filter, NPADS, PAD_ON_THRES,
+			      PAD_OFF_THRES, CTLRA_PAD_FILTER_FLAG_MEDIAN);
+
 	dev->base.usb_read_cb = ni_maschine_mikro_mk2_usb_read_cb;
 
+	dev->lights_endpoint = 0x80;
+	ctlra_led_shadow_init(&dev->leds);
+	ctlra_led_shadow_add(&dev->leds, &dev->lights_endpoint,
+			     LIGHTS_SIZE + 1);
+	dev->base.leds = &dev->leds;
+
 	dev->base.info.control_count[CTLRA_EVENT_BUTTON] =
 		CONTROL_NAMES_SIZE - 1; /* -1 is encoder */
 	dev->base.info.control_count[CTLRA_EVENT_ENCODER] = 1;
@@ -601,6 +595,7 @@ ctlra_ni_maschine_mikro_mk2_connect(ctlra_event_func event_func,
 	dev->base.poll = ni_maschine_mikro_mk2_poll;
 	dev->base.disconnect = ni_maschine_mikro_mk2_disconnect;
 	dev->base.light_set = ni_maschine_mikro_mk2_light_set;
+	dev->base.lights_set_bulk = ni_maschine_mikro_mk2_lights_set_bulk;
 	dev->base.light_flush = ni_maschine_mikro_mk2_light_flush;
 	dev->base.screen_get_data = ni_maschine_mikro_mk2_screen_get_data;
 
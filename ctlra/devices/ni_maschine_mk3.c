@@ -40,6 +40,10 @@
 #include <sys/time.h>
 
 #include "impl.h"
+#include "report_diff.h"
+#include "pad_filter.h"
+#include "colour.h"
+#include "led_shadow.h"
 
 // Uncomment to debug pad on/off
 //#define CTLRA_MK3_PADS 1
@@ -140,7 +144,7 @@ static const char *ni_maschine_mk3_control_names[] = {
 #define CONTROL_NAMES_SIZE (sizeof(ni_maschine_mk3_control_names) /\
 			    sizeof(ni_maschine_mk3_control_names[0]))
 
-static const struct ni_maschine_mk3_ctlra_t buttons[] = {
+static const struct ctlra_report_diff_ctlra_t buttons[] = {
 	/* encoder */
 	{1, 1, 0x01},
 	{1, 1, 0x08},
@@ -384,9 +388,8 @@ static struct ctlra_item_info_t encoder_info[] = {
 #define LIGHTS_PADS_SIZE (80)
 
 #define NPADS                  (16)
-/* KERNEL_LENGTH must be a power of 2 for masking */
-#define KERNEL_LENGTH          (8)
-#define KERNEL_MASK            (KERNEL_LENGTH-1)
+/* software threshold for gentle release */
+#define PAD_THRES              (128)
 
 
 /* TODO: Refactor out screen impl, and push to ctlra_ni_screen.h ? */
@@ -426,9 +429,10 @@ struct ni_maschine_mk3_t {
 	struct ctlra_dev_t base;
 	/* current value of each controller is stored here */
 	float hw_values[CONTROLS_SIZE];
-	/* current state of the lights, only flush on dirty */
-	uint8_t lights_dirty;
-	uint8_t lights_pads_dirty;
+	/* previous button report, for diff decoding */
+	struct ctlra_report_diff_t btn_diff;
+	/* state of the lights last written, only flush changes */
+	struct ctlra_led_shadow_t leds;
 
 	/* Lights endpoint used to transfer with hidapi */
 	uint8_t lights_endpoint;
@@ -445,9 +449,7 @@ struct ni_maschine_mk3_t {
 	uint16_t touchstrip_value;
 	/* Pressure filtering for note-onset detection */
 	uint64_t pad_last_msg_time;
-	uint16_t pad_hit;
-	uint16_t pad_idx[NPADS];
-	uint16_t pad_pressures[NPADS*KERNEL_LENGTH];
+	struct ctlra_pad_filter_t pad_filter;
 
 	struct ni_screen_t screen_left;
 	struct ni_screen_t screen_right;
@@ -476,9 +478,6 @@ static uint32_t ni_maschine_mk3_poll(struct ctlra_dev_t *base)
 	return 0;
 }
 
-void
-ni_maschine_mk3_light_flush(struct ctlra_dev_t *base, uint32_t force);
-
 /* ABCDEFGH Pad colour */
 static const uint8_t pad_cols[] = {
 	0x2a, 0b11101, 0b11000011, 0x5e,
@@ -507,11 +506,9 @@ ni_maschine_mk3_pads_decode_set(struct ni_maschine_mk3_t *dev,
 	};
 	struct ctlra_event_t *e = {&event};
 
-	/* pre-process pressed pads into bitmask. Keep state from before,
-	 * the messages will update only those that have changed */
-	uint16_t pad_pressures[16] = {0};
-	uint16_t rpt_pressed = dev->pad_hit;
-	int flush_lights = 0;
+	/* update the pads present in the message. The filter keeps the
+	 * pressure of the others, so only listed pads can change state */
+	struct ctlra_pad_filter_t *f = &dev->pad_filter;
 	uint8_t d1, d2;
 	int i;
 	for(i = 0; i < 16; i++) {
@@ -523,53 +520,40 @@ ni_maschine_mk3_pads_decode_set(struct ni_maschine_mk3_t *dev,
 		/* pad number is zero when list of pads has ended */
 		if(p == 0 && d1 == 0)
 			break;
+		if(p >= NPADS)
+			continue;
 
-		/* software threshold for gentle release */
-		uint16_t pressure = ((d1 & 0xf) << 8) | d2;
-		if(pressure > 128)
-			rpt_pressed |= 1 << p;
-		else
-			rpt_pressed &= ~(1 << p);
-
-		/* store pressure value for setting in event later */
-		pad_pressures[p] = pressure;
+		f->input[p] = ((d1 & 0xf) << 8) | d2;
 	}
 
-	for(int i = 0; i < 16; i++) {
-		/* detect state change */
-		int current = (dev->pad_hit & (1 << i));
-		int new     = (rpt_pressed  & (1 << i));
-
-		int state_change = (current != new);
-		int pressure_change = pad_pressures[i] != dev->pad_pressures[i];
+	uint32_t hits, releases;
+	ctlra_pad_filter_process(f, &hits, &releases);
+	uint32_t changed = hits | releases;
 
+	for(int i = 0; i < 16; i++) {
 #ifdef CTLRA_MK3_PRESSURE_DEBUG
-		printf("[msg_idx:%d]: pad %2d state (CH %d, V %d) pressure(CH %d, V %d)\n",
-		       msg_idx, i, state_change, new > 0, pressure_change,
-		       pad_pressures[i]);
+		printf("[msg_idx:%d]: pad %2d state (CH %d, V %d) pressure %d\n",
+		       msg_idx, i, (changed >> i) & 1, (f->pressed >> i) & 1,
+		       f->input[i]);
 #endif
 
-		/* Pressure value */
-		if(current == new) {
+		if(!(changed & (1 << i)))
 			continue;
-		}
 
 		/* rotate grid to match order on device (but zero
 		 * based counting instead of 1 based). */
 		event.grid.pos = (3-(i/4))*4 + (i%4);
-		int press = new > 0;
+		int press = (hits >> i) & 1;
 		event.grid.pressed = press;
-		event.grid.pressure = pad_pressures[i] * (1 / 4096.f) * press;
+		event.grid.pressure = f->input[i] * (1 / 4096.f) * press;
 
 		dev->base.event_func(&dev->base, 1, &e,
 				     dev->base.event_func_userdata);
 #ifdef CTLRA_MK3_PADS
 		dev->lights_pads[25+i] = dev->pad_colour * event.grid.pressed;
-		ni_maschine_mk3_light_flush(&dev->base, 1);
+		dev->base.light_flush_pending = 1;
 #endif
 	}
-
-	dev->pad_hit = rpt_pressed;
 }
 
 static void
@@ -667,28 +651,20 @@ ni_maschine_mk3_usb_read_cb(struct ctlra_dev_t *base,
 		}
 
 		/* Buttons */
-		for(uint32_t i = 0; i < BUTTONS_SIZE; i++) {
-			int id     = buttons[i].event_id;
-			int offset = buttons[i].buf_byte_offset;
-			int mask   = buttons[i].mask;
-
-			uint16_t v = *((uint16_t *)&buf[offset]) & mask;
-			int value_idx = i;
-
-			if(dev->hw_values[value_idx] != v) {
-				dev->hw_values[value_idx] = v;
-
-				struct ctlra_event_t event = {
-					.type = CTLRA_EVENT_BUTTON,
-					.button  = {
-						.id = i,
-						.pressed = v > 0
-					},
-				};
-				struct ctlra_event_t *e = {&event};
-				dev->base.event_func(&dev->base, 1, &e,
-						     dev->base.event_func_userdata);
-			}
+		struct ctlra_report_diff_change_t changes[BUTTONS_SIZE];
+		uint32_t nchanges = ctlra_report_diff_process(&dev->btn_diff,
+						buf, size, changes, BUTTONS_SIZE);
+		for(uint32_t i = 0; i < nchanges; i++) {
+			struct ctlra_event_t event = {
+				.type = CTLRA_EVENT_BUTTON,
+				.button  = {
+					.id = changes[i].idx,
+					.pressed = changes[i].pressed
+				},
+			};
+			struct ctlra_event_t *e = {&event};
+			dev->base.event_func(&dev->base, 1, &e,
+					     dev->base.event_func_userdata);
 		}
 
 		/* 8 float-style endless encoders under screen */
@@ -743,55 +719,21 @@ ni_maschine_mk3_usb_read_cb(struct ctlra_dev_t *base,
 	}
 }
 
-static void ni_maschine_mk3_light_set(struct ctlra_dev_t *base,
-                uint32_t light_id,
-                uint32_t light_status)
-{
-	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
-	int ret;
-
-	if(!dev)
-		return;
+/* RGB to palette hue, shared by all MK3 devices */
+static struct ctlra_colour_lut_t ni_maschine_mk3_colours;
 
-	// TODO: debug the -1, why is it required to get the right size?
-	if(light_id > (LIGHTS_SIZE + 25 + 16) - 1)
-		return;
+// TODO: debug the -1, why is it required to get the right size?
+#define LIGHTS_MAX_ID ((LIGHTS_SIZE + 25 + 16) - 1)
 
+/* Converts and stores one light, the light_id must be valid */
+static inline void
+ni_maschine_mk3_light_store(struct ni_maschine_mk3_t *dev,
+			    uint32_t light_id, uint32_t light_status)
+{
 	int idx = light_id;
-	const uint8_t r = ((light_status >> 16) & 0xFF);
-	const uint8_t g = ((light_status >>  8) & 0xFF);
-	const uint8_t b = ((light_status >>  0) & 0xFF);
-
-	uint8_t max = r > g ? r : g;
-	max = b > max ? b : max;
-	uint8_t min = r < g ? r : g;
-	min = b < min ? b : min;
-
-	/* rgb to hsv: nasty, but the device requires a H value input,
-	 * so we have to calculate it here. Icky branchy divide-y... */
-	uint8_t v = max;
-	uint8_t h, s;
-	if (v == 0 || (max - min) == 0) {
-		h = 0;
-		s = 0;
-	} else {
-		s = 255 * (max - min) / v;
-		if (s == 0)
-			h = 0;
-		if (max == r)
-			h = 0 + 43 * (g - b) / (max - min);
-		else if (max == g)
-			h = 85 + 43 * (b - r) / (max - min);
-		else
-			h = 171 + 43 * (r - g) / (max - min);
-	}
-
 	uint32_t bright = light_status >> 27;
-	uint8_t hue = h / 16 + 1;
-
-	/* if equal components, then set white */
-	if(r == g && r == b)
-		hue = 0xff;
+	uint8_t hue = ctlra_colour_lut_get(&ni_maschine_mk3_colours,
+					   light_status);
 
 	/* if the input was totally zero, set the LED off */
 	if(light_status == 0)
@@ -817,39 +759,48 @@ static void ni_maschine_mk3_light_set(struct ctlra_dev_t *base,
 			dev->lights[idx] = bright;
 			break;
 		};
-		dev->lights_dirty = 1;
 	} else {
 		/* 25 strip + 16 pads */
 		uint8_t v = (hue << 2) | (bright & 0x3);
 		dev->lights_pads[idx - LIGHTS_SIZE] = v;
-		dev->lights_pads_dirty = 1;
 	}
 }
 
-void
-ni_maschine_mk3_light_flush(struct ctlra_dev_t *base, uint32_t force)
+static void ni_maschine_mk3_light_set(struct ctlra_dev_t *base,
+                uint32_t light_id,
+                uint32_t light_status)
 {
 	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
-	if(!dev->lights_dirty && !force)
+
+	if(!dev || light_id > LIGHTS_MAX_ID)
 		return;
 
-	uint8_t *data = &dev->lights_endpoint;
-	dev->lights_endpoint = 0x80;
+	ni_maschine_mk3_light_store(dev, light_id, light_status);
+}
 
-	/* error handling in USB subsystem */
-	ctlra_dev_impl_usb_interrupt_write(base,
-					   USB_HANDLE_IDX,
-					   USB_ENDPOINT_WRITE,
-					   data,
-					   LIGHTS_SIZE + 1);
+static void
+ni_maschine_mk3_lights_set_bulk(struct ctlra_dev_t *base, uint32_t first_id,
+				uint32_t count, const uint32_t *colours)
+{
+	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
 
-	data = &dev->lights_pads_endpoint;
-	dev->lights_pads_endpoint = 0x81;
-	ctlra_dev_impl_usb_interrupt_write(base,
-					   USB_HANDLE_IDX,
-					   USB_ENDPOINT_WRITE,
-					   data,
-					   LIGHTS_SIZE + 1);
+	if(!dev || first_id > LIGHTS_MAX_ID)
+		return;
+	if(count > LIGHTS_MAX_ID + 1 - first_id)
+		count = LIGHTS_MAX_ID + 1 - first_id;
+
+	for(uint32_t i = 0; i < count; i++)
+		ni_maschine_mk3_light_store(dev, first_id + i, colours[i]);
+}
+
+void
+ni_maschine_mk3_light_flush(struct ctlra_dev_t *base, uint32_t force)
+{
+	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
+
+	/* lights report 0x80, pads and touchstrip report 0x81 */
+	ctlra_led_shadow_flush(&dev->leds, base, USB_HANDLE_IDX,
+			       USB_ENDPOINT_WRITE, force);
 }
 
 static void
@@ -1055,9 +1006,7 @@ ni_maschine_mk3_disconnect(struct ctlra_dev_t *base)
 	struct ni_maschine_mk3_t *dev = (struct ni_maschine_mk3_t *)base;
 
 	memset(dev->lights, 0x0, LIGHTS_SIZE);
-	dev->lights_dirty = 1;
 	memset(dev->lights_pads, 0x0, LIGHTS_PADS_SIZE);
-	dev->lights_pads_dirty = 1;
 
 	if(!base->banished) {
 		ni_maschine_mk3_light_flush(base, 1);
@@ -1086,7 +1035,16 @@ ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 	if(!dev)
 		goto fail;
 
-	int err = ctlra_dev_impl_usb_open(&dev->base,
+	/* a table entry that does not fit is a driver bug */
+	int err = ctlra_report_diff_add_table(&dev->btn_diff, buttons,
+					      BUTTONS_SIZE);
+	if(err) {
+		CTLRA_ERROR(dev->base.ctlra_context,
+			    "button table error %d\n", err);
+		goto fail;
+	}
+
+	err = ctlra_dev_impl_usb_open(&dev->base,
 					  CTLRA_DRIVER_VENDOR,
 					  CTLRA_DRIVER_DEVICE);
 	if(err) {
@@ -1094,6 +1052,9 @@ ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 		return 0;
 	}
 
+	/* on a virtual device the buttons and lights are reached through
+	 * hidraw, real ones keep async libusb writes for the lights */
+	dev->base.usb_hidraw = CTLRA_USB_HIDRAW_VIRTUAL;
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 					 USB_INTERFACE_ID, USB_HANDLE_IDX);
 	if(err) {
@@ -1102,6 +1063,7 @@ ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 		return 0;
 	}
 
+	dev->base.usb_hidraw = CTLRA_USB_HIDRAW_OFF;
 	err = ctlra_dev_impl_usb_open_interface(&dev->base,
 	                                        USB_INTERFACE_SCREEN,
 	                                        USB_HANDLE_SCREEN_IDX);
@@ -1135,14 +1097,33 @@ ctlra_ni_maschine_mk3_connect(ctlra_event_func event_func,
 	maschine_mk3_blit_to_screen(dev, 1);
 
 	dev->pad_colour = pad_cols[0];
-	dev->lights_dirty = 1;
+
+	/* the pads report has always been sent with the length of the
+	 * lights report, the hardware ignores the bytes after the pads */
+	dev->lights_endpoint = 0x80;
+	dev->lights_pads_endpoint = 0x81;
+	ctlra_led_shadow_init(&dev->leds);
+	ctlra_led_shadow_add(&dev->leds, &dev->lights_endpoint,
+			     LIGHTS_SIZE + 1);
+	ctlra_led_shadow_add(&dev->leds, &dev->lights_pads_endpoint,
+			     LIGHTS_SIZE + 1);
+	dev->base.leds = &dev->leds;
+
+	ctlra_colour_lut_init(&ni_maschine_mk3_colours, ctlra_colour_ni_hue);
+
+	/* the hardware already filters the pads: detect on raw values,
+	 * pressed above PAD_THRES and released at or below it */
+	ctlra_pad_filter_init(&dev->pad_filter, NPADS, PAD_THRES,
+			      PAD_THRES + 1, 0);
 
 	dev->base.info = ctlra_ni_maschine_mk3_info;
 
 	dev->base.poll = ni_maschine_mk3_poll;
+
 	dev->base.usb_read_cb = ni_maschine_mk3_usb_read_cb;
 	dev->base.disconnect = ni_maschine_mk3_disconnect;
 	dev->base.light_set = ni_maschine_mk3_light_set;
+	dev->base.lights_set_bulk = ni_maschine_mk3_lights_set_bulk;
 	dev->base.light_flush = ni_maschine_mk3_light_flush;
 	dev->base.screen_get_data = ni_maschine_mk3_screen_get_data;
 
@@ -141,6 +141,11 @@ struct ctlra_event_t {
 		struct ctlra_event_slider_t slider;
 		struct ctlra_event_grid_t grid;
 	};
+
+	/** The time the input arrived in nanoseconds on CLOCK_MONOTONIC,
+	 * or 0 if the device does not provide it. Set by MIDI devices, so
+	 * input from a single poll can be placed in time */
+	uint64_t timestamp;
 };
 
 /** Callback function that is called for event(s) */
@@ -0,0 +1,437 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+#include "impl.h"
+#include "hidraw.h"
+
+/* HID interfaces bypass libusb and its transfer bookkeeping: reports
+ * are read and written on the /dev/hidrawX node the kernel HID driver
+ * provides. The interface is not claimed, so other readers of the
+ * device keep working. One epoll instance per ctlra_t tells which
+ * nodes have reports waiting, so an idle device costs no syscall.
+ *
+ * Writes on this path are synchronous: usbhid completes the interrupt
+ * or SET_REPORT transfer inside write(), even with O_NONBLOCK, so LED
+ * writes run one at a time inside the idle iter. When built with
+ * liburing, an io_uring is used instead if the kernel has one, which
+ * makes the writes async, see hidraw_uring.c */
+
+#define HIDRAW_SYSFS "/sys/class/hidraw"
+
+/* Nodes found ready per epoll_wait(), any more are found next time */
+#define HIDRAW_EVENTS_MAX 16
+
+/* The epoll data is the device pointer, with the handle index in the
+ * low bit: devices are pointer aligned */
+#define HIDRAW_IDX_MASK 0x1
+#if CTLRA_USB_IFACE_PER_DEV > 2
+#error "hidraw epoll data holds one bit of handle index"
+#endif
+
+/* The sysfs name of the USB device at *location*, eg "1-2.3" for port
+ * 3 of the hub on port 2 of bus 1. See ctlra_usb_impl_location() */
+static int ctlra_hidraw_impl_usb_name(uint64_t location, char *name,
+				      size_t size)
+{
+	char sep = '-';
+	int n = snprintf(name, size, "%u", (unsigned)(location & 0xff));
+	for(location >>= 8; location && n < (int)size; location >>= 8) {
+		n += snprintf(&name[n], size - n, "%c%u", sep,
+			      (unsigned)(location & 0xff));
+		sep = '.';
+	}
+	return n < (int)size ? 0 : -ENAMETOOLONG;
+}
+
+/* Find the node of *interface* of the USB device named *usb*. The HID
+ * device of each node is a child of the USB interface it belongs to:
+ *   .../1-2.3/1-2.3:1.0/0003:17CC:1110.0005/hidraw/hidraw2 */
+static int ctlra_hidraw_impl_find(const char *usb, int interface,
+				  char *node, size_t size)
+{
+	DIR *dir = opendir(HIDRAW_SYSFS);
+	if(!dir)
+		return -ENOENT;
+
+	/* interfaces are named "<usb>:<config>.<interface>" */
+	char suffix[16];
+	snprintf(suffix, sizeof(suffix), ".%d", interface);
+	const size_t suffix_len = strlen(suffix);
+	const size_t usb_len = strlen(usb);
+
+	int ret = -ENOENT;
+	struct dirent *d;
+	while((d = readdir(dir))) {
+		if(strncmp(d->d_name, "hidraw", 6))
+			continue;
+
+		char path[PATH_MAX];
+		char real[PATH_MAX];
+		snprintf(path, sizeof(path), HIDRAW_SYSFS "/%s/device",
+			 d->d_name);
+		if(!realpath(path, real))
+			continue;
+
+		/* strip the HID device, leaving the USB interface */
+		char *hid = strrchr(real, '/');
+		if(!hid)
+			continue;
+		*hid = 0;
+		char *iface = strrchr(real, '/');
+		iface = iface ? iface + 1 : real;
+
+		size_t len = strlen(iface);
+		if(strncmp(iface, usb, usb_len) || iface[usb_len] != ':' ||
+		   len < suffix_len || strcmp(&iface[len - suffix_len], suffix))
+			continue;
+
+		snprintf(node, size, "/dev/%s", d->d_name);
+		ret = 0;
+		break;
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+/* Without a libusb handle, the serial is read from sysfs */
+static void ctlra_hidraw_impl_serial(struct ctlra_dev_t *dev,
+				     const char *usb)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/serial", usb);
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return;
+	if(fgets(dev->info.serial, CTLRA_DEV_SERIAL_MAX, f))
+		dev->info.serial[strcspn(dev->info.serial, "\n")] = 0;
+	fclose(f);
+}
+
+/* Virtual devices have no USB serial, use the unique ID they were
+ * created with */
+static void ctlra_hidraw_impl_uniq(struct ctlra_dev_t *dev, uint32_t num)
+{
+	char path[PATH_MAX];
+	char line[128];
+	snprintf(path, sizeof(path), HIDRAW_SYSFS "/hidraw%u/device/uevent",
+		 num);
+	FILE *f = fopen(path, "r");
+	if(!f)
+		return;
+	while(fgets(line, sizeof(line), f)) {
+		if(strncmp(line, "HID_UNIQ=", 9))
+			continue;
+		line[strcspn(line, "\n")] = 0;
+		snprintf(dev->info.serial, CTLRA_DEV_SERIAL_MAX, "%s",
+			 &line[9]);
+		break;
+	}
+	fclose(f);
+}
+
+int ctlra_impl_hidraw_virtual_list(struct ctlra_hidraw_virtual_t *list,
+				   int max)
+{
+	DIR *dir = opendir(HIDRAW_SYSFS);
+	if(!dir)
+		return 0;
+
+	int n = 0;
+	struct dirent *d;
+	while(n < max && (d = readdir(dir))) {
+		uint32_t num;
+		if(sscanf(d->d_name, "hidraw%u", &num) != 1)
+			continue;
+
+		char path[PATH_MAX];
+		char real[PATH_MAX];
+		snprintf(path, sizeof(path), HIDRAW_SYSFS "/%s/device",
+			 d->d_name);
+		if(!realpath(path, real))
+			continue;
+		if(strncmp(real, "/sys/devices/virtual/", 21))
+			continue;
+
+		/* HID devices are named "<bus>:<vendor>:<product>.<id>" */
+		const char *hid = strrchr(real, '/') + 1;
+		uint32_t bus, vid, pid;
+		if(sscanf(hid, "%x:%x:%x", &bus, &vid, &pid) != 3)
+			continue;
+
+		list[n].vendor_id = vid;
+		list[n].product_id = pid;
+		list[n].location = CTLRA_HIDRAW_VIRTUAL | num;
+		n++;
+	}
+
+	closedir(dir);
+	return n;
+}
+
+int ctlra_dev_impl_hidraw_open(struct ctlra_dev_t *dev, int interface,
+			       int idx)
+{
+	char usb[32];
+	char node[64];
+
+	/* the node of a virtual device is known, it has one interface */
+	if(dev->usb_location & CTLRA_HIDRAW_VIRTUAL) {
+		uint32_t num = dev->usb_location & 0xffffffff;
+		snprintf(node, sizeof(node), "/dev/hidraw%u", num);
+		int fd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+		if(fd < 0)
+			return -errno;
+		if(!dev->info.serial[0])
+			ctlra_hidraw_impl_uniq(dev, num);
+		dev->hidraw_fd[idx] = fd;
+		return 0;
+	}
+
+	int ret = ctlra_hidraw_impl_usb_name(dev->usb_location, usb,
+					     sizeof(usb));
+	if(ret)
+		return ret;
+
+	ret = ctlra_hidraw_impl_find(usb, interface, node, sizeof(node));
+	if(ret)
+		return ret;
+
+	int fd = open(node, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if(fd < 0)
+		return -errno;
+
+	if(!dev->info.serial[0])
+		ctlra_hidraw_impl_serial(dev, usb);
+
+	dev->hidraw_fd[idx] = fd;
+	return 0;
+}
+
+/* Add handle *idx* to the epoll instance, created on first use */
+static int ctlra_hidraw_impl_register(struct ctlra_dev_t *dev, uint32_t idx)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+
+	if(ctlra->hidraw_epoll < 0) {
+		ctlra->hidraw_epoll = epoll_create1(EPOLL_CLOEXEC);
+		if(ctlra->hidraw_epoll < 0)
+			return -errno;
+	}
+
+	struct epoll_event ev = {
+		.events = EPOLLIN,
+		.data.u64 = (uintptr_t)dev | idx,
+	};
+	if(epoll_ctl(ctlra->hidraw_epoll, EPOLL_CTL_ADD, dev->hidraw_fd[idx],
+		     &ev))
+		return -errno;
+
+	dev->hidraw_polled |= 1 << idx;
+	/* reports may have arrived before registering */
+	dev->hidraw_ready |= 1 << idx;
+	return 0;
+}
+
+/* Start polling handle *idx*: on the io_uring if the kernel has one,
+ * otherwise with epoll */
+static int ctlra_hidraw_impl_attach(struct ctlra_dev_t *dev, uint32_t idx,
+				    uint32_t size)
+{
+#ifdef HAVE_LIBURING
+	if(!ctlra_hidraw_uring_attach(dev, idx, size)) {
+		dev->hidraw_polled |= 1 << idx;
+		return 0;
+	}
+#endif
+	return ctlra_hidraw_impl_register(dev, idx);
+}
+
+int ctlra_dev_impl_hidraw_read(struct ctlra_dev_t *dev, uint32_t idx,
+			       uint32_t endpoint, uint8_t *data,
+			       uint32_t size)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+	const uint8_t bit = 1 << idx;
+
+	if(!(dev->hidraw_polled & bit)) {
+		int ret = ctlra_hidraw_impl_attach(dev, idx, size);
+		if(ret) {
+			CTLRA_ERROR(ctlra, "dev banished, hidraw poll error %s\n",
+				    strerror(-ret));
+			ctlra_dev_impl_banish(dev);
+			return ret;
+		}
+	}
+
+#ifdef HAVE_LIBURING
+	if(dev->hidraw_slot[idx])
+		return ctlra_hidraw_uring_read(dev, idx, endpoint);
+#endif
+
+	if(!(dev->hidraw_ready & bit))
+		return 0;
+	dev->hidraw_ready &= ~bit;
+
+	if(!dev->usb_read_cb) {
+		CTLRA_ERROR(ctlra, "DRIVER ERROR: no USB READ CB = %p!\n",
+			    dev->usb_read_cb);
+		return 0;
+	}
+
+	/* each read() returns one report, drain all that are queued */
+	int total = 0;
+	for(;;) {
+		ssize_t n = read(dev->hidraw_fd[idx], data, size);
+		if(n < 0) {
+			int err = errno;
+			if(err == EINTR)
+				continue;
+			if(err == EAGAIN)
+				break;
+			/* ENODEV when unplugged */
+			CTLRA_DRIVER(ctlra, "dev banished, hidraw read error %s\n",
+				     strerror(err));
+			ctlra_dev_impl_banish(dev);
+			return -err;
+		}
+		if(n == 0)
+			break;
+
+		dev->usb_xfer_counts[USB_XFER_INT_READ]++;
+		dev->usb_read_cb(dev, endpoint, data, n);
+		total += n;
+	}
+
+	return total;
+}
+
+int ctlra_dev_impl_hidraw_write(struct ctlra_dev_t *dev, uint32_t idx,
+				uint8_t *data, uint32_t size)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+
+#ifdef HAVE_LIBURING
+	if(dev->hidraw_slot[idx])
+		return ctlra_hidraw_uring_write(dev, idx, data, size);
+#endif
+
+	ssize_t n;
+	do {
+		n = write(dev->hidraw_fd[idx], data, size);
+	} while(n < 0 && errno == EINTR);
+
+	/* usbhid returns once the transfer is done, see the top of file.
+	 * Other HID drivers, eg: uhid, may refuse with EAGAIN instead */
+	if(n < 0) {
+		int err = errno;
+		/* dropped, as when the libusb path hits its in-flight limit */
+		if(err == EAGAIN) {
+			dev->usb_xfer_counts[USB_XFER_ERROR]++;
+			return 0;
+		}
+		CTLRA_DRIVER(ctlra, "dev banished, hidraw write error %s\n",
+			     strerror(err));
+		ctlra_dev_impl_banish(dev);
+		return -err;
+	}
+
+	dev->usb_xfer_counts[USB_XFER_INT_WRITE]++;
+	return n;
+}
+
+void ctlra_dev_impl_hidraw_close(struct ctlra_dev_t *dev)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+
+	for(int i = 0; i < CTLRA_USB_IFACE_PER_DEV; i++) {
+		int fd = dev->hidraw_fd[i];
+		if(fd < 0)
+			continue;
+		dev->hidraw_fd[i] = -1;
+#ifdef HAVE_LIBURING
+		/* the ring owns the fd, requests may still be in flight */
+		if(dev->hidraw_slot[i]) {
+			ctlra_hidraw_uring_close(dev, i);
+			continue;
+		}
+#endif
+		if(dev->hidraw_polled & (1 << i))
+			epoll_ctl(ctlra->hidraw_epoll, EPOLL_CTL_DEL, fd, 0);
+		close(fd);
+	}
+
+	dev->hidraw_polled = 0;
+	dev->hidraw_ready = 0;
+}
+
+void ctlra_impl_hidraw_idle_iter(struct ctlra_t *ctlra)
+{
+#ifdef HAVE_LIBURING
+	ctlra_hidraw_uring_iter(ctlra);
+#endif
+
+	if(ctlra->hidraw_epoll < 0)
+		return;
+
+	struct epoll_event ev[HIDRAW_EVENTS_MAX];
+	int n = epoll_wait(ctlra->hidraw_epoll, ev, HIDRAW_EVENTS_MAX, 0);
+
+	/* errors and hangups are marked ready too, so the read fails and
+	 * banishes the device */
+	for(int i = 0; i < n; i++) {
+		uint64_t data = ev[i].data.u64;
+		struct ctlra_dev_t *dev =
+			(struct ctlra_dev_t *)(uintptr_t)(data & ~HIDRAW_IDX_MASK);
+		dev->hidraw_ready |= 1 << (data & HIDRAW_IDX_MASK);
+	}
+}
+
+void ctlra_impl_hidraw_shutdown(struct ctlra_t *ctlra)
+{
+#ifdef HAVE_LIBURING
+	ctlra_hidraw_uring_shutdown(ctlra);
+#endif
+
+	if(ctlra->hidraw_epoll >= 0)
+		close(ctlra->hidraw_epoll);
+	ctlra->hidraw_epoll = -1;
+}
@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CTLRA_HIDRAW_H
+#define CTLRA_HIDRAW_H
+
+#include <stdint.h>
+
+struct ctlra_t;
+struct ctlra_dev_t;
+
+/* The location of a HID device that is not on USB: this bit, and the
+ * number of its /dev/hidrawX node. See ctlra_usb_impl_location() */
+#define CTLRA_HIDRAW_VIRTUAL (1ull << 63)
+
+/* A HID device not on USB, eg: created through /dev/uhid */
+struct ctlra_hidraw_virtual_t {
+	uint16_t vendor_id;
+	uint16_t product_id;
+	uint64_t location;
+};
+
+/* List up to *max* HID devices that are not on USB, returns the count */
+int ctlra_impl_hidraw_virtual_list(struct ctlra_hidraw_virtual_t *list,
+				   int max);
+
+/* hidraw transport of USB HID interfaces, used by the usb.c functions
+ * when a driver sets usb_hidraw. Implementation in hidraw.c */
+
+/* Open *interface* of the device through its /dev/hidrawX node, as
+ * handle *idx*. Returns 0 on success or a negative errno */
+int ctlra_dev_impl_hidraw_open(struct ctlra_dev_t *dev, int interface,
+			       int idx);
+/* Read all reports waiting on handle *idx*, passing each to the read
+ * callback of the device. Returns the number of bytes read */
+int ctlra_dev_impl_hidraw_read(struct ctlra_dev_t *dev, uint32_t idx,
+			       uint32_t endpoint, uint8_t *data,
+			       uint32_t size);
+/* Write one report, its first byte the report ID. Without io_uring the
+ * write is synchronous on usbhid: it returns when the transfer is done.
+ * Returns the bytes written, or 0 if the driver refused it with EAGAIN */
+int ctlra_dev_impl_hidraw_write(struct ctlra_dev_t *dev, uint32_t idx,
+				uint8_t *data, uint32_t size);
+/* Close the hidraw handles of a device */
+void ctlra_dev_impl_hidraw_close(struct ctlra_dev_t *dev);
+/* Find the hidraw handles with reports waiting, without blocking */
+void ctlra_impl_hidraw_idle_iter(struct ctlra_t *ctlra);
+/* Release the epoll instance */
+void ctlra_impl_hidraw_shutdown(struct ctlra_t *ctlra);
+
+#ifdef HAVE_LIBURING
+/* io_uring transport of the hidraw handles, preferred over epoll when
+ * the kernel supports it. Implementation in hidraw_uring.c */
+
+/* Move handle *idx* to the ring, posting a read of *size* bytes.
+ * Returns 0 on success or a negative errno, to fall back to epoll */
+int ctlra_hidraw_uring_attach(struct ctlra_dev_t *dev, uint32_t idx,
+			      uint32_t size);
+/* Pass a completed read to the read callback, and post the next */
+int ctlra_hidraw_uring_read(struct ctlra_dev_t *dev, uint32_t idx,
+			    uint32_t endpoint);
+/* Queue a write, submitted with the next iteration */
+int ctlra_hidraw_uring_write(struct ctlra_dev_t *dev, uint32_t idx,
+			     uint8_t *data, uint32_t size);
+/* Detach handle *idx*, which the ring closes once it is idle */
+void ctlra_hidraw_uring_close(struct ctlra_dev_t *dev, uint32_t idx);
+/* Submit all queued requests and harvest the completions */
+void ctlra_hidraw_uring_iter(struct ctlra_t *ctlra);
+/* Wait for the final writes, and release the ring */
+void ctlra_hidraw_uring_shutdown(struct ctlra_t *ctlra);
+#endif
+
+#endif /* CTLRA_HIDRAW_H */
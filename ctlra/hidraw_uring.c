@@ -0,0 +1,484 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <liburing.h>
+
+#include "impl.h"
+#include "hidraw.h"
+
+/* io_uring transport of the hidraw handles. Every handle keeps a batch
+ * of reads posted, and the writes of all devices are queued as they are
+ * made. ctlra_hidraw_uring_iter() submits everything queued since the
+ * last iteration and harvests all completions, in one io_uring_enter()
+ * for the whole rig rather than a read and write syscall per device.
+ *
+ * The handles are switched to blocking: hidraw has no nonblocking read
+ * attempt, so the kernel waits for reports in its io-wq workers. */
+
+/* Submission queue size, room for the reads and writes of many devices
+ * queued in one iteration. The queue is flushed early if it fills */
+#define HIDRAW_URING_ENTRIES 256
+/* Completions harvested per peek */
+#define HIDRAW_URING_CQE_BATCH 64
+/* Reads posted per handle, so reports arriving between two iterations
+ * are all delivered by the next one. They are hard linked, which runs
+ * them one after the other: io-wq would otherwise run them in parallel,
+ * and the reports could complete out of order. A hard link also holds
+ * when a read is shorter than the buffer, as most reports are */
+#define HIDRAW_URING_READS 4
+/* Writes queued per handle, further writes are dropped like a libusb
+ * write over the in-flight limit. Writes of one handle are submitted
+ * one at a time: io-wq runs requests on char devices in parallel, so
+ * more than one in flight could reach the device out of order */
+#define HIDRAW_URING_WRITES_MAX 4
+/* Time ctlra_exit() waits for the final writes, eg: lights off */
+#define HIDRAW_URING_CLOSE_WAIT_US 100000
+
+enum ctlra_hidraw_op_type_t {
+	HIDRAW_OP_READ,
+	HIDRAW_OP_WRITE,
+};
+
+/* user_data of each request, cancels have none */
+struct ctlra_hidraw_op_t {
+	uint8_t type;
+	/* buffer of a read */
+	uint8_t index;
+	struct ctlra_hidraw_slot_t *slot;
+};
+
+struct ctlra_hidraw_write_t {
+	struct ctlra_hidraw_op_t op;
+	struct ctlra_hidraw_write_t *next;
+	uint32_t size;
+	uint8_t data[];
+};
+
+/* One hidraw handle. Owned by the ring once attached: closing the
+ * device only detaches it, and it is freed with its fd when the kernel
+ * has handed back all of its requests */
+struct ctlra_hidraw_slot_t {
+	struct ctlra_hidraw_op_t read[HIDRAW_URING_READS];
+	struct ctlra_hidraw_slot_t *next;
+	/* NULL once the device is closed */
+	struct ctlra_dev_t *dev;
+	int fd;
+	uint32_t idx;
+	/* requests the kernel owns */
+	uint32_t inflight;
+	/* bitmasks of the reads of the batch the kernel owns, and of
+	 * those completed but not delivered yet */
+	uint8_t read_armed;
+	uint8_t read_done;
+	/* reads in the batch, and the next to deliver in posting order */
+	uint8_t read_count;
+	uint8_t read_next;
+	/* set while the read callback runs. Drivers may poll again from
+	 * it, and a nested poll must neither deliver the next report in
+	 * the middle of this one nor post a new batch over the buffer the
+	 * callback is still reading */
+	uint8_t read_busy;
+	int32_t read_res[HIDRAW_URING_READS];
+	/* queued writes, the head is in flight */
+	struct ctlra_hidraw_write_t *write_head;
+	struct ctlra_hidraw_write_t *write_tail;
+	uint32_t writes;
+	uint32_t size;
+	/* HIDRAW_URING_READS buffers of *size* bytes */
+	uint8_t buf[];
+};
+
+struct ctlra_hidraw_ring_t {
+	struct io_uring ring;
+	struct ctlra_hidraw_slot_t *slots;
+	/* queued writes of all slots */
+	uint32_t writes;
+};
+
+/* Get an SQE, flushing the queue to the kernel if it is full */
+static struct io_uring_sqe *
+ctlra_hidraw_uring_sqe(struct ctlra_hidraw_ring_t *r)
+{
+	struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+	if(!sqe) {
+		io_uring_submit(&r->ring);
+		sqe = io_uring_get_sqe(&r->ring);
+	}
+	return sqe;
+}
+
+/* Post the next batch of reads. A link chain must not be split over two
+ * submissions, so the queue is flushed first if the batch does not fit */
+static void ctlra_hidraw_uring_arm_read(struct ctlra_hidraw_ring_t *r,
+					struct ctlra_hidraw_slot_t *s)
+{
+	if(io_uring_sq_space_left(&r->ring) < HIDRAW_URING_READS)
+		io_uring_submit(&r->ring);
+
+	struct io_uring_sqe *prev = 0;
+	s->read_next = 0;
+	for(s->read_count = 0; s->read_count < HIDRAW_URING_READS;
+	    s->read_count++) {
+		int i = s->read_count;
+		struct io_uring_sqe *sqe = io_uring_get_sqe(&r->ring);
+		if(!sqe) {
+			/* a shorter batch, ending the chain */
+			if(prev)
+				io_uring_sqe_set_flags(prev, 0);
+			return;
+		}
+		io_uring_prep_read(sqe, s->fd, &s->buf[i * s->size], s->size,
+				   0);
+		io_uring_sqe_set_data(sqe, &s->read[i]);
+		if(i + 1 < HIDRAW_URING_READS)
+			io_uring_sqe_set_flags(sqe, IOSQE_IO_HARDLINK);
+		s->read_armed |= 1 << i;
+		s->inflight++;
+		prev = sqe;
+	}
+}
+
+/* Cancel the posted read of the batch that runs first. The later ones
+ * only start when it completes, and are cancelled then */
+static void ctlra_hidraw_uring_cancel_read(struct ctlra_hidraw_ring_t *r,
+					   struct ctlra_hidraw_slot_t *s)
+{
+	for(int i = 0; i < HIDRAW_URING_READS; i++) {
+		if(!(s->read_armed & (1 << i)))
+			continue;
+		struct io_uring_sqe *sqe = ctlra_hidraw_uring_sqe(r);
+		if(sqe) {
+			io_uring_prep_cancel(sqe, &s->read[i], 0);
+			io_uring_sqe_set_data(sqe, 0);
+		}
+		return;
+	}
+}
+
+static void ctlra_hidraw_uring_arm_write(struct ctlra_hidraw_ring_t *r,
+					 struct ctlra_hidraw_slot_t *s)
+{
+	while(s->write_head) {
+		struct ctlra_hidraw_write_t *w = s->write_head;
+		struct io_uring_sqe *sqe = ctlra_hidraw_uring_sqe(r);
+		if(sqe) {
+			io_uring_prep_write(sqe, s->fd, w->data, w->size, 0);
+			io_uring_sqe_set_data(sqe, &w->op);
+			s->inflight++;
+			return;
+		}
+		/* no room even after flushing: dropped */
+		s->write_head = w->next;
+		if(!s->write_head)
+			s->write_tail = 0;
+		s->writes--;
+		r->writes--;
+		free(w);
+	}
+}
+
+static void ctlra_hidraw_uring_slot_free(struct ctlra_hidraw_ring_t *r,
+					 struct ctlra_hidraw_slot_t *s)
+{
+	struct ctlra_hidraw_slot_t **sp = &r->slots;
+	while(*sp != s)
+		sp = &(*sp)->next;
+	*sp = s->next;
+
+	while(s->write_head) {
+		struct ctlra_hidraw_write_t *w = s->write_head;
+		s->write_head = w->next;
+		r->writes--;
+		free(w);
+	}
+	close(s->fd);
+	free(s);
+}
+
+int ctlra_hidraw_uring_attach(struct ctlra_dev_t *dev, uint32_t idx,
+			      uint32_t size)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+	struct ctlra_hidraw_ring_t *r = ctlra->hidraw_ring;
+
+	if(!r) {
+		/* an older kernel, or io_uring disabled: use epoll */
+		if(ctlra->hidraw_ring_failed)
+			return -ENOSYS;
+		r = calloc(1, sizeof(*r));
+		if(!r)
+			return -ENOMEM;
+		int ret = io_uring_queue_init(HIDRAW_URING_ENTRIES, &r->ring, 0);
+		if(ret < 0) {
+			CTLRA_INFO(ctlra, "io_uring unavailable (%s), using epoll\n",
+				   strerror(-ret));
+			ctlra->hidraw_ring_failed = 1;
+			free(r);
+			return ret;
+		}
+		ctlra->hidraw_ring = r;
+	}
+
+	struct ctlra_hidraw_slot_t *s = calloc(1, sizeof(*s) +
+					      size * HIDRAW_URING_READS);
+	if(!s)
+		return -ENOMEM;
+
+	int fd = dev->hidraw_fd[idx];
+	int flags = fcntl(fd, F_GETFL);
+	if(flags < 0 || fcntl(fd, F_SETFL, flags & ~O_NONBLOCK)) {
+		int err = errno;
+		free(s);
+		return -err;
+	}
+
+	for(int i = 0; i < HIDRAW_URING_READS; i++) {
+		s->read[i].type = HIDRAW_OP_READ;
+		s->read[i].index = i;
+		s->read[i].slot = s;
+	}
+	s->dev = dev;
+	s->fd = fd;
+	s->idx = idx;
+	s->size = size;
+	s->next = r->slots;
+	r->slots = s;
+
+	dev->hidraw_slot[idx] = s;
+	ctlra_hidraw_uring_arm_read(r, s);
+	return 0;
+}
+
+int ctlra_hidraw_uring_read(struct ctlra_dev_t *dev, uint32_t idx,
+			    uint32_t endpoint)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+	struct ctlra_hidraw_ring_t *r = ctlra->hidraw_ring;
+	struct ctlra_hidraw_slot_t *s = dev->hidraw_slot[idx];
+	int32_t ret = 0;
+
+	/* polled again from the read callback, see read_busy */
+	if(s->read_busy)
+		return 0;
+
+	/* every report harvested since the last poll, in order */
+	while(s->read_done & (1 << s->read_next)) {
+		uint8_t i = s->read_next++;
+		s->read_done &= ~(1 << i);
+		int32_t res = s->read_res[i];
+
+		if(res < 0 && res != -EINTR && res != -EAGAIN) {
+			/* ENODEV when unplugged */
+			CTLRA_DRIVER(ctlra, "dev banished, hidraw read error %s\n",
+				     strerror(-res));
+			ctlra_dev_impl_banish(dev);
+			return res;
+		}
+		if(res > 0) {
+			dev->usb_xfer_counts[USB_XFER_INT_READ]++;
+			s->read_busy = 1;
+			if(dev->usb_read_cb)
+				dev->usb_read_cb(dev, endpoint,
+						 &s->buf[i * s->size], res);
+			s->read_busy = 0;
+			ret = res;
+		}
+	}
+
+	/* the callbacks are done with the buffers: post the next batch,
+	 * and submit it now so no report waits for the next iteration */
+	if(!s->read_armed && s->read_next == s->read_count) {
+		ctlra_hidraw_uring_arm_read(r, s);
+		io_uring_submit(&r->ring);
+	}
+	return ret;
+}
+
+int ctlra_hidraw_uring_write(struct ctlra_dev_t *dev, uint32_t idx,
+			     uint8_t *data, uint32_t size)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+	struct ctlra_hidraw_ring_t *r = ctlra->hidraw_ring;
+	struct ctlra_hidraw_slot_t *s = dev->hidraw_slot[idx];
+
+	if(s->writes >= HIDRAW_URING_WRITES_MAX) {
+		dev->usb_xfer_counts[USB_XFER_ERROR]++;
+		return 0;
+	}
+
+	struct ctlra_hidraw_write_t *w = malloc(sizeof(*w) + size);
+	if(!w) {
+		dev->usb_xfer_counts[USB_XFER_ERROR]++;
+		return -ENOSPC;
+	}
+	w->op.type = HIDRAW_OP_WRITE;
+	w->op.slot = s;
+	w->next = 0;
+	w->size = size;
+	memcpy(w->data, data, size);
+
+	if(s->write_tail)
+		s->write_tail->next = w;
+	else
+		s->write_head = w;
+	s->write_tail = w;
+	s->writes++;
+	r->writes++;
+
+	if(s->write_head == w)
+		ctlra_hidraw_uring_arm_write(r, s);
+
+	dev->usb_xfer_counts[USB_XFER_INT_WRITE]++;
+	return size;
+}
+
+void ctlra_hidraw_uring_close(struct ctlra_dev_t *dev, uint32_t idx)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+	struct ctlra_hidraw_ring_t *r = ctlra->hidraw_ring;
+	struct ctlra_hidraw_slot_t *s = dev->hidraw_slot[idx];
+
+	dev->hidraw_slot[idx] = 0;
+	s->dev = 0;
+
+	/* the queued writes still go out, the posted reads are cancelled */
+	ctlra_hidraw_uring_cancel_read(r, s);
+
+	if(!s->inflight)
+		ctlra_hidraw_uring_slot_free(r, s);
+}
+
+static void ctlra_hidraw_uring_complete(struct ctlra_hidraw_ring_t *r,
+					struct io_uring_cqe *cqe)
+{
+	struct ctlra_hidraw_op_t *op = io_uring_cqe_get_data(cqe);
+	if(!op)
+		return;
+
+	struct ctlra_hidraw_slot_t *s = op->slot;
+	s->inflight--;
+
+	if(op->type == HIDRAW_OP_READ) {
+		s->read_armed &= ~(1 << op->index);
+		s->read_done |= 1 << op->index;
+		s->read_res[op->index] = cqe->res;
+		/* the next read of a closed handle starts now */
+		if(!s->dev)
+			ctlra_hidraw_uring_cancel_read(r, s);
+	} else {
+		struct ctlra_hidraw_write_t *w = s->write_head;
+		s->write_head = w->next;
+		if(!s->write_head)
+			s->write_tail = 0;
+		s->writes--;
+		r->writes--;
+		free(w);
+
+		if(cqe->res < 0 && s->dev) {
+			s->dev->usb_xfer_counts[USB_XFER_ERROR]++;
+			CTLRA_DRIVER(s->dev->ctlra_context,
+				     "dev banished, hidraw write error %s\n",
+				     strerror(-cqe->res));
+			ctlra_dev_impl_banish(s->dev);
+		}
+		if(s->write_head)
+			ctlra_hidraw_uring_arm_write(r, s);
+	}
+
+	if(!s->dev && !s->inflight)
+		ctlra_hidraw_uring_slot_free(r, s);
+}
+
+static void ctlra_hidraw_uring_harvest(struct ctlra_hidraw_ring_t *r)
+{
+	struct io_uring_cqe *cqes[HIDRAW_URING_CQE_BATCH];
+	unsigned n;
+	do {
+		n = io_uring_peek_batch_cqe(&r->ring, cqes,
+					    HIDRAW_URING_CQE_BATCH);
+		for(unsigned i = 0; i < n; i++)
+			ctlra_hidraw_uring_complete(r, cqes[i]);
+		io_uring_cq_advance(&r->ring, n);
+	} while(n == HIDRAW_URING_CQE_BATCH);
+}
+
+void ctlra_hidraw_uring_iter(struct ctlra_t *ctlra)
+{
+	struct ctlra_hidraw_ring_t *r = ctlra->hidraw_ring;
+	if(!r)
+		return;
+
+	/* the only syscall, and none at all if nothing is queued */
+	io_uring_submit(&r->ring);
+	ctlra_hidraw_uring_harvest(r);
+}
+
+void ctlra_hidraw_uring_shutdown(struct ctlra_t *ctlra)
+{
+	struct ctlra_hidraw_ring_t *r = ctlra->hidraw_ring;
+	if(!r)
+		return;
+
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(;;) {
+		io_uring_submit(&r->ring);
+		ctlra_hidraw_uring_harvest(r);
+		if(!r->writes)
+			break;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		uint64_t elapsed = (now.tv_sec - start.tv_sec) * 1000000ull +
+				   (now.tv_nsec - start.tv_nsec) / 1000;
+		if(elapsed >= HIDRAW_URING_CLOSE_WAIT_US) {
+			CTLRA_WARN(ctlra, "hidraw writes at close = %d\n",
+				   r->writes);
+			break;
+		}
+		struct io_uring_cqe *cqe;
+		struct __kernel_timespec ts = { .tv_nsec = 1000000 };
+		io_uring_wait_cqe_timeout(&r->ring, &cqe, &ts);
+	}
+
+	/* cancels and waits for whatever is left */
+	io_uring_queue_exit(&r->ring);
+	while(r->slots)
+		ctlra_hidraw_uring_slot_free(r, r->slots);
+	free(r);
+	ctlra->hidraw_ring = 0;
+}
@@ -79,6 +79,10 @@ typedef int32_t (*ctlra_dev_impl_disconnect)(struct ctlra_dev_t *dev);
 typedef void (*ctlra_dev_impl_light_set)(struct ctlra_dev_t *dev,
 					   uint32_t light_id,
 					   uint32_t light_status);
+typedef void (*ctlra_dev_impl_lights_set_bulk)(struct ctlra_dev_t *dev,
+						uint32_t first_id,
+						uint32_t count,
+						const uint32_t *colours);
 typedef void (*ctlra_dev_impl_feedback_set)(struct ctlra_dev_t *dev,
 					    uint32_t fb_id,
 					    float value);
@@ -125,6 +129,22 @@ struct ctlra_dev_t {
 
 	/* usb handle for this hardware device. */
 	void *usb_device;
+	/* bus and port path the device is plugged into, which tells apart
+	 * identical devices. See ctlra_usb_impl_location() */
+	uint64_t usb_location;
+	/* State of re-opening the device after a transfer error, with
+	 * flags_usb_reconnect set. While active the device is not polled
+	 * or fed feedback, see ctlra_usb_impl_recover_iter() */
+#define CTLRA_USB_RECOVER_NONE 0
+#define CTLRA_USB_RECOVER_ACTIVE 1
+#define CTLRA_USB_RECOVER_FAILED 2
+	uint8_t usb_recover;
+	uint8_t usb_recover_step;
+	/* bitmasks of the interfaces to re-open, and those using hidraw */
+	uint8_t usb_recover_ifaces;
+	uint8_t usb_recover_hidraw;
+	struct timespec usb_recover_start;
+	struct timespec usb_recover_retry;
 
 	/* Certain complex controllers require more than one
 	 * usb interface to be fully controlled (typically screen/buttons
@@ -133,8 +153,33 @@ struct ctlra_dev_t {
 	 * functions */
 	void *usb_handle[CTLRA_USB_IFACE_PER_DEV];
 	uint8_t usb_interface[CTLRA_USB_IFACE_PER_DEV];
+	/* Set by drivers of HID devices before opening the interfaces, to
+	 * use /dev/hidrawX instead of claiming them through libusb. The
+	 * interface falls back to libusb if no hidraw node is usable. One
+	 * of CTLRA_USB_HIDRAW_* */
+	uint8_t usb_hidraw;
+	/* hidraw file descriptor of each interface, -1 when using libusb */
+	int hidraw_fd[CTLRA_USB_IFACE_PER_DEV];
+	/* bitmask of the hidraw interfaces with reports waiting, set by
+	 * epoll in ctlra_impl_hidraw_idle_iter(), and those registered */
+	uint8_t hidraw_ready;
+	uint8_t hidraw_polled;
+	/* io_uring state of each hidraw interface, see hidraw_uring.c */
+	void *hidraw_slot[CTLRA_USB_IFACE_PER_DEV];
 	/* linked list of outstanding async transfers */
 	void *usb_async_next;
+	/* Transfer classes, each with its own in-flight limit so screen
+	 * frames can not hold up input or LED writes. Defaults are set on
+	 * open, drivers may change them after */
+#define CTLRA_USB_CLASS_INPUT 0
+#define CTLRA_USB_CLASS_LED 1
+#define CTLRA_USB_CLASS_SCREEN 2
+#define CTLRA_USB_CLASS_COUNT 3
+	uint8_t usb_inflight_max[CTLRA_USB_CLASS_COUNT];
+	/* screen writes waiting for ctlra_impl_usb_screen_iter() */
+	void *usb_screen_head;
+	void *usb_screen_tail;
+	uint8_t usb_screen_queued;
 	/* statistics of USB backend */
 #define USB_XFER_INT_READ 0
 #define USB_XFER_INT_WRITE 1
@@ -146,7 +191,8 @@ struct ctlra_dev_t {
 #define USB_XFER_INFLIGHT_READ 7
 #define USB_XFER_INFLIGHT_WRITE 8
 #define USB_XFER_INFLIGHT_CANCEL 9
-#define USB_XFER_COUNT 10
+#define USB_XFER_INFLIGHT_BULK 10
+#define USB_XFER_COUNT 11
 	uint32_t usb_xfer_counts[USB_XFER_COUNT];
 
 
@@ -167,12 +213,29 @@ struct ctlra_dev_t {
 	ctlra_feedback_func feedback_func;
 	void *event_func_userdata;
 
+	/* Feedback scheduling, see ctlra_create_opts_t */
+	uint8_t feedback_dirty;
+	struct timespec feedback_last;
+	struct timespec light_flush_last_force;
+	/* Animated lights, allocated on first use. See anim.c */
+	struct ctlra_anim_list_t *anim;
+	/* Shadow of the LED reports, set by drivers that use one */
+	struct ctlra_led_shadow_t *leds;
+	/* Set by drivers when they changed lights themselves, eg: pad
+	 * lights following presses. Flushed in ctlra_idle_iter(), so
+	 * reading input never writes to the device */
+	uint8_t light_flush_pending;
+	/* Prebuilt feedback pages, see page.c */
+	struct ctlra_page_t **pages;
+	uint32_t num_pages;
+
 	/* Function pointers to poll events from device */
 	ctlra_dev_impl_poll poll;
 	ctlra_dev_impl_disconnect disconnect;
 
 	/* Function pointers to write feedback to device */
 	ctlra_dev_impl_light_set light_set;
+	ctlra_dev_impl_lights_set_bulk lights_set_bulk;
 	ctlra_dev_impl_feedback_set feedback_set;
 	ctlra_dev_impl_feedback_digits feedback_digits;
 	ctlra_dev_impl_grid_light_set grid_light_set;
@@ -207,9 +270,20 @@ typedef struct ctlra_dev_t *(*ctlra_dev_connect_func)(ctlra_event_func event_fun
  * @retval -ENODEV when device not found */
 int ctlra_dev_impl_usb_open(struct ctlra_dev_t *dev, int vid, int pid);
 
+/* Values of *usb_hidraw*. On usbhid a hidraw write is a synchronous
+ * transfer, so without io_uring each LED flush blocks the idle iter
+ * where a libusb write would be async. Drivers that only need hidraw to
+ * be reached on virtual devices, eg: the uhid rig, use the VIRTUAL
+ * value and keep libusb on real hardware */
+#define CTLRA_USB_HIDRAW_OFF     0
+#define CTLRA_USB_HIDRAW_ON      1
+#define CTLRA_USB_HIDRAW_VIRTUAL 2
+
 /** Opens the interface on a usb device. This allows controllers to make
  * multiple connections to interfaces, allowing access to screens, lights,
- * etc regardless of what USB endpoints they are presented on.
+ * etc regardless of what USB endpoints they are presented on. When the
+ * driver set *usb_hidraw*, the interface is opened as /dev/hidrawX and
+ * not claimed, so other readers of the device keep working.
  */
 int ctlra_dev_impl_usb_open_interface(struct ctlra_dev_t *ctlra_dev,
 				      int interface, int handle_idx);
@@ -241,6 +315,28 @@ void ctlra_dev_impl_banish(struct ctlra_dev_t *dev);
 
 /* IMPLEMENTATION DETAILS ONLY BELOW HERE */
 
+/* Returns 1 and moves *then* to *now* if at least *ns* nanoseconds
+ * passed between them, otherwise returns 0 */
+int ctlra_impl_interval_elapsed(struct timespec *then,
+				const struct timespec *now, uint64_t ns);
+
+/* Render the animated lights of *dev* if a tick is due, writing and
+ * flushing those that changed. Implementation in anim.c */
+void ctlra_impl_anim_tick(struct ctlra_t *ctlra, struct ctlra_dev_t *dev,
+			  const struct timespec *now);
+
+/* Animate a light, or with *grid* set to grid id + 1 the pad *light_id*
+ * of that grid through grid_light_set. Implementation in anim.c */
+int32_t ctlra_impl_anim_set(struct ctlra_dev_t *dev, uint32_t grid,
+			    uint32_t light_id,
+			    const struct ctlra_anim_t *anim);
+
+/* Release the animations of *dev*, before it is disconnected */
+void ctlra_impl_anim_free(struct ctlra_dev_t *dev);
+
+/* Release the feedback pages of *dev*. Implementation in page.c */
+void ctlra_impl_page_free(struct ctlra_dev_t *dev);
+
 
 struct ctlra_t
 {
@@ -254,6 +350,25 @@ struct ctlra_t
 	/* USB backend context */
 	struct libusb_context *ctx;
 	uint8_t usb_initialized;
+	/* Hotplugged devices waiting to be brought up, in arrival order */
+	struct ctlra_usb_pending_t *usb_pending;
+	/* Closed devices with transfers in flight, freed by the idle iter
+	 * once they are done, see ctlra_impl_usb_close_all() */
+	struct ctlra_usb_closing_t *usb_closing;
+	/* epoll instance of the hidraw interfaces, -1 until one is read */
+	int hidraw_epoll;
+	/* io_uring of the hidraw interfaces, used instead of epoll when
+	 * the kernel supports it. See hidraw_uring.c */
+	void *hidraw_ring;
+	uint8_t hidraw_ring_failed;
+	/* Screen bytes each USB bus may still send, refilled at the rate
+	 * of opts.screen_bus_mbytes_per_sec. See usb.c */
+#define CTLRA_USB_BUS_BUDGET_MAX 8
+	struct ctlra_usb_bus_budget_t {
+		uint8_t bus;
+		int64_t bytes;
+		struct timespec refill;
+	} usb_bus_budget[CTLRA_USB_BUS_BUDGET_MAX];
 
 	/* Linked list of devices currently in use */
 	struct ctlra_dev_t *dev_list;
@@ -262,6 +377,15 @@ struct ctlra_t
 
 	/* For devices with screens, this is redraw timeout in nanos. */
 	uint64_t screen_redraw_ns;
+	/* Minimum time between feedback calls in nanos, 0 for none */
+	uint64_t feedback_ns;
+	/* Minimum time between forced light flushes in nanos */
+	uint64_t feedback_force_ns;
+
+	/* Tempo for animations: *tempo_beat* was the beat at *tempo_time* */
+	float tempo_bpm;
+	double tempo_beat;
+	struct timespec tempo_time;
 
 	/* context aware error message pointer */
 	const char *strerror;
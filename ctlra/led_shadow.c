@@ -0,0 +1,126 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <string.h>
+
+#include "led_shadow.h"
+#include "impl.h"
+
+void
+ctlra_led_shadow_init(struct ctlra_led_shadow_t *s)
+{
+	memset(s, 0, sizeof(*s));
+}
+
+int32_t
+ctlra_led_shadow_add(struct ctlra_led_shadow_t *s, uint8_t *data,
+		     uint32_t size)
+{
+	if(!data || size == 0 || size > UINT16_MAX)
+		return -EINVAL;
+	if(s->num_reports >= CTLRA_LED_SHADOW_REPORTS_MAX ||
+	   s->sent_used + size > CTLRA_LED_SHADOW_BYTES_MAX)
+		return -ENOSPC;
+
+	struct ctlra_led_report_t *r = &s->reports[s->num_reports];
+	r->data = data;
+	r->sent = &s->sent_buf[s->sent_used];
+	r->size = size;
+	r->valid = 0;
+	s->sent_used += size;
+
+	return s->num_reports++;
+}
+
+void
+ctlra_led_shadow_invalidate(struct ctlra_led_shadow_t *s)
+{
+	for(uint32_t i = 0; i < s->num_reports; i++)
+		s->reports[i].valid = 0;
+}
+
+int32_t
+ctlra_led_shadow_dirty(struct ctlra_led_shadow_t *s, uint32_t report,
+		       uint32_t *first, uint32_t *end)
+{
+	if(report >= s->num_reports)
+		return 0;
+
+	struct ctlra_led_report_t *r = &s->reports[report];
+	uint32_t lo = 0;
+	uint32_t hi = r->size;
+
+	if(r->valid) {
+		while(lo < hi && r->data[lo] == r->sent[lo])
+			lo++;
+		if(lo == hi)
+			return 0;
+		while(r->data[hi-1] == r->sent[hi-1])
+			hi--;
+	}
+
+	if(first)
+		*first = lo;
+	if(end)
+		*end = hi;
+	return 1;
+}
+
+void
+ctlra_led_shadow_commit(struct ctlra_led_shadow_t *s, uint32_t report)
+{
+	if(report >= s->num_reports)
+		return;
+
+	struct ctlra_led_report_t *r = &s->reports[report];
+	memcpy(r->sent, r->data, r->size);
+	r->valid = 1;
+}
+
+void
+ctlra_led_shadow_flush(struct ctlra_led_shadow_t *s, struct ctlra_dev_t *dev,
+		       uint32_t idx, uint32_t endpoint, uint32_t force)
+{
+	if(force)
+		ctlra_led_shadow_invalidate(s);
+
+	for(uint32_t i = 0; i < s->num_reports; i++) {
+		if(!ctlra_led_shadow_dirty(s, i, 0, 0))
+			continue;
+
+		struct ctlra_led_report_t *r = &s->reports[i];
+		int ret = ctlra_dev_impl_usb_interrupt_write(dev, idx, endpoint,
+							     r->data, r->size);
+		if(ret > 0)
+			ctlra_led_shadow_commit(s, i);
+	}
+}
@@ -0,0 +1,98 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CTLRA_LED_SHADOW_H
+#define CTLRA_LED_SHADOW_H
+
+#include <stdint.h>
+
+struct ctlra_dev_t;
+
+/* Shadow of the feedback reports of a device. The driver keeps writing
+ * its LED buffers as before, and registers each report it sends with
+ * the shadow. The shadow keeps a copy of what was last written to the
+ * hardware, so at flush time the driver asks which reports differ and
+ * writes only those: setting one LED costs one report, and setting an
+ * LED to the value it already has costs nothing.
+ *
+ * Reports start out invalid, so the first flush writes all of them. */
+
+#define CTLRA_LED_SHADOW_REPORTS_MAX 4
+#define CTLRA_LED_SHADOW_BYTES_MAX   512
+
+struct ctlra_led_report_t {
+	/* buffer of the driver, the bytes as sent to the device */
+	uint8_t *data;
+	/* copy of the bytes last written, in the shadow */
+	uint8_t *sent;
+	uint16_t size;
+	/* zero until *sent* matches the hardware */
+	uint8_t valid;
+};
+
+struct ctlra_led_shadow_t {
+	uint32_t num_reports;
+	uint32_t sent_used;
+	struct ctlra_led_report_t reports[CTLRA_LED_SHADOW_REPORTS_MAX];
+	uint8_t sent_buf[CTLRA_LED_SHADOW_BYTES_MAX];
+};
+
+/* Remove all reports */
+void ctlra_led_shadow_init(struct ctlra_led_shadow_t *s);
+
+/* Register *size* bytes at *data* as one report. The buffer must stay
+ * valid while the shadow is used. Returns the report index, or -ENOSPC
+ * if the shadow is full. */
+int32_t ctlra_led_shadow_add(struct ctlra_led_shadow_t *s, uint8_t *data,
+			     uint32_t size);
+
+/* Forget what the hardware shows, so the next flush writes all reports.
+ * Used for forced flushes, and after the device lost its state */
+void ctlra_led_shadow_invalidate(struct ctlra_led_shadow_t *s);
+
+/* Returns 1 if *report* must be written, and stores the byte range that
+ * differs from the last write in [*first*, *end*). Returns 0 if the
+ * hardware is up to date. *first* and *end* may be NULL. */
+int32_t ctlra_led_shadow_dirty(struct ctlra_led_shadow_t *s,
+			       uint32_t report, uint32_t *first,
+			       uint32_t *end);
+
+/* Record that *report* was written to the hardware */
+void ctlra_led_shadow_commit(struct ctlra_led_shadow_t *s, uint32_t report);
+
+/* Write every dirty report to interrupt *endpoint* of USB handle *idx*,
+ * committing those the USB layer accepted. Dropped writes stay dirty and
+ * retry on the next flush. *force* invalidates the shadow first. */
+void ctlra_led_shadow_flush(struct ctlra_led_shadow_t *s,
+			    struct ctlra_dev_t *dev, uint32_t idx,
+			    uint32_t endpoint, uint32_t force);
+
+#endif /* CTLRA_LED_SHADOW_H */
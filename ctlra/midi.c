@@ -1,37 +1,158 @@
 
 #include "midi.h"
 
+#include <poll.h>
+#include <time.h>
 #include <alsa/asoundlib.h>
 
 /* for snd_seq_port_info_alloca() macro expansion */
 #include <alloca.h>
 
-struct ctlra_midi_t {
+/* One sequencer client, shared by any number of port pairs. Input for
+ * all ports arrives on the single client fd, and is routed to the port
+ * pair by the destination port of each event */
+struct ctlra_midi_client_t {
 	snd_seq_t *seq;
+	/* events to bytes, stateless as running status is disabled */
 	snd_midi_event_t *encoder;
+	/* input is stamped with the real time of this queue */
+	int queue;
+	uint64_t queue_start;
+	struct ctlra_midi_t *ports;
+	/* bytes written into the sequencer output buffer */
+	uint32_t out_queued;
+};
+
+/* Hardware ports opened with rawmidi bypass the sequencer, the bytes
+ * are parsed into messages here */
+#define RAW_READ_SIZE 256
+#define RAW_OUT_SIZE 1024
+/* longest wait for the port to take output that does not fit */
+#define RAW_WAIT_MS 500
+#define RAW_POLL_FDS 4
+
+struct ctlra_midi_raw_t {
+	snd_rawmidi_t *in;
+	snd_rawmidi_t *out;
+	/* parser state: running status, and the message being built */
+	uint8_t status;
+	uint8_t msg[3];
+	uint8_t used;
+	uint8_t need;
+	uint8_t in_sysex;
+	/* buffered output */
+	uint32_t out_used;
+	uint8_t out_buf[RAW_OUT_SIZE];
+};
+
+struct ctlra_midi_t {
+	/* one of the two backends is set */
+	struct ctlra_midi_client_t *client;
+	struct ctlra_midi_raw_t *raw;
+	/* the client was opened for this port alone by ctlra_midi_open() */
+	uint8_t owns_client;
+	struct ctlra_midi_t *next;
+	/* bytes to events, per port as it holds the running status */
 	snd_midi_event_t *decoder;
 	int port_in;
 	int port_out;
 	ctlra_midi_input_cb input_cb;
 	void *input_cb_ud;
+	/* time of the input being passed to the callback */
+	uint64_t input_time;
+	/* buffered output: the queued count that drains */
+	uint32_t out_threshold;
+	/* SysEx input is reassembled here, the buffer is kept for reuse */
+	ctlra_midi_sysex_cb sysex_cb;
+	uint8_t *sysex;
+	uint32_t sysex_used;
+	uint32_t sysex_size;
 };
 
-/* Create a single input and single output port for communicating with
- * MIDI controllers */
-struct ctlra_midi_t *ctlra_midi_open(const char *name,
-				     ctlra_midi_input_cb cb,
-				     void *userdata)
+/* The sequencer delivers long SysEx messages in pieces, write out long
+ * messages in pieces of the same size */
+#define SYSEX_CHUNK 256
+
+static inline uint64_t
+ctlra_midi_time_now(void)
 {
-	struct ctlra_midi_t *m = calloc(1, sizeof(struct ctlra_midi_t));
-	if(!m) return 0;
-	int res = snd_seq_open(&m->seq, "default",
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+static void ctlra_midi_raw_close(struct ctlra_midi_t *s);
+static int ctlra_midi_raw_flush(struct ctlra_midi_raw_t *r);
+static int ctlra_midi_raw_drain(struct ctlra_midi_raw_t *r);
+static void ctlra_midi_sysex_input(struct ctlra_midi_t *s,
+				   const uint8_t *data, uint32_t len);
+
+struct ctlra_midi_client_t *ctlra_midi_client_create(const char *name)
+{
+	struct ctlra_midi_client_t *c = calloc(1, sizeof(*c));
+	if(!c)
+		return 0;
+
+	int res = snd_seq_open(&c->seq, "default",
 	                       SND_SEQ_OPEN_DUPLEX, SND_SEQ_NONBLOCK);
 	if (res < 0) {
 		fprintf(stderr, "%s: failed to open seq\n", __func__);
+		free(c);
+		return 0;
+	}
+	snd_seq_set_client_name(c->seq, name);
+
+	res = snd_midi_event_new(0, &c->encoder);
+	if(res < 0) {
+		fprintf(stderr, "%s: error creating encoder\n", __func__);
+		snd_seq_close(c->seq);
+		free(c);
 		return 0;
 	}
+	snd_midi_event_no_status(c->encoder, 1);
+
+	/* the queue only provides the timestamps, nothing is scheduled */
+	c->queue = snd_seq_alloc_queue(c->seq);
+	if(c->queue < 0) {
+		fprintf(stderr, "%s: error creating queue\n", __func__);
+		snd_midi_event_free(c->encoder);
+		snd_seq_close(c->seq);
+		free(c);
+		return 0;
+	}
+	snd_seq_start_queue(c->seq, c->queue, NULL);
+	snd_seq_drain_output(c->seq);
+	c->queue_start = ctlra_midi_time_now();
+
+	return c;
+}
+
+void ctlra_midi_client_destroy(struct ctlra_midi_client_t *c)
+{
+	if(!c)
+		return;
+	while(c->ports)
+		ctlra_midi_destroy(c->ports);
+	snd_seq_free_queue(c->seq, c->queue);
+	snd_midi_event_free(c->encoder);
+	snd_seq_close(c->seq);
+	free(c);
+}
+
+/* Create a single input and single output port on *c* for communicating
+ * with a MIDI controller */
+struct ctlra_midi_t *ctlra_midi_open_port(struct ctlra_midi_client_t *c,
+					  const char *name,
+					  ctlra_midi_input_cb cb,
+					  void *userdata)
+{
+	if(!c)
+		return 0;
+
+	struct ctlra_midi_t *m = calloc(1, sizeof(struct ctlra_midi_t));
+	if(!m) return 0;
+	m->client = c;
 
-	snd_seq_set_client_name(m->seq, name);
 	snd_seq_port_info_t *pinfo;
 	snd_seq_port_info_alloca(&pinfo);
 
@@ -43,81 +164,569 @@ struct ctlra_midi_t *ctlra_midi_open(const char *name,
 	                           SND_SEQ_PORT_TYPE_MIDI_GENERIC |
 	                           SND_SEQ_PORT_TYPE_APPLICATION);
 	snd_seq_port_info_set_midi_channels(pinfo, 16);
+	snd_seq_port_info_set_timestamping(pinfo, 1);
+	snd_seq_port_info_set_timestamp_real(pinfo, 1);
+	snd_seq_port_info_set_timestamp_queue(pinfo, c->queue);
 
 	char buf[64];
 	snprintf(buf, sizeof(buf), "%s_input", name);
 	snd_seq_port_info_set_name(pinfo, buf);
-	m->port_in = snd_seq_create_port(m->seq, pinfo);
-	if (m->port_in < 0) {
+	int res = snd_seq_create_port(c->seq, pinfo);
+	if (res < 0) {
 		fprintf(stderr, "%s: failed to open port: %d\n",
-		        __func__, m->port_in);
-		return 0;
+		        __func__, res);
+		goto fail;
 	}
+	m->port_in = snd_seq_port_info_get_port(pinfo);
 
 	/* output port */
 	snprintf(buf, sizeof(buf), "%s_output", name);
-	m->port_out = snd_seq_create_simple_port(m->seq, buf,
+	m->port_out = snd_seq_create_simple_port(c->seq, buf,
 					   SND_SEQ_PORT_CAP_READ |
 						SND_SEQ_PORT_CAP_SUBS_READ,
 					   SND_SEQ_PORT_TYPE_MIDI_GENERIC |
 						SND_SEQ_PORT_TYPE_APPLICATION);
-	snd_seq_port_info_set_midi_channels(pinfo, 16);
 	if (m->port_out < 0) {
 		fprintf(stderr, "%s: failed to open port: %d\n",
 		        __func__, m->port_out);
-		return 0;
+		snd_seq_delete_port(c->seq, m->port_in);
+		goto fail;
 	}
 
-	/* initialize encoder / decoders */
-	res = snd_midi_event_new(0, &m->encoder);
-	if(res < 0)
-		printf("%s: error creating encoder\n", __func__);
-	snd_midi_event_no_status(m->encoder, 1);
-
 	res = snd_midi_event_new(32, &m->decoder);
-	if (res < 0)
-		printf("%s: error creating decoder\n", __func__);
+	if (res < 0) {
+		fprintf(stderr, "%s: error creating decoder\n", __func__);
+		snd_seq_delete_port(c->seq, m->port_in);
+		snd_seq_delete_port(c->seq, m->port_out);
+		goto fail;
+	}
 	snd_midi_event_init(m->decoder);
 
 	/* Keep callback / ud */
 	m->input_cb = cb;
 	m->input_cb_ud = userdata;
 
+	m->next = c->ports;
+	c->ports = m;
+
+	return m;
+fail:
+	free(m);
+	return 0;
+}
+
+struct ctlra_midi_t *ctlra_midi_open(const char *name,
+				     ctlra_midi_input_cb cb,
+				     void *userdata)
+{
+	struct ctlra_midi_client_t *c = ctlra_midi_client_create(name);
+	if(!c)
+		return 0;
+
+	struct ctlra_midi_t *m = ctlra_midi_open_port(c, name, cb, userdata);
+	if(!m) {
+		ctlra_midi_client_destroy(c);
+		return 0;
+	}
+	m->owns_client = 1;
 	return m;
 }
 
 void ctlra_midi_destroy(struct ctlra_midi_t *s)
 {
-	snd_seq_delete_port(s->seq, s->port_in);
-	snd_seq_delete_port(s->seq, s->port_out);
-	snd_midi_event_free(s->encoder);
+	if(s->raw) {
+		ctlra_midi_raw_close(s);
+		return;
+	}
+
+	struct ctlra_midi_client_t *c = s->client;
+
+	struct ctlra_midi_t **p = &c->ports;
+	while(*p != s)
+		p = &(*p)->next;
+	*p = s->next;
+
+	snd_seq_delete_port(c->seq, s->port_in);
+	snd_seq_delete_port(c->seq, s->port_out);
 	snd_midi_event_free(s->decoder);
-	snd_seq_close(s->seq);
+	if(s->owns_client)
+		ctlra_midi_client_destroy(c);
+	free(s->sysex);
 	free(s);
 }
 
+/* Length of the message started by *status*, including the status */
+static uint8_t
+ctlra_midi_msg_len(uint8_t status)
+{
+	switch (status & 0xf0) {
+	case 0xc0:
+	case 0xd0:
+		return 2;
+	case 0xf0:
+		break;
+	default:
+		return 3;
+	}
+
+	switch (status) {
+	case 0xf1:
+	case 0xf3:
+		return 2;
+	case 0xf2:
+		return 3;
+	default:
+		return 1;
+	}
+}
+
+struct ctlra_midi_t *ctlra_midi_open_raw(const char *device,
+					 ctlra_midi_input_cb cb,
+					 void *userdata)
+{
+	struct ctlra_midi_t *m = calloc(1, sizeof(struct ctlra_midi_t));
+	if(!m)
+		return 0;
+	m->raw = calloc(1, sizeof(struct ctlra_midi_raw_t));
+	if(!m->raw)
+		goto fail;
+
+	int res = snd_rawmidi_open(&m->raw->in, &m->raw->out, device,
+				   SND_RAWMIDI_NONBLOCK);
+	if (res < 0) {
+		fprintf(stderr, "%s: failed to open %s: %s\n", __func__,
+			device, snd_strerror(res));
+		goto fail;
+	}
+
+	m->input_cb = cb;
+	m->input_cb_ud = userdata;
+	return m;
+fail:
+	free(m->raw);
+	free(m);
+	return 0;
+}
+
+static void
+ctlra_midi_raw_close(struct ctlra_midi_t *s)
+{
+	ctlra_midi_raw_drain(s->raw);
+	snd_rawmidi_close(s->raw->in);
+	snd_rawmidi_close(s->raw->out);
+	free(s->raw);
+	free(s->sysex);
+	free(s);
+}
+
+/* Wait until the output port can take more bytes */
+static int
+ctlra_midi_raw_wait(struct ctlra_midi_raw_t *r)
+{
+	struct pollfd pfds[RAW_POLL_FDS];
+	int n = snd_rawmidi_poll_descriptors(r->out, pfds, RAW_POLL_FDS);
+	if (n <= 0)
+		return -EIO;
+
+	int res = poll(pfds, n, RAW_WAIT_MS);
+	if (res < 0)
+		return -errno;
+	if (res == 0)
+		return -ETIMEDOUT;
+	return 0;
+}
+
+/* Write as much of *data* as the kernel takes. The port is nonblocking,
+ * so this returns the bytes written, which may be less than *nbytes* */
+static long
+ctlra_midi_raw_send(struct ctlra_midi_raw_t *r, const uint8_t *data,
+		    uint32_t nbytes)
+{
+	uint32_t done = 0;
+	while (done < nbytes) {
+		long written = snd_rawmidi_write(r->out, &data[done],
+						 nbytes - done);
+		if (written == -EAGAIN || written == 0)
+			break;
+		if (written < 0)
+			return -ENOSPC;
+		done += written;
+	}
+	return done;
+}
+
+/* Write all of *data*, waiting for the port as its buffer drains */
+static int
+ctlra_midi_raw_send_all(struct ctlra_midi_raw_t *r, const uint8_t *data,
+			uint32_t nbytes)
+{
+	while (nbytes) {
+		long written = ctlra_midi_raw_send(r, data, nbytes);
+		if (written < 0)
+			return written;
+		data += written;
+		nbytes -= written;
+		if (nbytes) {
+			int res = ctlra_midi_raw_wait(r);
+			if (res < 0)
+				return res;
+		}
+	}
+	return 0;
+}
+
+/* Send what the port takes now, the unsent tail stays buffered and goes
+ * first on the next flush */
+static int
+ctlra_midi_raw_flush(struct ctlra_midi_raw_t *r)
+{
+	if (!r->out_used)
+		return 0;
+
+	long written = ctlra_midi_raw_send(r, r->out_buf, r->out_used);
+	if (written < 0) {
+		r->out_used = 0;
+		return written;
+	}
+	r->out_used -= written;
+	memmove(r->out_buf, &r->out_buf[written], r->out_used);
+	return 0;
+}
+
+/* Send all buffered bytes, waiting for the port */
+static int
+ctlra_midi_raw_drain(struct ctlra_midi_raw_t *r)
+{
+	int res = ctlra_midi_raw_send_all(r, r->out_buf, r->out_used);
+	r->out_used = 0;
+	return res;
+}
+
+static int
+ctlra_midi_raw_write(struct ctlra_midi_t *s, const uint8_t *data,
+		     uint32_t nbytes)
+{
+	struct ctlra_midi_raw_t *r = s->raw;
+	int res;
+
+	/* no room: wait for the port to take the buffered bytes */
+	while (r->out_used && r->out_used + nbytes > RAW_OUT_SIZE) {
+		res = ctlra_midi_raw_wait(r);
+		if (res == 0)
+			res = ctlra_midi_raw_flush(r);
+		if (res < 0)
+			return res;
+	}
+
+	/* larger than the buffer, which is empty now: straight out */
+	if (nbytes > RAW_OUT_SIZE) {
+		res = ctlra_midi_raw_send_all(r, data, nbytes);
+		return res < 0 ? res : (int)nbytes;
+	}
+
+	/* unbuffered output goes out now too, behind any leftover tail */
+	memcpy(&r->out_buf[r->out_used], data, nbytes);
+	r->out_used += nbytes;
+	if (!s->out_threshold || r->out_used >= s->out_threshold) {
+		res = ctlra_midi_raw_flush(r);
+		if (res < 0)
+			return res;
+	}
+	return nbytes;
+}
+
+static inline void
+ctlra_midi_raw_dispatch(struct ctlra_midi_t *s, uint8_t *msg, uint8_t len)
+{
+	if (s->input_cb)
+		s->input_cb(len, msg, s->input_cb_ud);
+}
+
+/* Parse the input byte stream into messages for the input callback,
+ * expanding running status. SysEx is passed to the SysEx reassembly
+ * in runs, as realtime bytes may be interleaved with the SysEx data */
+static void
+ctlra_midi_raw_parse(struct ctlra_midi_t *s, uint8_t *buf, uint32_t len)
+{
+	struct ctlra_midi_raw_t *r = s->raw;
+	/* start of the current run of SysEx bytes */
+	uint32_t sx = 0;
+
+	for (uint32_t i = 0; i < len; i++) {
+		uint8_t b = buf[i];
+
+		if (b >= 0xf8) {
+			if (r->in_sysex) {
+				ctlra_midi_sysex_input(s, &buf[sx], i - sx);
+				sx = i + 1;
+			}
+			ctlra_midi_raw_dispatch(s, &buf[i], 1);
+			continue;
+		}
+
+		if (r->in_sysex) {
+			if (b == 0xf7) {
+				ctlra_midi_sysex_input(s, &buf[sx],
+						       i + 1 - sx);
+				r->in_sysex = 0;
+				continue;
+			}
+			if (!(b & 0x80))
+				continue;
+			/* any other status ends the SysEx unfinished */
+			r->in_sysex = 0;
+			s->sysex_used = 0;
+		}
+
+		if (b == 0xf0) {
+			r->in_sysex = 1;
+			r->status = 0;
+			r->used = 0;
+			sx = i;
+			continue;
+		}
+
+		if (b & 0x80) {
+			/* system common messages cancel running status */
+			r->status = b < 0xf0 ? b : 0;
+			r->msg[0] = b;
+			r->used = 1;
+			r->need = ctlra_midi_msg_len(b);
+			if (r->need == 1) {
+				if (b != 0xf7)
+					ctlra_midi_raw_dispatch(s, r->msg, 1);
+				r->used = 0;
+			}
+			continue;
+		}
+
+		/* data byte, without a status byte uses running status */
+		if (r->used == 0) {
+			if (!r->status)
+				continue;
+			r->msg[0] = r->status;
+			r->used = 1;
+			r->need = ctlra_midi_msg_len(r->status);
+		}
+		r->msg[r->used++] = b;
+		if (r->used == r->need) {
+			ctlra_midi_raw_dispatch(s, r->msg, r->need);
+			r->used = 0;
+		}
+	}
+
+	/* the SysEx continues in the next read */
+	if (r->in_sysex)
+		ctlra_midi_sysex_input(s, &buf[sx], len - sx);
+}
+
+static int
+ctlra_midi_raw_poll(struct ctlra_midi_t *s)
+{
+	uint8_t buf[RAW_READ_SIZE];
+
+	/* read until the port is drained, a full read may have more */
+	for (;;) {
+		long nbytes = snd_rawmidi_read(s->raw->in, buf, sizeof(buf));
+		if (nbytes <= 0)
+			break;
+		/* rawmidi has no timestamps, use the time of the read */
+		s->input_time = ctlra_midi_time_now();
+		ctlra_midi_raw_parse(s, buf, nbytes);
+		if (nbytes < (long)sizeof(buf))
+			break;
+	}
+	return 0;
+}
+
+int ctlra_midi_output_buffered(struct ctlra_midi_t *s, uint32_t threshold)
+{
+	if(!s)
+		return -EINVAL;
+
+	/* drain anything queued under the previous setting */
+	int res = ctlra_midi_output_flush(s);
+	s->out_threshold = threshold;
+	return res;
+}
+
+int ctlra_midi_client_flush(struct ctlra_midi_client_t *c)
+{
+	if(!c->out_queued)
+		return 0;
+
+	/* the client is nonblocking: events the kernel did not take stay
+	 * in the output buffer, and are retried on the next flush */
+	int res = snd_seq_drain_output(c->seq);
+	if (res == -EAGAIN)
+		return 0;
+	if (res < 0) {
+		c->out_queued = 0;
+		return -ENOSPC;
+	}
+	c->out_queued = res;
+	return 0;
+}
+
+int ctlra_midi_output_flush(struct ctlra_midi_t *s)
+{
+	if(s->raw)
+		return ctlra_midi_raw_flush(s->raw);
+	return ctlra_midi_client_flush(s->client);
+}
+
+/* Account *nbytes* written to *s*, draining when over its threshold */
+static int
+ctlra_midi_output_queued(struct ctlra_midi_t *s, uint32_t nbytes)
+{
+	s->client->out_queued += nbytes;
+	if (s->client->out_queued >= s->out_threshold)
+		return ctlra_midi_client_flush(s->client);
+	return 0;
+}
+
 int ctlra_midi_output_write(struct ctlra_midi_t *s, uint8_t nbytes,
                             uint8_t * buffer)
 {
-	snd_seq_event_t seq_ev;
-	snd_seq_ev_clear(&seq_ev);
-	snd_seq_ev_set_source(&seq_ev, s->port_out);
-	snd_seq_ev_set_subs(&seq_ev);
-	snd_seq_ev_set_direct(&seq_ev);
+	if (s->raw)
+		return ctlra_midi_raw_write(s, buffer, nbytes);
 
-	int res = snd_midi_event_encode(s->decoder, buffer, nbytes, &seq_ev);
-	if (res < nbytes)
-		return -EINVAL;
+	uint32_t remaining = nbytes;
+
+	/* The parser keeps the last status byte, so *buffer* may hold a
+	 * number of messages, and running status continues across calls */
+	while(remaining) {
+		snd_seq_event_t seq_ev;
+		snd_seq_ev_clear(&seq_ev);
 
-	res = snd_seq_event_output(s->seq, &seq_ev);
+		long used = snd_midi_event_encode(s->decoder, buffer,
+						  remaining, &seq_ev);
+		if (used <= 0)
+			return -EINVAL;
+		buffer += used;
+		remaining -= used;
+
+		/* message not complete yet */
+		if (seq_ev.type == SND_SEQ_EVENT_NONE)
+			continue;
+
+		snd_seq_ev_set_source(&seq_ev, s->port_out);
+		snd_seq_ev_set_subs(&seq_ev);
+		snd_seq_ev_set_direct(&seq_ev);
+
+		int res = snd_seq_event_output(s->client->seq, &seq_ev);
+		if (res < 0)
+			return -ENOSPC;
+	}
+
+	int res = ctlra_midi_output_queued(s, nbytes);
 	if (res < 0)
-		return -ENOSPC;
+		return res;
+	return nbytes;
+}
+
+int ctlra_midi_output_sysex(struct ctlra_midi_t *s, uint32_t nbytes,
+			    const uint8_t *data)
+{
+	if (!s || nbytes < 2 || data[0] != 0xf0 || data[nbytes-1] != 0xf7)
+		return -EINVAL;
+
+	/* the bytes go out as they are, in one piece */
+	if (s->raw)
+		return ctlra_midi_raw_write(s, data, nbytes);
+
+	for (uint32_t done = 0; done < nbytes; done += SYSEX_CHUNK) {
+		uint32_t len = nbytes - done;
+		if (len > SYSEX_CHUNK)
+			len = SYSEX_CHUNK;
+
+		snd_seq_event_t seq_ev;
+		snd_seq_ev_clear(&seq_ev);
+		snd_seq_ev_set_source(&seq_ev, s->port_out);
+		snd_seq_ev_set_subs(&seq_ev);
+		snd_seq_ev_set_direct(&seq_ev);
+		snd_seq_ev_set_sysex(&seq_ev, len, (void *)&data[done]);
 
-	res = snd_seq_drain_output(s->seq);
+		/* the output buffer holds a copy of the data, and drains
+		 * to the kernel itself when full */
+		int res = snd_seq_event_output(s->client->seq, &seq_ev);
+		if (res < 0)
+			return -ENOSPC;
+	}
+
+	/* SysEx cancels running status */
+	snd_midi_event_reset_encode(s->decoder);
+
+	int res = ctlra_midi_output_queued(s, nbytes);
+	if (res < 0)
+		return res;
 	return nbytes;
 }
 
-int ctlra_midi_input_poll(struct ctlra_midi_t *s)
+void ctlra_midi_set_sysex_cb(struct ctlra_midi_t *s, ctlra_midi_sysex_cb cb)
+{
+	s->sysex_cb = cb;
+	s->sysex_used = 0;
+}
+
+/* Append a piece of SysEx, calling the callback on the final piece */
+static void
+ctlra_midi_sysex_input(struct ctlra_midi_t *s, const uint8_t *data,
+		       uint32_t len)
+{
+	if (!s->sysex_cb || len == 0)
+		return;
+
+	/* a new message drops any unfinished one */
+	if (data[0] == 0xf0)
+		s->sysex_used = 0;
+	else if (s->sysex_used == 0)
+		return;
+
+	/* whole message in one piece: no copy */
+	if (s->sysex_used == 0 && data[len-1] == 0xf7) {
+		s->sysex_cb(len, data, s->input_cb_ud);
+		return;
+	}
+
+	uint32_t need = s->sysex_used + len;
+	if (need > CTLRA_MIDI_SYSEX_MAX) {
+		s->sysex_used = 0;
+		return;
+	}
+	if (need > s->sysex_size) {
+		uint32_t size = s->sysex_size ? s->sysex_size : 1024;
+		while (size < need)
+			size *= 2;
+		uint8_t *b = realloc(s->sysex, size);
+		if (!b) {
+			s->sysex_used = 0;
+			return;
+		}
+		s->sysex = b;
+		s->sysex_size = size;
+	}
+
+	memcpy(&s->sysex[s->sysex_used], data, len);
+	s->sysex_used = need;
+
+	if (data[len-1] == 0xf7) {
+		s->sysex_cb(s->sysex_used, s->sysex, s->input_cb_ud);
+		s->sysex_used = 0;
+	}
+}
+
+/* Find the port pair an event was sent to */
+static struct ctlra_midi_t *
+ctlra_midi_client_port(struct ctlra_midi_client_t *c, int port)
+{
+	for(struct ctlra_midi_t *m = c->ports; m; m = m->next)
+		if(m->port_in == port)
+			return m;
+	return 0;
+}
+
+int ctlra_midi_client_poll(struct ctlra_midi_client_t *c)
 {
 	int res;
 	int nbytes;
@@ -127,25 +736,63 @@ int ctlra_midi_input_poll(struct ctlra_midi_t *s)
 	int input_pending = 1;
 
 	while (input_pending) {
-		res = snd_seq_event_input(s->seq, &seq_ev);
+		res = snd_seq_event_input(c->seq, &seq_ev);
 		if(res < 0)
 			return 0;
 
-		input_pending = snd_seq_event_input_pending(s->seq, 1);
+		input_pending = snd_seq_event_input_pending(c->seq, 1);
 		if (input_pending < 0) {
 			snd_seq_free_event(seq_ev);
 			return 0;
 		}
 
-		nbytes= snd_midi_event_decode(s->encoder, buffer, 3, seq_ev);
+		struct ctlra_midi_t *s = ctlra_midi_client_port(c,
+							seq_ev->dest.port);
+		if (!s) {
+			snd_seq_free_event(seq_ev);
+			continue;
+		}
+
+		if ((seq_ev->flags & SND_SEQ_TIME_STAMP_MASK) ==
+		    SND_SEQ_TIME_STAMP_REAL)
+			s->input_time = c->queue_start +
+				seq_ev->time.time.tv_sec * 1000000000ull +
+				seq_ev->time.time.tv_nsec;
+		else
+			s->input_time = ctlra_midi_time_now();
+
+		if (seq_ev->type == SND_SEQ_EVENT_SYSEX) {
+			ctlra_midi_sysex_input(s, seq_ev->data.ext.ptr,
+					       seq_ev->data.ext.len);
+			snd_seq_free_event(seq_ev);
+			continue;
+		}
+
+		nbytes= snd_midi_event_decode(c->encoder, buffer, 3, seq_ev);
 		if (nbytes < 0) {
+			snd_seq_free_event(seq_ev);
 			continue;
 		}
 
-		s->input_cb(nbytes, buffer, s->input_cb_ud);
+		if (s->input_cb)
+			s->input_cb(nbytes, buffer, s->input_cb_ud);
 
 		snd_seq_free_event(seq_ev);
 	}
 
 	return 0;
 }
+
+uint64_t ctlra_midi_input_time(struct ctlra_midi_t *s)
+{
+	return s->input_time;
+}
+
+int ctlra_midi_input_poll(struct ctlra_midi_t *s)
+{
+	if(s->raw)
+		return ctlra_midi_raw_poll(s);
+
+	/* input of the other ports of the client is dispatched too */
+	return ctlra_midi_client_poll(s->client);
+}
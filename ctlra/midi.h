@@ -35,26 +35,108 @@
 #include <stdint.h>
 
 struct ctlra_midi_t;
+struct ctlra_midi_client_t;
 
 /** the callback that will be called for each input event */
 typedef int (*ctlra_midi_input_cb)(uint8_t nbytes,
 				   uint8_t * buffer,
 				   void *ud);
 
-/** Open an ALSA MIDI port for Controller I/O */
+/** the callback that will be called for each complete SysEx message,
+ * from the 0xF0 up to and including the 0xF7. The *buffer* belongs to
+ * the port, and is only valid during the callback */
+typedef int (*ctlra_midi_sysex_cb)(uint32_t nbytes,
+				   const uint8_t * buffer,
+				   void *ud);
+
+/** Open an ALSA MIDI port for Controller I/O. This opens a sequencer
+ * client for the port alone, see ctlra_midi_open_port() to share one
+ * client between many devices */
 struct ctlra_midi_t *ctlra_midi_open(const char *name,
 				     ctlra_midi_input_cb cb,
 				     void *userdata);
 
-/** Cleanup the MIDI I/O ports */
+/** Open the ALSA rawmidi *device*, eg "hw:1,0,0", for Controller I/O.
+ * This bypasses the sequencer: input is read in batches and parsed in
+ * the library, and output bytes are written to the device as they are.
+ * Bytes the device cannot take yet stay queued, and are sent first by
+ * the next write or ctlra_midi_output_flush(). Use it for hardware MIDI
+ * controllers where latency matters; the returned port is used as one
+ * from ctlra_midi_open(). */
+struct ctlra_midi_t *ctlra_midi_open_raw(const char *device,
+					 ctlra_midi_input_cb cb,
+					 void *userdata);
+
+/** Cleanup the MIDI I/O ports, and the client if it was opened by
+ * ctlra_midi_open() */
 void ctlra_midi_destroy(struct ctlra_midi_t *s);
 
-/** Call this function to write MIDI output */
+/** Open an ALSA sequencer client that many port pairs can share. A rig
+ * of controllers then uses a single client and a single fd to poll,
+ * instead of one per device. */
+struct ctlra_midi_client_t *ctlra_midi_client_create(const char *name);
+
+/** Close the client, destroying any ports still open on it */
+void ctlra_midi_client_destroy(struct ctlra_midi_client_t *c);
+
+/** Open an input and output port pair named after *name* on client *c*.
+ * The returned ports are used as with ctlra_midi_open() */
+struct ctlra_midi_t *ctlra_midi_open_port(struct ctlra_midi_client_t *c,
+					  const char *name,
+					  ctlra_midi_input_cb cb,
+					  void *userdata);
+
+/** Poll the input of every port on the client at once, calling the
+ * callback of the port each event was sent to */
+int ctlra_midi_client_poll(struct ctlra_midi_client_t *c);
+
+/** Send the queued output of every port on the client in one write */
+int ctlra_midi_client_flush(struct ctlra_midi_client_t *c);
+
+/** Call this function to write MIDI output. The *buffer* may hold more
+ * than one message, and messages may use running status. Unless the
+ * output is buffered, the messages are sent before returning. */
 int ctlra_midi_output_write(struct ctlra_midi_t *s, uint8_t nbytes,
                             uint8_t * buffer);
 
+/** Queue output written to *s* in the sequencer output buffer, sending
+ * it when *threshold* bytes are queued or on ctlra_midi_output_flush().
+ * Call the flush once per ctlra_idle_iter(), so a burst of messages
+ * costs a single write. A *threshold* of 0 sends every message as it
+ * is written, which is the default. */
+int ctlra_midi_output_buffered(struct ctlra_midi_t *s, uint32_t threshold);
+
+/** Send all queued output of *s*. Ports share the output buffer of
+ * their client, so this sends the output of the other ports too */
+int ctlra_midi_output_flush(struct ctlra_midi_t *s);
+
+/** Write a SysEx message of *nbytes*, starting with 0xF0 and ending with
+ * 0xF7. Long messages are written in chunks, and follow the buffering
+ * of the port.
+ * @retval nbytes Success
+ * @retval -EINVAL The data is not a single SysEx message
+ * @retval -ENOSPC The sequencer output failed */
+int ctlra_midi_output_sysex(struct ctlra_midi_t *s, uint32_t nbytes,
+			    const uint8_t *data);
+
+/** Receive SysEx messages of up to CTLRA_MIDI_SYSEX_MAX bytes with *cb*,
+ * reassembled from the chunks the sequencer delivers. Without a SysEx
+ * callback, SysEx input is dropped. */
+void ctlra_midi_set_sysex_cb(struct ctlra_midi_t *s, ctlra_midi_sysex_cb cb);
+
+#define CTLRA_MIDI_SYSEX_MAX (64 * 1024)
+
+/** Returns the time the input being passed to the input or SysEx
+ * callback arrived, in nanoseconds on the CLOCK_MONOTONIC timeline.
+ * Sequencer ports are stamped by the sequencer queue of the client, so
+ * a burst of input read in one poll keeps its timing. Rawmidi ports are
+ * stamped with the time of the read. Only valid during a callback. */
+uint64_t ctlra_midi_input_time(struct ctlra_midi_t *s);
+
 /** Call this to poll for input. This results in the callback getting
- * called once for each input event */
+ * called once for each input event. On a shared client this polls the
+ * input of every port, so poll one port or the client once per
+ * iteration */
 int ctlra_midi_input_poll(struct ctlra_midi_t *s);
 
 #endif /* CTLRA_MIDI_H */
@@ -0,0 +1,113 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <string.h>
+
+#include "pad_filter.h"
+
+#define PADS CTLRA_PAD_FILTER_PADS_MAX
+
+/* Compare-exchange one pair of rows: after this a[] holds the minimum
+ * and b[] the maximum of each pad. Loops over the full row width so the
+ * compiler can vectorize it. */
+static inline void
+pad_filter_cmp_swap(uint16_t *a, uint16_t *b)
+{
+	for(int p = 0; p < PADS; p++) {
+		uint16_t lo = a[p] < b[p] ? a[p] : b[p];
+		uint16_t hi = a[p] < b[p] ? b[p] : a[p];
+		a[p] = lo;
+		b[p] = hi;
+	}
+}
+
+/* Optimal 19 comparator sorting network for 8 inputs */
+static const uint8_t pad_filter_network[][2] = {
+	{0, 2}, {1, 3}, {4, 6}, {5, 7},
+	{0, 4}, {1, 5}, {2, 6}, {3, 7},
+	{0, 1}, {2, 3}, {4, 5}, {6, 7},
+	{2, 4}, {3, 5},
+	{1, 4}, {3, 6},
+	{1, 2}, {3, 4}, {5, 6},
+};
+
+void
+ctlra_pad_filter_init(struct ctlra_pad_filter_t *f, uint32_t num_pads,
+		      uint16_t on_thres, uint16_t off_thres, uint32_t flags)
+{
+	memset(f, 0, sizeof(*f));
+	f->num_pads = num_pads > PADS ? PADS : num_pads;
+	f->on_thres = on_thres;
+	f->off_thres = off_thres;
+	f->flags = flags;
+}
+
+void
+ctlra_pad_filter_process(struct ctlra_pad_filter_t *f, uint32_t *hits,
+			 uint32_t *releases)
+{
+	uint16_t *oldest = f->history[f->idx];
+	f->idx = (f->idx + 1) & CTLRA_PAD_FILTER_MASK;
+
+	/* moving average: running sum, replacing the oldest sample */
+	for(int p = 0; p < PADS; p++) {
+		f->sum[p] += f->input[p];
+		f->sum[p] -= oldest[p];
+		oldest[p] = f->input[p];
+		f->average[p] = f->sum[p] / CTLRA_PAD_FILTER_KERNEL;
+	}
+
+	const uint16_t *value = f->input;
+	if(f->flags & CTLRA_PAD_FILTER_FLAG_MEDIAN) {
+		/* sort a copy, the history must stay in arrival order */
+		uint16_t s[CTLRA_PAD_FILTER_KERNEL][PADS];
+		memcpy(s, f->history, sizeof(s));
+		const int n = sizeof(pad_filter_network) /
+			      sizeof(pad_filter_network[0]);
+		for(int i = 0; i < n; i++)
+			pad_filter_cmp_swap(s[pad_filter_network[i][0]],
+					    s[pad_filter_network[i][1]]);
+		memcpy(f->median, s[CTLRA_PAD_FILTER_KERNEL/2],
+		       sizeof(f->median));
+		value = f->median;
+	}
+
+	uint32_t on = 0;
+	uint32_t off = 0;
+	for(uint32_t p = 0; p < f->num_pads; p++) {
+		on  |= (uint32_t)(value[p] > f->on_thres) << p;
+		off |= (uint32_t)(value[p] < f->off_thres) << p;
+	}
+
+	*hits = on & ~f->pressed;
+	*releases = off & f->pressed;
+	f->pressed = (f->pressed | *hits) & ~*releases;
+}
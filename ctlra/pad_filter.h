@@ -0,0 +1,88 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CTLRA_PAD_FILTER_H
+#define CTLRA_PAD_FILTER_H
+
+#include <stdint.h>
+
+/* Pressure filter shared by drivers with pressure sensitive pads. The
+ * state is stored as a structure-of-arrays: each history slot holds the
+ * sample of every pad, so a single report updates all pads in one pass
+ * of branch-free min/max operations instead of sorting each pad.
+ *
+ * Usage: the driver writes the raw pressures into input[] (pads absent
+ * from a report may keep their previous value), then calls process().
+ * The returned bitmasks hold the pads that were hit or released. */
+
+#define CTLRA_PAD_FILTER_PADS_MAX 16
+/* Must be 8: the median is taken with a fixed sorting network */
+#define CTLRA_PAD_FILTER_KERNEL   8
+#define CTLRA_PAD_FILTER_MASK     (CTLRA_PAD_FILTER_KERNEL-1)
+
+/* Detect onset/release on the median of the history, rejecting the
+ * single-sample spikes some pad ADCs produce. Without this flag the
+ * latest raw sample is used, and the median is not computed. */
+#define CTLRA_PAD_FILTER_FLAG_MEDIAN (1<<0)
+
+struct ctlra_pad_filter_t {
+	uint32_t num_pads;
+	uint32_t flags;
+	/* onset when value > on_thres, release when value < off_thres */
+	uint16_t on_thres;
+	uint16_t off_thres;
+	/* all pads arrive in one report, so share one ring index */
+	uint8_t idx;
+	/* bitmask of pads currently held down */
+	uint32_t pressed;
+
+	/* raw pressures of the current report, written by the driver */
+	uint16_t input[CTLRA_PAD_FILTER_PADS_MAX];
+	/* filtered outputs, valid after process() */
+	uint16_t median[CTLRA_PAD_FILTER_PADS_MAX];
+	uint16_t average[CTLRA_PAD_FILTER_PADS_MAX];
+
+	uint32_t sum[CTLRA_PAD_FILTER_PADS_MAX];
+	uint16_t history[CTLRA_PAD_FILTER_KERNEL][CTLRA_PAD_FILTER_PADS_MAX];
+};
+
+/* Reset all state and set the thresholds for *num_pads* pads */
+void ctlra_pad_filter_init(struct ctlra_pad_filter_t *f, uint32_t num_pads,
+			   uint16_t on_thres, uint16_t off_thres,
+			   uint32_t flags);
+
+/* Push input[] into the history, update median[] and average[], and
+ * detect state changes. Returns the bitmask of pads with an onset in
+ * *hits and of released pads in *releases. */
+void ctlra_pad_filter_process(struct ctlra_pad_filter_t *f,
+			      uint32_t *hits, uint32_t *releases);
+
+#endif /* CTLRA_PAD_FILTER_H */
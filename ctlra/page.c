@@ -0,0 +1,137 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "impl.h"
+#include "led_shadow.h"
+
+struct ctlra_page_t {
+	char name[CTLRA_STR_MAX];
+	/* bytes of every report of the shadow, back to back */
+	uint32_t size;
+	uint8_t data[];
+};
+
+/* copy the report buffers of *leds* to or from *buf* */
+static void
+page_copy(struct ctlra_led_shadow_t *leds, uint8_t *buf, int to_reports)
+{
+	for(uint32_t i = 0; i < leds->num_reports; i++) {
+		struct ctlra_led_report_t *r = &leds->reports[i];
+		if(to_reports)
+			memcpy(r->data, buf, r->size);
+		else
+			memcpy(buf, r->data, r->size);
+		buf += r->size;
+	}
+}
+
+int32_t
+ctlra_dev_page_find(struct ctlra_dev_t *dev, const char *name)
+{
+	if(!dev || !name)
+		return -ENOENT;
+
+	for(uint32_t i = 0; i < dev->num_pages; i++) {
+		if(strncmp(dev->pages[i]->name, name, CTLRA_STR_MAX - 1) == 0)
+			return i;
+	}
+	return -ENOENT;
+}
+
+int32_t
+ctlra_dev_page_build(struct ctlra_dev_t *dev, const char *name,
+		     ctlra_page_build_func func, void *userdata)
+{
+	if(!dev || !name || !func)
+		return -EINVAL;
+	struct ctlra_led_shadow_t *leds = dev->leds;
+	if(!leds || !leds->num_reports)
+		return -ENOTSUP;
+
+	/* sent_used is the total size of the reports */
+	const uint32_t size = leds->sent_used;
+	int32_t idx = ctlra_dev_page_find(dev, name);
+	struct ctlra_page_t *page;
+
+	if(idx < 0) {
+		struct ctlra_page_t **pages = realloc(dev->pages,
+				(dev->num_pages + 1) * sizeof(*pages));
+		if(!pages)
+			return -ENOMEM;
+		dev->pages = pages;
+
+		page = calloc(1, sizeof(*page) + size);
+		if(!page)
+			return -ENOMEM;
+		strncpy(page->name, name, CTLRA_STR_MAX - 1);
+		page->size = size;
+		idx = dev->num_pages++;
+		dev->pages[idx] = page;
+	} else {
+		page = dev->pages[idx];
+	}
+
+	/* build on the live buffers, and restore them afterwards */
+	uint8_t live[size];
+	page_copy(leds, live, 0);
+	func(dev, userdata);
+	page_copy(leds, page->data, 0);
+	page_copy(leds, live, 1);
+
+	return idx;
+}
+
+int32_t
+ctlra_dev_page_show(struct ctlra_dev_t *dev, int32_t page)
+{
+	if(!dev || page < 0 || (uint32_t)page >= dev->num_pages)
+		return -EINVAL;
+
+	/* the shadow turns this into writes of the changed reports */
+	page_copy(dev->leds, dev->pages[page]->data, 1);
+	if(dev->light_flush)
+		dev->light_flush(dev, 0);
+	return 0;
+}
+
+void
+ctlra_impl_page_free(struct ctlra_dev_t *dev)
+{
+	for(uint32_t i = 0; i < dev->num_pages; i++)
+		free(dev->pages[i]);
+	free(dev->pages);
+	dev->pages = 0;
+	dev->num_pages = 0;
+}
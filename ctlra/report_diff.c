@@ -0,0 +1,147 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#include <errno.h>
+#include <string.h>
+
+#include "report_diff.h"
+
+/* masked value of a control, without an unaligned 16 bit load. The
+ * high byte of a control at the end of a short report reads as zero */
+static inline uint16_t
+report_diff_value(const uint8_t *buf, uint32_t size, uint32_t offset,
+		  uint16_t mask)
+{
+	uint16_t v = buf[offset];
+	if(mask > 0xff && offset + 1 < size)
+		v |= buf[offset+1] << 8;
+	return v & mask;
+}
+
+void
+ctlra_report_diff_init(struct ctlra_report_diff_t *diff)
+{
+	memset(diff, 0, sizeof(*diff));
+	memset(diff->bit_to_ctlra, CTLRA_REPORT_DIFF_UNMAPPED,
+	       sizeof(diff->bit_to_ctlra));
+	diff->start = CTLRA_REPORT_DIFF_SIZE_MAX;
+}
+
+int
+ctlra_report_diff_add(struct ctlra_report_diff_t *diff, uint32_t idx,
+		      uint32_t buf_byte_offset, uint32_t mask)
+{
+	uint32_t last = buf_byte_offset + (mask > 0xff);
+	if(idx >= CTLRA_REPORT_DIFF_CTLRA_MAX || mask == 0 || mask > 0xffff ||
+	   last >= CTLRA_REPORT_DIFF_SIZE_MAX)
+		return -EINVAL;
+
+	diff->ctlra_offset[idx] = buf_byte_offset;
+	diff->ctlra_mask[idx] = mask;
+	if(idx >= diff->num_ctlra)
+		diff->num_ctlra = idx + 1;
+
+	for(int b = 0; b < 16; b++) {
+		if(mask & (1 << b))
+			diff->bit_to_ctlra[buf_byte_offset * 8 + b] = idx;
+	}
+
+	if(buf_byte_offset < diff->start)
+		diff->start = buf_byte_offset;
+	if(last + 1 > diff->end)
+		diff->end = last + 1;
+	return 0;
+}
+
+int
+ctlra_report_diff_add_table(struct ctlra_report_diff_t *diff,
+			    const struct ctlra_report_diff_ctlra_t *table,
+			    uint32_t count)
+{
+	ctlra_report_diff_init(diff);
+	for(uint32_t i = 0; i < count; i++) {
+		int ret = ctlra_report_diff_add(diff, i,
+						table[i].buf_byte_offset,
+						table[i].mask);
+		if(ret)
+			return ret;
+	}
+	return 0;
+}
+
+uint32_t
+ctlra_report_diff_process(struct ctlra_report_diff_t *diff,
+			  const uint8_t *buf, uint32_t size,
+			  struct ctlra_report_diff_change_t *changes,
+			  uint32_t max)
+{
+	uint32_t start = diff->start;
+	uint32_t end = diff->end < size ? diff->end : size;
+	if(end <= start)
+		return 0;
+
+	const uint32_t len = end - start;
+	if(memcmp(&diff->prev[start], &buf[start], len) == 0)
+		return 0;
+
+	uint32_t n = 0;
+	for(uint32_t i = start; i < end; i++) {
+		uint8_t x = diff->prev[i] ^ buf[i];
+		while(x) {
+			uint32_t b = __builtin_ctz(x);
+			x &= x - 1;
+
+			uint8_t c = diff->bit_to_ctlra[i * 8 + b];
+			if(c == CTLRA_REPORT_DIFF_UNMAPPED)
+				continue;
+
+			uint32_t off = diff->ctlra_offset[c];
+			uint16_t mask = diff->ctlra_mask[c];
+			uint16_t old = report_diff_value(diff->prev, end,
+							 off, mask);
+			uint16_t new = report_diff_value(buf, end, off, mask);
+
+			/* report multi-bit controls on their first
+			 * changed bit only */
+			if((i - off) * 8 + b != __builtin_ctz(old ^ new))
+				continue;
+
+			if(n < max) {
+				changes[n].idx = c;
+				changes[n].pressed = new > 0;
+				n++;
+			}
+		}
+	}
+
+	memcpy(&diff->prev[start], &buf[start], len);
+	return n;
+}
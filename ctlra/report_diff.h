@@ -0,0 +1,101 @@
+/*
+ * Copyright (c) 2017, OpenAV Productions,
+ * Harry van Haaren <harryhaaren@gmail.com>
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS
+ * IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A
+ * PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED
+ * TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR
+ * PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF
+ * LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING
+ * NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+*/
+
+#ifndef CTLRA_REPORT_DIFF_H
+#define CTLRA_REPORT_DIFF_H
+
+#include <stdint.h>
+
+/* Button decoder shared by the drivers. It keeps the previous raw report
+ * of one report-id, and XORs it against each new report: unchanged
+ * reports cost a single memcmp(), and otherwise only the bits that
+ * flipped are looked up in a bit to control map. The map is built once
+ * from the {event_id, buf_byte_offset, mask} tables of the driver, where
+ * the mask applies to the little-endian 16 bit word at the offset.
+ *
+ * Embed one instance per report-id that carries buttons. */
+
+#define CTLRA_REPORT_DIFF_SIZE_MAX   64
+#define CTLRA_REPORT_DIFF_CTLRA_MAX  128
+#define CTLRA_REPORT_DIFF_UNMAPPED   0xff
+
+struct ctlra_report_diff_t {
+	/* byte range of the report that contains mapped bits */
+	uint16_t start;
+	uint16_t end;
+	uint16_t num_ctlra;
+	/* previous report: zero (all released) before the first one */
+	uint8_t prev[CTLRA_REPORT_DIFF_SIZE_MAX];
+	/* report bit to control index */
+	uint8_t bit_to_ctlra[CTLRA_REPORT_DIFF_SIZE_MAX * 8];
+	/* offset and mask of each control, for multi-bit masks */
+	uint8_t ctlra_offset[CTLRA_REPORT_DIFF_CTLRA_MAX];
+	uint16_t ctlra_mask[CTLRA_REPORT_DIFF_CTLRA_MAX];
+};
+
+/* An entry of the button table of a driver */
+struct ctlra_report_diff_ctlra_t {
+	int event_id;
+	int buf_byte_offset;
+	uint32_t mask;
+};
+
+/* A control that changed state: *idx* is the index passed to add() */
+struct ctlra_report_diff_change_t {
+	uint8_t idx;
+	uint8_t pressed;
+};
+
+/* Reset the map and the previous report */
+void ctlra_report_diff_init(struct ctlra_report_diff_t *diff);
+
+/* Map the bits of *mask* at *buf_byte_offset* to control *idx*, which
+ * is usually the index in the table of the driver. Returns 0, or
+ * -EINVAL if the control does not fit in the decoder. */
+int ctlra_report_diff_add(struct ctlra_report_diff_t *diff, uint32_t idx,
+			  uint32_t buf_byte_offset, uint32_t mask);
+
+/* Reset the decoder and map entry i of *table* to control i. Returns
+ * 0, or -EINVAL if an entry does not fit: drivers fail to connect
+ * rather than silently lose a control. */
+int ctlra_report_diff_add_table(struct ctlra_report_diff_t *diff,
+				const struct ctlra_report_diff_ctlra_t *table,
+				uint32_t count);
+
+/* Diff *buf* against the previous report and store it. Writes each
+ * changed control to *changes* once, so *max* equal to the number of
+ * mapped controls never truncates. Returns the number of changes. */
+uint32_t ctlra_report_diff_process(struct ctlra_report_diff_t *diff,
+				   const uint8_t *buf, uint32_t size,
+				   struct ctlra_report_diff_change_t *changes,
+				   uint32_t max);
+
+#endif /* CTLRA_REPORT_DIFF_H */
@@ -4,15 +4,26 @@
 #include <stdlib.h>
 #include <stddef.h>
 #include <unistd.h>
+#include <time.h>
 
 #include "impl.h"
+#include "usb.h"
+#include "hidraw.h"
 
 #include <libusb.h>
 
 #define USB_PATH_MAX 256
 
 #define CTLRA_USE_ASYNC_XFER 1
-#define CTLRA_ASYNC_READ_MAX 10
+
+/* Default in-flight limits of the transfer classes. Screen frames are
+ * large, two in flight keeps the endpoint busy while the next one is
+ * queued. Writes beyond the queue are dropped, the next redraw sends
+ * the whole frame again */
+#define CTLRA_USB_INPUT_INFLIGHT_MAX 10
+#define CTLRA_USB_LED_INFLIGHT_MAX 10
+#define CTLRA_USB_SCREEN_INFLIGHT_MAX 2
+#define CTLRA_USB_SCREEN_QUEUE_MAX 4
 
 #ifndef LIBUSB_HOTPLUG_MATCH_ANY
 #define LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT 0xcafe
@@ -30,8 +41,167 @@ int libusb_set_auto_detach_kernel_driver() {return 0xcafe;}
 /* From cltra.c */
 extern int ctlra_impl_get_id_by_vid_pid(uint32_t vid, uint32_t pid);
 extern int ctlra_impl_accept_dev(struct ctlra_t *ctlra, int dev_id);
-extern int ctlra_impl_dev_get_by_vid_pid(struct ctlra_t *ctlra, int32_t vid,
-					 int32_t pid, struct ctlra_dev_t **out_dev);
+
+/* Bound on waiting for the final writes of devices being closed, and
+ * then for the cancelled transfers to be handed back */
+#define CTLRA_USB_CLOSE_WAIT_US 100000
+#define CTLRA_USB_CANCEL_WAIT_US 10000
+
+/* With flags_usb_reconnect, how long a device that failed a transfer
+ * may take to come back, and how often re-opening it is tried */
+#define CTLRA_USB_RECOVER_US 2000000
+#define CTLRA_USB_RECOVER_RETRY_US 50000
+
+static void ctlra_usb_impl_recover_iter(struct ctlra_t *ctlra);
+static void ctlra_usb_impl_closing_reap(struct ctlra_t *ctlra,
+					uint32_t wait_us);
+static int ctlra_usb_impl_enum_pin(libusb_device *dev,
+				   const struct libusb_device_descriptor *desc);
+
+/* A closed device, kept until its in-flight transfers are done. The
+ * transfers complete on this copy of the device, as the driver frees
+ * the original when disconnecting */
+struct ctlra_usb_closing_t {
+	struct ctlra_usb_closing_t *next;
+	/* when the device was closed, its writes are cancelled after
+	 * CTLRA_USB_CLOSE_WAIT_US */
+	struct timespec closed;
+	uint8_t writes_cancelled;
+	struct ctlra_dev_t dev;
+};
+
+/* A hotplugged device waiting to be brought up */
+struct ctlra_usb_pending_t {
+	struct ctlra_usb_pending_t *next;
+	libusb_device *dev;
+	struct libusb_device_descriptor desc;
+};
+
+/* The devices on the bus, enumerated once for the whole of
+ * ctlra_probe() rather than once per registered driver. The entries
+ * are sorted by VID:PID, so each driver finds its device by search */
+struct ctlra_usb_enum_entry_t {
+	uint32_t vid_pid;
+	uint64_t location;
+	libusb_device *dev;
+	struct libusb_device_descriptor desc;
+	/* handed to a driver, open or rejected by the application */
+	uint8_t taken;
+};
+
+/* HID devices not on USB probed with flags_hidraw_virtual set */
+#define USB_ENUM_VIRTUAL_MAX 64
+
+/* Set while probing, or for the single device being hotplugged */
+static struct {
+	libusb_device **list;
+	struct ctlra_usb_enum_entry_t *entries;
+	int count;
+	/* entries handed out to drivers */
+	uint32_t taken;
+} usb_enum;
+
+/* Identical devices are told apart by where they are plugged in: the
+ * bus number in the low byte, then one byte per port of the path from
+ * the root hub, which is at most 7 deep. Zero is never a location */
+#define USB_PORTS_MAX 7
+
+/* The devices opened in this process by location, so a driver opening
+ * a VID:PID skips the instances already in use, and unplug finds the
+ * instance that left. Open addressed, the size a power of two */
+#define USB_OPEN_SLOTS 128
+
+static struct ctlra_usb_open_t {
+	uint64_t location;
+	struct ctlra_dev_t *dev;
+} usb_open_table[USB_OPEN_SLOTS];
+
+static uint64_t ctlra_usb_impl_location(libusb_device *dev)
+{
+	uint8_t ports[USB_PORTS_MAX];
+	int n = libusb_get_port_numbers(dev, ports, sizeof(ports));
+	uint64_t loc = libusb_get_bus_number(dev);
+	for(int i = 0; i < n; i++)
+		loc |= (uint64_t)ports[i] << (8 * (i + 1));
+	return loc;
+}
+
+/* No interface of a just opened device is in use yet */
+static void ctlra_usb_impl_handles_reset(struct ctlra_dev_t *dev)
+{
+	memset(dev->usb_handle, 0, sizeof(dev->usb_handle));
+	for(int i = 0; i < CTLRA_USB_IFACE_PER_DEV; i++)
+		dev->hidraw_fd[i] = -1;
+
+	dev->usb_inflight_max[CTLRA_USB_CLASS_INPUT] =
+		CTLRA_USB_INPUT_INFLIGHT_MAX;
+	dev->usb_inflight_max[CTLRA_USB_CLASS_LED] =
+		CTLRA_USB_LED_INFLIGHT_MAX;
+	dev->usb_inflight_max[CTLRA_USB_CLASS_SCREEN] =
+		CTLRA_USB_SCREEN_INFLIGHT_MAX;
+}
+
+static inline uint32_t ctlra_usb_impl_slot(uint64_t location)
+{
+	return (location * 0x9e3779b97f4a7c15ull) >> 57;
+}
+
+static struct ctlra_usb_open_t *ctlra_usb_impl_open_find(uint64_t location)
+{
+	uint32_t i = ctlra_usb_impl_slot(location);
+	while(usb_open_table[i].location) {
+		if(usb_open_table[i].location == location)
+			return &usb_open_table[i];
+		i = (i + 1) & (USB_OPEN_SLOTS - 1);
+	}
+	return 0;
+}
+
+static int ctlra_usb_impl_open_add(uint64_t location, struct ctlra_dev_t *dev)
+{
+	uint32_t i = ctlra_usb_impl_slot(location);
+	for(uint32_t n = 0; n < USB_OPEN_SLOTS; n++) {
+		if(!usb_open_table[i].location) {
+			usb_open_table[i].location = location;
+			usb_open_table[i].dev = dev;
+			return 0;
+		}
+		i = (i + 1) & (USB_OPEN_SLOTS - 1);
+	}
+	return -ENOSPC;
+}
+
+static void ctlra_usb_impl_open_remove(uint64_t location)
+{
+	struct ctlra_usb_open_t *e = ctlra_usb_impl_open_find(location);
+	if(!e)
+		return;
+
+	/* shift back the entries after it that hashed to before it,
+	 * so that no probe sequence is broken by the hole */
+	uint32_t hole = e - usb_open_table;
+	uint32_t i = hole;
+	for(;;) {
+		i = (i + 1) & (USB_OPEN_SLOTS - 1);
+		if(!usb_open_table[i].location)
+			break;
+		uint32_t home = ctlra_usb_impl_slot(usb_open_table[i].location);
+		if(((i - home) & (USB_OPEN_SLOTS - 1)) >=
+		   ((i - hole) & (USB_OPEN_SLOTS - 1))) {
+			usb_open_table[hole] = usb_open_table[i];
+			hole = i;
+		}
+	}
+	usb_open_table[hole].location = 0;
+	usb_open_table[hole].dev = 0;
+}
+
+/* Closed devices are not in the table, only their copies complete */
+static int ctlra_usb_impl_is_open(struct ctlra_dev_t *dev)
+{
+	struct ctlra_usb_open_t *e = ctlra_usb_impl_open_find(dev->usb_location);
+	return e && e->dev == dev;
+}
 
 /* struct to track async USB transfers */
 struct usb_async_t {
@@ -68,14 +238,26 @@ ctlra_usb_impl_xfer_validate(struct ctlra_dev_t *dev)
 #define XFER_VALIDATE(dev)
 #endif
 
+/* Directions of transfers to cancel */
+#define USB_RELEASE_READS  (1 << 0)
+#define USB_RELEASE_WRITES (1 << 1)
+#define USB_RELEASE_ALL    (USB_RELEASE_READS | USB_RELEASE_WRITES)
+
+/* Cancel the in-flight transfers of *dev* in the directions of *mask* */
 static inline void
-ctlra_usb_impl_xfer_release(struct ctlra_dev_t *dev)
+ctlra_usb_impl_xfer_release(struct ctlra_dev_t *dev, int mask)
 {
 	struct ctlra_t *c = dev->ctlra_context;
 	struct usb_async_t *current = dev->usb_async_next;
 
 	int i = 0;
 	while(current) {
+		int dir = (current->xfer->endpoint & LIBUSB_ENDPOINT_IN) ?
+			  USB_RELEASE_READS : USB_RELEASE_WRITES;
+		if(!(mask & dir)) {
+			current = current->next;
+			continue;
+		}
 		CTLRA_DRIVER(c, "async free %d : %p\n", i, current);
 		int ret = libusb_cancel_transfer(current->xfer);
 		if(ret) {
@@ -143,96 +325,141 @@ static int ctlra_usb_impl_hotplug_cb(libusb_context *ctx,
 		CTLRA_INFO(ctlra, "Device removed: %04x:%04x\n",
 			   desc.idVendor, desc.idProduct);
 
-		/* NI Maschine Mikro MK2 */
-		if(desc.idVendor == 0x17cc && desc.idProduct == 0x1200) {
-			struct ctlra_dev_t *ni_mm;
-			int err = ctlra_impl_dev_get_by_vid_pid(ctlra,
-								0x17cc,
-								0x1200,
-								&ni_mm);
-			ctlra_dev_disconnect(ni_mm);
+		/* removed before it was brought up: nothing to disconnect */
+		struct ctlra_usb_pending_t **pp = &ctlra->usb_pending;
+		while(*pp) {
+			struct ctlra_usb_pending_t *p = *pp;
+			if(p->dev == dev) {
+				*pp = p->next;
+				libusb_unref_device(p->dev);
+				free(p);
+				return 0;
+			}
+			pp = &p->next;
 		}
 
-		/* Search through all devices matching on VID and PID.
-		 * If the device matches, we disconnect it from Ctlra.
-		 * TODO: Improve this to use the serial number if present.
-		 */
-		struct ctlra_dev_t *dev_iter = ctlra->dev_list;
-		while(dev_iter) {
-			struct ctlra_dev_t *tmp = dev_iter;
-			dev_iter = dev_iter->dev_list_next;
-
-			if(tmp->info.vendor_id == desc.idVendor &&
-				tmp->info.device_id == desc.idProduct) {
-				/* as the device has just been unplugged,
-				 * its too late to update state, so banish
-				 * and then disconnect */
-				tmp->banished = 1;
-				ctlra_dev_disconnect(tmp);
-			}
+		/* Find the instance by where it was plugged in, so only
+		 * it is removed when identical devices are in use. A
+		 * banished instance is disconnected by the idle iter */
+		struct ctlra_usb_open_t *e =
+			ctlra_usb_impl_open_find(ctlra_usb_impl_location(dev));
+		if(e && e->dev->ctlra_context == ctlra && !e->dev->banished) {
+			/* it may only have dropped off the bus for a moment */
+			if(ctlra->opts.flags_usb_reconnect &&
+			   e->dev->usb_recover != CTLRA_USB_RECOVER_FAILED &&
+			   ctlra_impl_usb_recover_start(e->dev) == 0)
+				return 0;
+
+			/* as the device has just been unplugged, its too
+			 * late to update state, so banish and then
+			 * disconnect */
+			e->dev->banished = 1;
+			ctlra_dev_disconnect(e->dev);
 		}
 
 		return 0;
 	}
 
 	if(event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
-
-		libusb_device_handle *handle = 0;
-		ret = libusb_open(dev, &handle);
-		if(ret != LIBUSB_SUCCESS)
+		/* Opening and setting up the device can take a long time,
+		 * eg claiming interfaces and writing screens. Queue it to
+		 * be brought up by ctlra_impl_usb_hotplug_iter() instead,
+		 * so the events of running devices are not held up */
+		struct ctlra_usb_pending_t *p = calloc(1, sizeof(*p));
+		if(!p)
 			return -1;
-		uint8_t buf[255];
-		ret = ctlra_usb_impl_get_serial(handle, desc.iSerialNumber,
-					  buf, 255);
-		if(ret)
-			snprintf((char *)buf, sizeof(buf), "---");
+		p->dev = libusb_ref_device(dev);
+		p->desc = desc;
 
-		CTLRA_INFO(ctlra, "Device attached: %04x:%04x, serial %s\n",
-			   desc.idVendor, desc.idProduct, buf);
-		/* Quirks:
-		 * Here we can handle strange hotplug issues. For example,
-		 * controllers that have a USB hub integrated show as the
-		 * hub first (so the hotplug picks up that VID/PID pair,
-		 * not the device itself for some reason). Here we can
-		 * modify the VID/PID pair based on known corner cases:
-		 */
-		uint32_t quirk_vid = desc.idVendor;
-		uint32_t quirk_pid = desc.idProduct;
-		switch(quirk_vid) {
-		case 0x17cc:
-			/* NI Kontrol D2, change PID from 0x1403 (hub) back
-			 * to the normal PID of 0x1400 */
-			if(quirk_pid == 0x1403)
-				quirk_pid = 0x1400;
-			break;
-		default: break;
-		};
+		struct ctlra_usb_pending_t **tail = &ctlra->usb_pending;
+		while(*tail)
+			tail = &(*tail)->next;
+		*tail = p;
+		return 0;
+	}
 
-		int id = ctlra_impl_get_id_by_vid_pid(quirk_vid, quirk_pid);
-		if(id < 0) {
-			/* Device is not supported by Ctlra, so release
-			 * the libusb handle which was opened to retrieve
-			 * the serial from the device */
-			CTLRA_WARN(ctlra, "Ctlra does not support hotplugged device %x %x\n",
-				   quirk_vid, quirk_pid);
-			libusb_close(handle);
-			return -1;
-		}
+	return 0;
+}
 
-		int accepted = ctlra_impl_accept_dev(ctlra, id);
-		if(!accepted)
-			libusb_close(handle);
+void ctlra_impl_usb_hotplug_iter(struct ctlra_t *ctlra)
+{
+	struct ctlra_usb_pending_t *p = ctlra->usb_pending;
+	if(!p)
+		return;
+	ctlra->usb_pending = p->next;
+
+	/* the instance of a device being recovered re-opens it itself */
+	if(ctlra_usb_impl_open_find(ctlra_usb_impl_location(p->dev))) {
+		libusb_unref_device(p->dev);
+		free(p);
+		return;
+	}
 
-		/* close the handle, since its no longer needed with
-		 * the device set up. This is different in the hotplug
-		 * path than the present-on-probe path, but also works.
-		 */
-		libusb_close(handle);
+	struct libusb_device_descriptor desc = p->desc;
+	libusb_device *usb_dev = p->dev;
+	free(p);
 
-		return 0;
+	libusb_device_handle *handle = 0;
+	int ret = libusb_open(usb_dev, &handle);
+	if(ret != LIBUSB_SUCCESS) {
+		libusb_unref_device(usb_dev);
+		return;
 	}
 
-	return 0;
+	uint8_t buf[255];
+	ret = ctlra_usb_impl_get_serial(handle, desc.iSerialNumber,
+				  buf, 255);
+	if(ret)
+		snprintf((char *)buf, sizeof(buf), "---");
+
+	CTLRA_INFO(ctlra, "Device attached: %04x:%04x, serial %s\n",
+		   desc.idVendor, desc.idProduct, buf);
+	/* Quirks:
+	 * Here we can handle strange hotplug issues. For example,
+	 * controllers that have a USB hub integrated show as the
+	 * hub first (so the hotplug picks up that VID/PID pair,
+	 * not the device itself for some reason). Here we can
+	 * modify the VID/PID pair based on known corner cases:
+	 */
+	uint32_t quirk_vid = desc.idVendor;
+	uint32_t quirk_pid = desc.idProduct;
+	switch(quirk_vid) {
+	case 0x17cc:
+		/* NI Kontrol D2, change PID from 0x1403 (hub) back
+		 * to the normal PID of 0x1400 */
+		if(quirk_pid == 0x1403)
+			quirk_pid = 0x1400;
+		break;
+	default: break;
+	};
+
+	int id = ctlra_impl_get_id_by_vid_pid(quirk_vid, quirk_pid);
+	if(id < 0) {
+		/* Device is not supported by Ctlra, so release
+		 * the libusb handle which was opened to retrieve
+		 * the serial from the device */
+		CTLRA_WARN(ctlra, "Ctlra does not support hotplugged device %x %x\n",
+			   quirk_vid, quirk_pid);
+		libusb_close(handle);
+		libusb_unref_device(usb_dev);
+		return;
+	}
+
+	/* open the device that arrived, not the first identical device
+	 * that is not open: that may be one the application rejected. A
+	 * hub quirk means the device itself is elsewhere on the bus */
+	int pinned = quirk_pid == desc.idProduct &&
+		     ctlra_usb_impl_enum_pin(usb_dev, &desc) == 0;
+	ctlra_impl_accept_dev(ctlra, id);
+	if(pinned)
+		ctlra_impl_usb_enum_end();
+	libusb_unref_device(usb_dev);
+
+	/* close the handle, since its no longer needed with
+	 * the device set up. This is different in the hotplug
+	 * path than the present-on-probe path, but also works.
+	 */
+	libusb_close(handle);
 }
 
 void ctlra_impl_usb_idle_iter(struct ctlra_t *ctlra)
@@ -242,6 +469,12 @@ void ctlra_impl_usb_idle_iter(struct ctlra_t *ctlra)
 	 * 2nd: timeval to wait - 0 returns as if non blocking
 	 * 3rd: int* to completed event - unused by Ctlra */
 	libusb_handle_events_timeout_completed(ctlra->ctx, &tv, NULL);
+
+	if(ctlra->usb_closing)
+		ctlra_usb_impl_closing_reap(ctlra, CTLRA_USB_CLOSE_WAIT_US);
+
+	ctlra_impl_hidraw_idle_iter(ctlra);
+	ctlra_usb_impl_recover_iter(ctlra);
 }
 
 int ctlra_dev_impl_usb_init(struct ctlra_t *ctlra)
@@ -288,9 +521,156 @@ int ctlra_dev_impl_usb_init(struct ctlra_t *ctlra)
 	return 0;
 }
 
+static int ctlra_usb_impl_enum_cmp(const void *a, const void *b)
+{
+	const struct ctlra_usb_enum_entry_t *ea = a;
+	const struct ctlra_usb_enum_entry_t *eb = b;
+	return (ea->vid_pid > eb->vid_pid) - (ea->vid_pid < eb->vid_pid);
+}
+
+/* identical devices are ordered by location, so they are opened in the
+ * same order on every probe */
+static int ctlra_usb_impl_enum_sort_cmp(const void *a, const void *b)
+{
+	const struct ctlra_usb_enum_entry_t *ea = a;
+	const struct ctlra_usb_enum_entry_t *eb = b;
+	int ret = ctlra_usb_impl_enum_cmp(a, b);
+	if(ret)
+		return ret;
+	return (ea->location > eb->location) - (ea->location < eb->location);
+}
+
+int ctlra_impl_usb_enum_begin(struct ctlra_t *ctlra)
+{
+	struct ctlra_hidraw_virtual_t virt[USB_ENUM_VIRTUAL_MAX];
+	int nvirt = 0;
+	if(ctlra->opts.flags_hidraw_virtual)
+		nvirt = ctlra_impl_hidraw_virtual_list(virt,
+						       USB_ENUM_VIRTUAL_MAX);
+
+	libusb_device **devs;
+	int cnt = libusb_get_device_list(ctlra->ctx, &devs);
+	if (cnt < 0)
+		return -1;
+
+	struct ctlra_usb_enum_entry_t *e = calloc(cnt + nvirt + 1, sizeof(*e));
+	if (!e) {
+		libusb_free_device_list(devs, 1);
+		return -ENOMEM;
+	}
+
+	int n = 0;
+	for (int i = 0; i < cnt; i++) {
+		int r = libusb_get_device_descriptor(devs[i], &e[n].desc);
+		if (r < 0) {
+			CTLRA_ERROR(ctlra, "device desc open failed %d", r);
+			continue;
+		}
+		e[n].dev = devs[i];
+		e[n].location = ctlra_usb_impl_location(devs[i]);
+		e[n].vid_pid = ((uint32_t)e[n].desc.idVendor << 16) |
+			       e[n].desc.idProduct;
+		n++;
+	}
+	/* virtual devices have no libusb device, only a hidraw node */
+	for (int i = 0; i < nvirt; i++, n++) {
+		e[n].desc.idVendor = virt[i].vendor_id;
+		e[n].desc.idProduct = virt[i].product_id;
+		e[n].location = virt[i].location;
+		e[n].vid_pid = ((uint32_t)virt[i].vendor_id << 16) |
+			       virt[i].product_id;
+	}
+	qsort(e, n, sizeof(*e), ctlra_usb_impl_enum_sort_cmp);
+
+	usb_enum.list = devs;
+	usb_enum.entries = e;
+	usb_enum.count = n;
+	return 0;
+}
+
+/* Limit the enumeration to *dev*, so the driver opens it rather than the
+ * first identical device that is not open */
+static int ctlra_usb_impl_enum_pin(libusb_device *dev,
+				   const struct libusb_device_descriptor *desc)
+{
+	struct ctlra_usb_enum_entry_t *e = calloc(1, sizeof(*e));
+	if (!e)
+		return -ENOMEM;
+	e->dev = dev;
+	e->desc = *desc;
+	e->location = ctlra_usb_impl_location(dev);
+	e->vid_pid = ((uint32_t)desc->idVendor << 16) | desc->idProduct;
+
+	usb_enum.entries = e;
+	usb_enum.count = 1;
+	return 0;
+}
+
+void ctlra_impl_usb_enum_end(void)
+{
+	if (!usb_enum.entries)
+		return;
+	if (usb_enum.list)
+		libusb_free_device_list(usb_enum.list, 1);
+	free(usb_enum.entries);
+	memset(&usb_enum, 0, sizeof(usb_enum));
+}
+
+/* Find a device in the probe enumeration that was not handed to a
+ * driver yet, returns 0 if there is none */
+static struct ctlra_usb_enum_entry_t *
+ctlra_usb_impl_enum_find(int vid, int pid)
+{
+	struct ctlra_usb_enum_entry_t key = {
+		.vid_pid = ((uint32_t)vid << 16) | (uint16_t)pid,
+	};
+	struct ctlra_usb_enum_entry_t *e = bsearch(&key, usb_enum.entries,
+						   usb_enum.count,
+						   sizeof(key),
+						   ctlra_usb_impl_enum_cmp);
+	if(!e)
+		return 0;
+
+	/* bsearch returns any of the identical devices */
+	struct ctlra_usb_enum_entry_t *end = &usb_enum.entries[usb_enum.count];
+	while(e > usb_enum.entries && e[-1].vid_pid == key.vid_pid)
+		e--;
+	for(; e < end && e->vid_pid == key.vid_pid; e++)
+		if(!e->taken && !ctlra_usb_impl_open_find(e->location))
+			return e;
+	return 0;
+}
+
+uint32_t ctlra_impl_usb_enum_taken(void)
+{
+	return usb_enum.taken;
+}
+
+int ctlra_impl_usb_enum_pending(int vid, int pid)
+{
+	return usb_enum.entries && ctlra_usb_impl_enum_find(vid, pid) != 0;
+}
+
 int ctlra_dev_impl_usb_open(struct ctlra_dev_t *ctlra_dev, int vid,
                             int pid)
 {
+	/* during probe, look the device up instead of walking the bus */
+	if(usb_enum.entries) {
+		struct ctlra_usb_enum_entry_t *e =
+			ctlra_usb_impl_enum_find(vid, pid);
+		if(!e)
+			return -1;
+		e->taken = 1;
+		usb_enum.taken++;
+		ctlra_dev->info.serial_number = e->desc.iSerialNumber;
+		ctlra_dev->info.vendor_id     = e->desc.idVendor;
+		ctlra_dev->info.device_id     = e->desc.idProduct;
+		ctlra_dev->usb_device = e->dev;
+		ctlra_dev->usb_location = e->location;
+		ctlra_usb_impl_handles_reset(ctlra_dev);
+		return 0;
+	}
+
 	int ret;
 
 	libusb_device **devs;
@@ -328,6 +708,11 @@ int ctlra_dev_impl_usb_open(struct ctlra_dev_t *ctlra_dev, int vid,
 
 		if(desc.idVendor  == vid &&
 		    desc.idProduct == pid) {
+			/* an identical device that is already open */
+			uint64_t location = ctlra_usb_impl_location(dev);
+			if(ctlra_usb_impl_open_find(location))
+				continue;
+			ctlra_dev->usb_location = location;
 			ctlra_dev->info.serial_number = desc.iSerialNumber;
 			ctlra_dev->info.vendor_id     = desc.idVendor;
 			ctlra_dev->info.device_id     = desc.idProduct;
@@ -340,15 +725,24 @@ int ctlra_dev_impl_usb_open(struct ctlra_dev_t *ctlra_dev, int vid,
 	if(!dev)
 		goto fail;
 	ctlra_dev->usb_device = dev;
-
-	memset(ctlra_dev->usb_handle, 0,
-	       sizeof(ctlra_dev->usb_handle));
+	ctlra_usb_impl_handles_reset(ctlra_dev);
 
 	return 0;
 fail:
 	return -1;
 }
 
+/* The first opened interface marks the device as in use */
+static void ctlra_usb_impl_open_mark(struct ctlra_dev_t *dev)
+{
+	if(ctlra_usb_impl_open_find(dev->usb_location))
+		return;
+	int ret = ctlra_usb_impl_open_add(dev->usb_location, dev);
+	if(ret)
+		CTLRA_WARN(dev->ctlra_context, "too many open devices: %d\n",
+			   ret);
+}
+
 int ctlra_dev_impl_usb_open_interface(struct ctlra_dev_t *ctlra_dev,
                                       int interface,
                                       int handle_idx)
@@ -361,6 +755,39 @@ int ctlra_dev_impl_usb_open_interface(struct ctlra_dev_t *ctlra_dev,
 			    handle_idx);
 		return -1;
 	}
+
+	/* A virtual device has only its hidraw node. Its other interfaces
+	 * open as sinks that discard writes, so the drivers of devices
+	 * with screens run unchanged */
+	if(ctlra_dev->usb_location & CTLRA_HIDRAW_VIRTUAL) {
+		if(ctlra_dev->usb_hidraw) {
+			int ret = ctlra_dev_impl_hidraw_open(ctlra_dev,
+							     interface,
+							     handle_idx);
+			if(ret) {
+				CTLRA_ERROR(ctlra, "virtual hidraw open error %s\n",
+					    strerror(-ret));
+				return -1;
+			}
+		}
+		ctlra_usb_impl_open_mark(ctlra_dev);
+		ctlra_dev->usb_interface[handle_idx] = interface;
+		return 0;
+	}
+
+	if(ctlra_dev->usb_hidraw == CTLRA_USB_HIDRAW_ON) {
+		int ret = ctlra_dev_impl_hidraw_open(ctlra_dev, interface,
+						     handle_idx);
+		if(ret == 0) {
+			ctlra_usb_impl_open_mark(ctlra_dev);
+			ctlra_dev->usb_interface[handle_idx] = interface;
+			return 0;
+		}
+		CTLRA_INFO(ctlra, "%04x:%04x interface %d: no hidraw (%s), using libusb\n",
+			   ctlra_dev->info.vendor_id, ctlra_dev->info.device_id,
+			   interface, strerror(-ret));
+	}
+
 	libusb_device *usb_dev = ctlra_dev->usb_device;
 	libusb_device_handle *handle = 0;
 
@@ -373,9 +800,12 @@ int ctlra_dev_impl_usb_open_interface(struct ctlra_dev_t *ctlra_dev,
 		return -1;
 	}
 
-	ctlra_usb_impl_get_serial(handle, ctlra_dev->info.serial_number,
-				  (uint8_t*)ctlra_dev->info.serial,
-				  CTLRA_DEV_SERIAL_MAX);
+	/* read once, not again for each further interface */
+	if(!ctlra_dev->info.serial[0])
+		ctlra_usb_impl_get_serial(handle,
+					  ctlra_dev->info.serial_number,
+					  (uint8_t*)ctlra_dev->info.serial,
+					  CTLRA_DEV_SERIAL_MAX);
 
 	/* enable auto management of kernel claiming / unclaiming */
 	if (libusb_has_capability(LIBUSB_CAP_SUPPORTS_DETACH_KERNEL_DRIVER)) {
@@ -404,6 +834,8 @@ int ctlra_dev_impl_usb_open_interface(struct ctlra_dev_t *ctlra_dev,
 		return -1;
 	}
 
+	ctlra_usb_impl_open_mark(ctlra_dev);
+
 	/* Commit to success: update handles in struct and return ok*/
 	ctlra_dev->usb_handle[handle_idx] = handle;
 	ctlra_dev->usb_interface[handle_idx] = interface;
@@ -413,14 +845,11 @@ int ctlra_dev_impl_usb_open_interface(struct ctlra_dev_t *ctlra_dev,
 
 #if CTLRA_USE_ASYNC_XFER
 static void ctlra_usb_xfr_done_generic(struct libusb_transfer *xfr,
-				       const int read)
+				       const int stat_idx)
 {
 	struct ctlra_dev_t *dev = xfr->user_data;
 	struct ctlra_t *ctlra = dev->ctlra_context;
 
-	const int stat_idx =
-		read ?  USB_XFER_INFLIGHT_READ : USB_XFER_INFLIGHT_WRITE;
-
 	switch(xfr->status) {
 	/* Success */
 	case LIBUSB_TRANSFER_COMPLETED: {
@@ -456,8 +885,11 @@ static void ctlra_usb_xfr_done_generic(struct libusb_transfer *xfr,
 	case LIBUSB_TRANSFER_OVERFLOW:
 		CTLRA_DRIVER(ctlra, "Ctlra: USB transfer error %s, dev banished.\n",
 			     libusb_error_name(xfr->status));
-		dev = xfr->user_data;
-		dev->banished = 1;
+		/* the copy of a closed device is only marked */
+		if(ctlra_usb_impl_is_open(dev))
+			ctlra_dev_impl_banish(dev);
+		else
+			dev->banished = 1;
 		break;
 	default:
 		CTLRA_DRIVER(ctlra, "USB transaction has unknown status: %d\n",
@@ -471,7 +903,8 @@ static void ctlra_usb_xfr_done_generic(struct libusb_transfer *xfr,
 	struct usb_async_t *async = (struct usb_async_t *)
 		(((uint8_t *)xfr->buffer) - offsetof(struct usb_async_t, malloc_mem));
 	CTLRA_DRIVER(ctlra, "free %s async @ %p\n",
-		     read == 1 ? "read" : "write", async);
+		     stat_idx == USB_XFER_INFLIGHT_READ ? "read" : "write",
+		     async);
 
 	XFER_VALIDATE(dev);
 
@@ -496,14 +929,33 @@ static void ctlra_usb_xfr_done_generic(struct libusb_transfer *xfr,
 
 static void ctlra_usb_xfr_done_cb(struct libusb_transfer *xfr)
 {
-	const int read = 1;
-	ctlra_usb_xfr_done_generic(xfr, read);
+	ctlra_usb_xfr_done_generic(xfr, USB_XFER_INFLIGHT_READ);
 }
 
 static void ctlra_usb_xfr_write_done_cb(struct libusb_transfer *xfr)
 {
-	const int read = 0;
-	ctlra_usb_xfr_done_generic(xfr, read);
+	ctlra_usb_xfr_done_generic(xfr, USB_XFER_INFLIGHT_WRITE);
+}
+
+static void ctlra_usb_xfr_bulk_done_cb(struct libusb_transfer *xfr)
+{
+	ctlra_usb_xfr_done_generic(xfr, USB_XFER_INFLIGHT_BULK);
+}
+
+/* Insert a submitted transfer at the head of the list of *dev*, so it
+ * is cancelled on close. Completions only run from libusb event
+ * handling, so it is safe to link it in after submitting */
+static void ctlra_usb_impl_async_link(struct ctlra_dev_t *dev,
+				      struct usb_async_t *async)
+{
+	XFER_VALIDATE(dev);
+	struct usb_async_t *dev_current = dev->usb_async_next;
+	if(dev_current)
+		dev_current->prev = async;
+	async->next = dev_current;
+	async->prev = 0;
+	dev->usb_async_next = async;
+	XFER_VALIDATE(dev);
 }
 #endif /* CTLRA_USE_ASYNC_XFER */
 
@@ -514,6 +966,16 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 	int transferred;
 	struct ctlra_t *ctlra = dev->ctlra_context;
 
+	/* the handles are closed while re-opening the device */
+	if(dev->usb_recover != CTLRA_USB_RECOVER_NONE)
+		return 0;
+	if(dev->hidraw_fd[idx] >= 0)
+		return ctlra_dev_impl_hidraw_read(dev, idx, endpoint, data,
+						  size);
+	/* sink interface of a virtual device */
+	if(!dev->usb_device)
+		return 0;
+
 /* we can use synchronous reads too, but the latency builds up of the
  * timeout. AKA: with 6 devices, at 100 ms each, 600ms between a re-poll
  * of the USB device - totally unacceptable.
@@ -523,7 +985,7 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
  */
 #if CTLRA_USE_ASYNC_XFER
 	int inf_reads = dev->usb_xfer_counts[USB_XFER_INFLIGHT_READ];
-	if(inf_reads >= CTLRA_ASYNC_READ_MAX) {
+	if(inf_reads >= dev->usb_inflight_max[CTLRA_USB_CLASS_INPUT]) {
 		dev->usb_xfer_counts[USB_XFER_ERROR]++;
 		return 0;
 	}
@@ -535,6 +997,8 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 	xfr = libusb_alloc_transfer(0);
 	if(xfr == 0) {
 		CTLRA_DRIVER(ctlra, "xfr == %p\n", xfr);
+		dev->usb_xfer_counts[USB_XFER_ERROR]++;
+		return 0;
 	}
 
 	/* Malloc space for the USB transaction - not ideal, but we have
@@ -548,18 +1012,11 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 	 * due to just allocating a slightly block, and keeping the list
 	 * pointer at the start of the block, before the libusb xfer mem */
 	struct usb_async_t *async = malloc(size + sizeof(struct usb_async_t));
-
-	XFER_VALIDATE(dev);
-
-	/* insert at head into double-linked list for device */
-	struct usb_async_t *dev_current = dev->usb_async_next;
-	if(dev_current)
-		dev_current->prev = async;
-	async->next = dev_current;
-	async->prev = 0;
-	dev->usb_async_next = async;
-
-	XFER_VALIDATE(dev);
+	if(!async) {
+		libusb_free_transfer(xfr);
+		dev->usb_xfer_counts[USB_XFER_ERROR]++;
+		return 0;
+	}
 
 	/* back-pointer from async to xfer */
 	async->xfer = xfr;
@@ -585,7 +1042,7 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 	 * of reads will catch any data if available */
 	if(res) {
 		libusb_free_transfer(xfr);
-		free(usb_data);
+		free(async);
 		if(res == LIBUSB_ERROR_IO)
 			return 0;
 
@@ -593,7 +1050,8 @@ int ctlra_dev_impl_usb_interrupt_read(struct ctlra_dev_t *dev, uint32_t idx,
 		return -1;
 	}
 
-
+	/* insert at head into double-linked list for device */
+	ctlra_usb_impl_async_link(dev, async);
 	dev->usb_xfer_counts[USB_XFER_INFLIGHT_READ]++;
 	dev->usb_xfer_counts[USB_XFER_INT_READ]++;
 	CTLRA_DRIVER(ctlra, "async int read @ %p\n", async);
@@ -646,8 +1104,16 @@ int ctlra_dev_impl_usb_interrupt_write(struct ctlra_dev_t *dev, uint32_t idx,
 	struct ctlra_t *ctlra = dev->ctlra_context;
 	const uint32_t timeout = 0;
 
+	/* dropped, the light flush after re-opening writes them all */
+	if(dev->usb_recover != CTLRA_USB_RECOVER_NONE)
+		return 0;
+	if(dev->hidraw_fd[idx] >= 0)
+		return ctlra_dev_impl_hidraw_write(dev, idx, data, size);
+	if(!dev->usb_device)
+		return size;
+
 	int inf = dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE];
-	if(inf >= CTLRA_ASYNC_READ_MAX) {
+	if(inf >= dev->usb_inflight_max[CTLRA_USB_CLASS_LED]) {
 		dev->usb_xfer_counts[USB_XFER_ERROR]++;
 		return 0;
 	}
@@ -655,23 +1121,19 @@ int ctlra_dev_impl_usb_interrupt_write(struct ctlra_dev_t *dev, uint32_t idx,
 #if CTLRA_USE_ASYNC_XFER
 	struct libusb_transfer *xfr;
 	xfr = libusb_alloc_transfer(0);
-	if(xfr == 0)
+	if(xfr == 0) {
 		CTLRA_ERROR(ctlra, "write xfr == %p!\n", xfr);
+		dev->usb_xfer_counts[USB_XFER_ERROR]++;
+		return -ENOSPC;
+	}
 
 	/* see comment in interrupt read for malloc() and async details */
 	struct usb_async_t *async = malloc(size + sizeof(struct usb_async_t));
 	if(!async) {
+		libusb_free_transfer(xfr);
 		dev->usb_xfer_counts[USB_XFER_ERROR]++;
 		return -ENOSPC;
 	}
-	XFER_VALIDATE(dev);
-	struct usb_async_t *dev_current = dev->usb_async_next;
-	if(dev_current)
-		dev_current->prev = async;
-	async->next = dev_current;
-	async->prev = 0;
-	dev->usb_async_next = async;
-	XFER_VALIDATE(dev);
 
 	/* back-pointer from async to xfer */
 	async->xfer = xfr;
@@ -690,10 +1152,11 @@ int ctlra_dev_impl_usb_interrupt_write(struct ctlra_dev_t *dev, uint32_t idx,
 				       timeout);
 	if(libusb_submit_transfer(xfr) < 0) {
 		libusb_free_transfer(xfr);
-		free(usb_data);
+		free(async);
 		//printf("error submitting data!!\n");
 		return -1;
 	}
+	ctlra_usb_impl_async_link(dev, async);
 
 	dev->usb_xfer_counts[USB_XFER_INT_WRITE]++;
 	dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE]++;
@@ -727,34 +1190,35 @@ int ctlra_dev_impl_usb_bulk_write(struct ctlra_dev_t *dev, uint32_t idx,
 	struct ctlra_t *ctlra = dev->ctlra_context;
 	const uint32_t timeout = 0;
 
-	int inf = dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE];
-	if(inf >= CTLRA_ASYNC_READ_MAX) {
-		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
+	/* the driver's frame is written again after re-opening */
+	if(dev->usb_recover != CTLRA_USB_RECOVER_NONE)
 		return 0;
-	}
+	/* HID interfaces have no bulk endpoints */
+	if(dev->hidraw_fd[idx] >= 0)
+		return -ENOTSUP;
+	if(!dev->usb_device)
+		return size;
 
 #if CTLRA_USE_ASYNC_XFER
-	struct libusb_transfer *xfr;
-	xfr = libusb_alloc_transfer(0);
-	if(xfr == 0)
-		CTLRA_ERROR(ctlra, "write xfr == %p!\n", xfr);
+	/* Screen frames are queued, and submitted by
+	 * ctlra_impl_usb_screen_iter() once the input and LED transfers
+	 * of this iteration are on their way */
+	if(dev->usb_screen_queued >= CTLRA_USB_SCREEN_QUEUE_MAX) {
+		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
+		return 0;
+	}
 
 	/* see comment in interrupt read for malloc() and async details */
+	struct libusb_transfer *xfr = libusb_alloc_transfer(0);
 	struct usb_async_t *async = malloc(size + sizeof(struct usb_async_t));
-	if(!async) {
+	if(!xfr || !async) {
+		libusb_free_transfer(xfr);
+		free(async);
 		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
 		return -ENOSPC;
 	}
-	XFER_VALIDATE(dev);
-	struct usb_async_t *dev_current = dev->usb_async_next;
-	if(dev_current)
-		dev_current->prev = async;
-	async->next = dev_current;
+	async->next = 0;
 	async->prev = 0;
-	dev->usb_async_next = async;
-	XFER_VALIDATE(dev);
-
-	/* back-pointer from async to xfer */
 	async->xfer = xfr;
 
 	void *usb_data = &async->malloc_mem;
@@ -764,23 +1228,21 @@ int ctlra_dev_impl_usb_bulk_write(struct ctlra_dev_t *dev, uint32_t idx,
 				       endpoint,
 				       usb_data,
 				       size,
-				       ctlra_usb_xfr_write_done_cb,
+				       ctlra_usb_xfr_bulk_done_cb,
 				       dev, /* userdata - pass dev to
 					       banish it if required */
 				       timeout);
-	if(libusb_submit_transfer(xfr) < 0) {
-		libusb_free_transfer(xfr);
-		free(async);
-		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
-		//printf("error submitting data!!\n");
-		return -1;
-	}
 
-	dev->usb_xfer_counts[USB_XFER_BULK_WRITE]++;
-	dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE]++;
+	/* the queue is linked through async->next until submitted */
+	struct usb_async_t *tail = dev->usb_screen_tail;
+	if(tail)
+		tail->next = async;
+	else
+		dev->usb_screen_head = async;
+	dev->usb_screen_tail = async;
+	dev->usb_screen_queued++;
 
-	/* do we want to return the size here? */
-	/* This read op is async - there *IS* no data written yet */
+	/* the data is copied, the caller may reuse its buffer */
 	return size;
 #else
 	int r = libusb_bulk_transfer(dev->usb_handle[idx], endpoint,
@@ -813,6 +1275,128 @@ int ctlra_dev_impl_usb_bulk_write(struct ctlra_dev_t *dev, uint32_t idx,
 #endif /* CTLRA_USE_ASYNC_XFER */
 }
 
+#if CTLRA_USE_ASYNC_XFER
+/* Submit the first queued screen write of *dev*. Returns its size, or
+ * -1 if it failed and was dropped */
+static int ctlra_usb_impl_screen_submit(struct ctlra_dev_t *dev)
+{
+	struct usb_async_t *async = dev->usb_screen_head;
+	dev->usb_screen_head = async->next;
+	if(!dev->usb_screen_head)
+		dev->usb_screen_tail = 0;
+	dev->usb_screen_queued--;
+
+	if(libusb_submit_transfer(async->xfer) < 0) {
+		libusb_free_transfer(async->xfer);
+		free(async);
+		dev->usb_xfer_counts[USB_XFER_BULK_ERROR]++;
+		return -1;
+	}
+
+	ctlra_usb_impl_async_link(dev, async);
+
+	dev->usb_xfer_counts[USB_XFER_BULK_WRITE]++;
+	dev->usb_xfer_counts[USB_XFER_INFLIGHT_BULK]++;
+	return async->xfer->length;
+}
+
+/* Submit everything queued, eg: the last frame before closing */
+static void ctlra_usb_impl_screen_flush(struct ctlra_dev_t *dev)
+{
+	while(dev->usb_screen_head)
+		ctlra_usb_impl_screen_submit(dev);
+}
+
+/* Free everything queued without sending it */
+static void ctlra_usb_impl_screen_drop(struct ctlra_dev_t *dev)
+{
+	while(dev->usb_screen_head) {
+		struct usb_async_t *async = dev->usb_screen_head;
+		dev->usb_screen_head = async->next;
+		libusb_free_transfer(async->xfer);
+		free(async);
+	}
+	dev->usb_screen_tail = 0;
+	dev->usb_screen_queued = 0;
+}
+
+/* Returns the screen budget of the bus *dev* is on, refilled up to
+ * *now*, or NULL if the bus is not limited */
+static struct ctlra_usb_bus_budget_t *
+ctlra_usb_impl_bus_budget(struct ctlra_t *ctlra, struct ctlra_dev_t *dev,
+			  const struct timespec *now)
+{
+	const int64_t rate = ctlra->opts.screen_bus_mbytes_per_sec * 1000000ll;
+	/* at most 100 ms worth is saved up, so an idle bus can not burst */
+	const int64_t burst = rate / 10;
+
+	/* bus numbers start at 1, entries with bus 0 are unused. Buses
+	 * beyond the table size are not limited */
+	uint8_t bus = libusb_get_bus_number(dev->usb_device);
+	struct ctlra_usb_bus_budget_t *b = 0;
+	for(int i = 0; i < CTLRA_USB_BUS_BUDGET_MAX && !b; i++) {
+		struct ctlra_usb_bus_budget_t *e = &ctlra->usb_bus_budget[i];
+		if(e->bus == bus || e->bus == 0)
+			b = e;
+	}
+	if(!b)
+		return 0;
+
+	if(b->bus == 0) {
+		b->bus = bus;
+		b->bytes = burst;
+		b->refill = *now;
+		return b;
+	}
+
+	double secs = (now->tv_sec - b->refill.tv_sec) +
+		      (now->tv_nsec - b->refill.tv_nsec) / 1000000000.;
+	b->refill = *now;
+	b->bytes += (int64_t)(rate * secs);
+	if(b->bytes > burst)
+		b->bytes = burst;
+	return b;
+}
+#endif /* CTLRA_USE_ASYNC_XFER */
+
+void ctlra_impl_usb_screen_iter(struct ctlra_t *ctlra)
+{
+#if CTLRA_USE_ASYNC_XFER
+	const int limit_bus = ctlra->opts.screen_bus_mbytes_per_sec != 0;
+	struct timespec now;
+	if(limit_bus)
+		clock_gettime(CLOCK_MONOTONIC, &now);
+
+	/* one write per device per pass, so a device with a full queue
+	 * does not starve the other screens on the bus. A bus over its
+	 * budget may overdraw by one write, which is paid back later */
+	int submitted = 1;
+	while(submitted) {
+		submitted = 0;
+		struct ctlra_dev_t *dev = ctlra->dev_list;
+		for(; dev; dev = dev->dev_list_next) {
+			if(!dev->usb_screen_head || dev->banished ||
+			   dev->usb_recover == CTLRA_USB_RECOVER_ACTIVE)
+				continue;
+			if(dev->usb_xfer_counts[USB_XFER_INFLIGHT_BULK] >=
+			   dev->usb_inflight_max[CTLRA_USB_CLASS_SCREEN])
+				continue;
+
+			struct ctlra_usb_bus_budget_t *b = 0;
+			if(limit_bus)
+				b = ctlra_usb_impl_bus_budget(ctlra, dev, &now);
+			if(b && b->bytes <= 0)
+				continue;
+
+			int ret = ctlra_usb_impl_screen_submit(dev);
+			if(b && ret > 0)
+				b->bytes -= ret;
+			submitted = 1;
+		}
+	}
+#endif /* CTLRA_USE_ASYNC_XFER */
+}
+
 void ctlra_dev_usb_stats_debug(struct ctlra_dev_t *dev)
 {
 	struct ctlra_t *ctlra = dev->ctlra_context;
@@ -827,6 +1411,7 @@ void ctlra_dev_usb_stats_debug(struct ctlra_dev_t *dev)
 		"Inflight Read",
 		"Inflight Write",
 		"Inflight Cancel",
+		"Inflight Bulk",
 	};
 	for(int i = 0; i < USB_XFER_COUNT; i++) {
 		CTLRA_INFO(ctlra, "[%s] usb %s count = %d\n",
@@ -835,40 +1420,22 @@ void ctlra_dev_usb_stats_debug(struct ctlra_dev_t *dev)
 	}
 }
 
-void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
+/* Reads complete on a closed device when cancelled, nothing to do */
+static void
+ctlra_usb_impl_closed_read_cb(struct ctlra_dev_t *dev, uint32_t endpoint,
+			      uint8_t *data, uint32_t size)
 {
-	struct ctlra_t *ctlra = dev->ctlra_context;
-
-	struct timeval tv = {
-		.tv_sec = 0,
-		.tv_usec = 1,
-	};
-
-	/* if there are inflight writes, these are often to disable any
-	 * LEDs or lights on the device. If so, wait a bit, to be nice :)
-	 */
-	int wait_count = 0;
-	do {
-		libusb_handle_events_timeout(ctlra->ctx, &tv);
-	} while(dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE] &&
-		wait_count++ < 10000);
-
-	int32_t inf_writes = dev->usb_xfer_counts[USB_XFER_INFLIGHT_WRITE];
-	if(inf_writes)
-		CTLRA_WARN(ctlra, "[%s] inflight writes at close = %d\n"
-				  "     Some lights on the device may still be on\n",
-			   dev->info.device, inf_writes);
-
-	ctlra_usb_impl_xfer_release(dev);
+}
 
-	libusb_context *ctx = ctlra->ctx;
+static void ctlra_usb_impl_handles_close(struct ctlra_dev_t *dev)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
 
-	int ret = libusb_handle_events_timeout_completed(ctlra->ctx, &tv, 0);
 	int32_t inf_cancels = dev->usb_xfer_counts[USB_XFER_INFLIGHT_CANCEL];
-	if(ret || inf_cancels) {
+	if(inf_cancels) {
 		CTLRA_WARN(ctlra,
-			   "[%s] inflight cancels at close = %d, ret %d\n",
-			   dev->info.device, inf_cancels, ret);
+			   "[%s] inflight cancels at close = %d\n",
+			   dev->info.device, inf_cancels);
 	}
 
 	for(int i = 0; i < CTLRA_USB_IFACE_PER_DEV; i++) {
@@ -889,12 +1456,343 @@ void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
 	}
 
 	ctlra_dev_usb_stats_debug(dev);
-	CTLRA_INFO(ctlra, "[%s] usb writes drain time = %d usecs.\n",
-		   dev->info.device, wait_count);
+}
+
+static uint64_t ctlra_usb_impl_elapsed_us(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1000000ull +
+	       (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+/* Handle USB events while *busy* returns 1, until the deadline */
+static void
+ctlra_usb_impl_wait(struct ctlra_t *ctlra, uint32_t timeout_us,
+		    int (*busy)(struct ctlra_t *ctlra))
+{
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	while(busy(ctlra)) {
+		uint64_t elapsed = ctlra_usb_impl_elapsed_us(&start);
+		if(elapsed >= timeout_us)
+			break;
+		/* returns early as soon as any transfer completes */
+		struct timeval tv = {
+			.tv_usec = timeout_us - elapsed < 1000 ?
+				   timeout_us - elapsed : 1000,
+		};
+		libusb_handle_events_timeout_completed(ctlra->ctx, &tv, 0);
+	}
+}
+
+static int ctlra_usb_impl_closing_writes(struct ctlra_t *ctlra)
+{
+	for(struct ctlra_usb_closing_t *c = ctlra->usb_closing; c; c = c->next)
+		if(c->dev.usb_xfer_counts[USB_XFER_INFLIGHT_WRITE] ||
+		   c->dev.usb_xfer_counts[USB_XFER_INFLIGHT_BULK])
+			return 1;
+	return 0;
+}
+
+static int ctlra_usb_impl_closing_xfers(struct ctlra_t *ctlra)
+{
+	for(struct ctlra_usb_closing_t *c = ctlra->usb_closing; c; c = c->next)
+		if(c->dev.usb_async_next)
+			return 1;
+	return 0;
+}
+
+/* Give up on the final writes of a closed device */
+static void
+ctlra_usb_impl_closing_cancel(struct ctlra_t *ctlra,
+			      struct ctlra_usb_closing_t *c)
+{
+	int32_t inf_writes = c->dev.usb_xfer_counts[USB_XFER_INFLIGHT_WRITE] +
+			     c->dev.usb_xfer_counts[USB_XFER_INFLIGHT_BULK];
+	if(inf_writes) {
+		CTLRA_WARN(ctlra, "[%s] inflight writes at close = %d\n"
+				  "     Some lights on the device may still be on\n",
+			   c->dev.info.device, inf_writes);
+		ctlra_usb_impl_xfer_release(&c->dev, USB_RELEASE_WRITES);
+	}
+	c->writes_cancelled = 1;
+}
+
+/* Free the closed devices with nothing left in flight, and cancel the
+ * writes of those closed more than *wait_us* ago. Never waits, so it is
+ * safe from the idle iter while libusb callbacks may be running */
+static void
+ctlra_usb_impl_closing_reap(struct ctlra_t *ctlra, uint32_t wait_us)
+{
+	struct ctlra_usb_closing_t **p = &ctlra->usb_closing;
+	while(*p) {
+		struct ctlra_usb_closing_t *c = *p;
+		if(!c->dev.usb_async_next) {
+			*p = c->next;
+			ctlra_usb_impl_handles_close(&c->dev);
+			free(c);
+			continue;
+		}
+		if(!c->writes_cancelled &&
+		   ctlra_usb_impl_elapsed_us(&c->closed) >= wait_us)
+			ctlra_usb_impl_closing_cancel(ctlra, c);
+		p = &c->next;
+	}
+}
+
+void ctlra_impl_usb_close_all(struct ctlra_t *ctlra)
+{
+	struct ctlra_usb_closing_t *c;
+	if(!ctlra->usb_closing)
+		return;
+
+	/* the final writes are often to disable any LEDs or lights on the
+	 * devices, wait for them to be nice :) One deadline covers the
+	 * writes of all devices being closed */
+	ctlra_usb_impl_wait(ctlra, CTLRA_USB_CLOSE_WAIT_US,
+			    ctlra_usb_impl_closing_writes);
+
+	for(c = ctlra->usb_closing; c; c = c->next)
+		if(!c->writes_cancelled)
+			ctlra_usb_impl_closing_cancel(ctlra, c);
+
+	/* the cancelled transfers hand back their memory in callbacks */
+	ctlra_usb_impl_wait(ctlra, CTLRA_USB_CANCEL_WAIT_US,
+			    ctlra_usb_impl_closing_xfers);
+	ctlra_usb_impl_closing_reap(ctlra, 0);
+
+	/* libusb still owns transfers pointing into these copies, freeing
+	 * them would let a late completion write to freed memory */
+	for(c = ctlra->usb_closing; c; c = c->next)
+		CTLRA_WARN(ctlra, "[%s] transfers still in flight at exit\n",
+			   c->dev.info.device);
+	ctlra->usb_closing = 0;
+}
+
+void ctlra_dev_impl_usb_close(struct ctlra_dev_t *dev)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+
+	struct ctlra_usb_open_t *e = ctlra_usb_impl_open_find(dev->usb_location);
+	if(e && e->dev == dev)
+		ctlra_usb_impl_open_remove(dev->usb_location);
+
+	/* hidraw handles have nothing in flight, close them right away */
+	ctlra_dev_impl_hidraw_close(dev);
+
+#if CTLRA_USE_ASYNC_XFER
+	/* the last frames are often a blank screen, send them along with
+	 * the final LED writes */
+	ctlra_usb_impl_screen_flush(dev);
+#endif
+
+	/* The driver frees *dev* on return, but its transfers may still
+	 * be in flight. Keep a copy for them to complete on, and close
+	 * the handles once they are done */
+	struct ctlra_usb_closing_t *c = malloc(sizeof(*c));
+	if(!c) {
+		ctlra_usb_impl_xfer_release(dev, USB_RELEASE_ALL);
+		struct timeval tv = { .tv_usec = 1000 };
+		libusb_handle_events_timeout_completed(ctlra->ctx, &tv, 0);
+		ctlra_usb_impl_handles_close(dev);
+		return;
+	}
+	c->dev = *dev;
+	c->dev.usb_read_cb = ctlra_usb_impl_closed_read_cb;
+	for(struct usb_async_t *a = c->dev.usb_async_next; a; a = a->next)
+		a->xfer->user_data = &c->dev;
+
+	c->next = ctlra->usb_closing;
+	ctlra->usb_closing = c;
+	clock_gettime(CLOCK_MONOTONIC, &c->closed);
+	c->writes_cancelled = 0;
+
+	/* reads never complete by themselves, cancel them right away. The
+	 * writes get CTLRA_USB_CLOSE_WAIT_US to finish, and the copy is
+	 * freed by the idle iter once nothing is in flight: this may run in
+	 * a hotplug callback, where libusb events cannot be handled */
+	ctlra_usb_impl_xfer_release(&c->dev, USB_RELEASE_READS);
+}
+
+int ctlra_impl_usb_recover_start(struct ctlra_dev_t *dev)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+
+	if(dev->usb_recover == CTLRA_USB_RECOVER_ACTIVE)
+		return 0;
+	/* only USB devices, a virtual device gets a new node when it
+	 * comes back */
+	if(!dev->usb_location || (dev->usb_location & CTLRA_HIDRAW_VIRTUAL))
+		return -ENOTSUP;
+	if(!ctlra_usb_impl_is_open(dev))
+		return -ENODEV;
+
+	dev->usb_recover_ifaces = 0;
+	dev->usb_recover_hidraw = 0;
+	for(int i = 0; i < CTLRA_USB_IFACE_PER_DEV; i++) {
+		if(dev->usb_handle[i])
+			dev->usb_recover_ifaces |= 1 << i;
+		if(dev->hidraw_fd[i] >= 0) {
+			dev->usb_recover_ifaces |= 1 << i;
+			dev->usb_recover_hidraw |= 1 << i;
+		}
+	}
+
+	/* this may run in a transfer callback, where cancelling the other
+	 * transfers is not safe. They are cancelled by the recover iter */
+	dev->usb_recover = CTLRA_USB_RECOVER_ACTIVE;
+	dev->usb_recover_step = 0;
+	clock_gettime(CLOCK_MONOTONIC, &dev->usb_recover_start);
+	/* the first try is right away, errors often leave it plugged in */
+	memset(&dev->usb_recover_retry, 0, sizeof(dev->usb_recover_retry));
+
+	CTLRA_WARN(ctlra, "[%s] USB error, reconnecting\n", dev->info.device);
+	return 0;
+}
+
+/* Release the interfaces, keeping the device in the open table */
+static void ctlra_usb_impl_recover_close(struct ctlra_dev_t *dev)
+{
+	ctlra_dev_impl_hidraw_close(dev);
+	for(int i = 0; i < CTLRA_USB_IFACE_PER_DEV; i++) {
+		if(!dev->usb_handle[i])
+			continue;
+		libusb_release_interface(dev->usb_handle[i],
+					 dev->usb_interface[i]);
+		libusb_close(dev->usb_handle[i]);
+		dev->usb_handle[i] = 0;
+	}
+}
+
+/* Open the interfaces of *dev* again, on the device now plugged into
+ * the same port */
+static int ctlra_usb_impl_recover_open(struct ctlra_dev_t *dev)
+{
+	struct ctlra_t *ctlra = dev->ctlra_context;
+
+	libusb_device **devs;
+	int cnt = libusb_get_device_list(ctlra->ctx, &devs);
+	if(cnt < 0)
+		return -EIO;
+
+	libusb_device *usb_dev = 0;
+	for(int i = 0; i < cnt && !usb_dev; i++) {
+		struct libusb_device_descriptor desc;
+		if(libusb_get_device_descriptor(devs[i], &desc) < 0)
+			continue;
+		if(desc.idVendor == dev->info.vendor_id &&
+		   desc.idProduct == dev->info.device_id &&
+		   ctlra_usb_impl_location(devs[i]) == dev->usb_location)
+			usb_dev = devs[i];
+	}
+
+	int ret = usb_dev ? 0 : -ENODEV;
+	if(usb_dev) {
+		dev->usb_device = usb_dev;
+		/* the interfaces open as they were opened by the driver */
+		uint8_t usb_hidraw = dev->usb_hidraw;
+		for(int i = 0; i < CTLRA_USB_IFACE_PER_DEV && !ret; i++) {
+			if(!(dev->usb_recover_ifaces & (1 << i)))
+				continue;
+			dev->usb_hidraw = (dev->usb_recover_hidraw >> i) & 1;
+			if(ctlra_dev_impl_usb_open_interface(dev,
+					dev->usb_interface[i], i))
+				ret = -EIO;
+		}
+		dev->usb_hidraw = usb_hidraw;
+		if(ret)
+			ctlra_usb_impl_recover_close(dev);
+	}
+
+	libusb_free_device_list(devs, 1);
+	return ret;
+}
+
+/* Write what the device showed before it was lost */
+static void ctlra_usb_impl_recover_restore(struct ctlra_dev_t *dev)
+{
+	/* forced, the device lost the lights the shadow thinks it has */
+	if(dev->light_flush)
+		dev->light_flush(dev, 1);
+
+	/* flushing blits the frame the driver holds. Devices with one
+	 * screen return the same pixels for each index */
+	uint8_t *prev = 0;
+	for(int i = 0; dev->screen_get_data && i < CTLRA_NUM_SCREENS_MAX; i++) {
+		uint8_t *pixels = 0;
+		uint32_t bytes;
+		struct ctlra_screen_zone_t zone = {0};
+		if(dev->screen_get_data(dev, i, &pixels, &bytes, &zone, 0) ||
+		   !pixels || pixels == prev)
+			continue;
+		prev = pixels;
+		dev->screen_get_data(dev, i, &pixels, &bytes, &zone, 1);
+	}
+
+	dev->feedback_dirty = 1;
+}
+
+static void ctlra_usb_impl_recover_iter(struct ctlra_t *ctlra)
+{
+	struct ctlra_dev_t *dev = ctlra->dev_list;
+	for(; dev; dev = dev->dev_list_next) {
+		if(dev->usb_recover != CTLRA_USB_RECOVER_ACTIVE)
+			continue;
+
+		uint64_t elapsed = ctlra_usb_impl_elapsed_us(&dev->usb_recover_start);
+		if(elapsed >= CTLRA_USB_RECOVER_US) {
+			CTLRA_WARN(ctlra, "[%s] did not come back, removing\n",
+				   dev->info.device);
+			dev->usb_recover = CTLRA_USB_RECOVER_FAILED;
+			ctlra_dev_impl_banish(dev);
+			continue;
+		}
+
+		switch(dev->usb_recover_step) {
+		case 0:
+#if CTLRA_USE_ASYNC_XFER
+			ctlra_usb_impl_screen_drop(dev);
+#endif
+			ctlra_usb_impl_xfer_release(dev, USB_RELEASE_ALL);
+			dev->usb_recover_step = 1;
+			/* fall through */
+		case 1:
+			/* the cancelled transfers hand back their memory in
+			 * callbacks, before the handles can be closed */
+			if(dev->usb_async_next)
+				continue;
+			ctlra_usb_impl_recover_close(dev);
+			dev->usb_recover_step = 2;
+			/* fall through */
+		case 2:
+			if(ctlra_usb_impl_elapsed_us(&dev->usb_recover_retry) <
+			   CTLRA_USB_RECOVER_RETRY_US)
+				continue;
+			clock_gettime(CLOCK_MONOTONIC, &dev->usb_recover_retry);
+			if(ctlra_usb_impl_recover_open(dev))
+				continue;
+			break;
+		}
+
+		dev->usb_recover = CTLRA_USB_RECOVER_NONE;
+		CTLRA_INFO(ctlra, "[%s] reconnected after %d ms\n",
+			   dev->info.device, (int)(elapsed / 1000));
+		ctlra_usb_impl_recover_restore(dev);
+	}
 }
 
 void ctlra_impl_usb_shutdown(struct ctlra_t *ctlra)
 {
+	while(ctlra->usb_pending) {
+		struct ctlra_usb_pending_t *p = ctlra->usb_pending;
+		ctlra->usb_pending = p->next;
+		libusb_unref_device(p->dev);
+		free(p);
+	}
+
+	ctlra_impl_hidraw_shutdown(ctlra);
 
 	if(ctlra->opts.flags_usb_no_own_context)
 		libusb_exit(NULL);
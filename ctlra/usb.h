@@ -38,6 +38,24 @@ struct ctlra_t;
 int ctlra_dev_impl_usb_init(struct ctlra_t *ctlra);
 /* For polling hotplug / other events */
 void ctlra_impl_usb_idle_iter(struct ctlra_t *ctlra);
+/* Enumerate the bus once, for the drivers opening devices in probe */
+int ctlra_impl_usb_enum_begin(struct ctlra_t *ctlra);
+void ctlra_impl_usb_enum_end(void);
+/* Number of enumerated devices handed to drivers so far */
+uint32_t ctlra_impl_usb_enum_taken(void);
+/* Returns 1 if a *vid*:*pid* device is left for a driver to open */
+int ctlra_impl_usb_enum_pending(int vid, int pid);
+/* Submit the queued screen writes, after the reads and LED writes of
+ * this iteration were submitted */
+void ctlra_impl_usb_screen_iter(struct ctlra_t *ctlra);
+/* Start re-opening *dev* after a transfer error. Returns 0 if it is
+ * being recovered, or an error if it can only be banished */
+int ctlra_impl_usb_recover_start(struct ctlra_dev_t *dev);
+/* Bring up one hotplugged device, if any are waiting */
+void ctlra_impl_usb_hotplug_iter(struct ctlra_t *ctlra);
+/* Close the USB handles of all closed devices at exit, waiting once for
+ * the in-flight writes of all of them */
+void ctlra_impl_usb_close_all(struct ctlra_t *ctlra);
 /* For cleaning up the USB subsystem */
 void ctlra_impl_usb_shutdown(struct ctlra_t *ctlra);
 /* Print stats for a specific USB based dev_t */
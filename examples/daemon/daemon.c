@@ -3,10 +3,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <string.h>
 
 #include "ctlra.h"
 #include "midi.h"
 
+#ifdef HAVE_JACK
+#include "jack.h"
+
+/* when set, all devices write to this JACK MIDI port instead of ALSA */
+static struct daemon_jack_t *jack;
+#endif
+
 static volatile uint32_t done;
 
 #define GRID_SIZE 64
@@ -39,6 +47,10 @@ void demo_feedback_func(struct ctlra_dev_t *dev, void *d)
 	}
 
 	ctlra_dev_light_flush(dev, 0);
+
+	/* send the MIDI written by the event func this iteration */
+	if(daemon->midi)
+		ctlra_midi_output_flush(daemon->midi);
 }
 
 int ignored_input_cb(uint8_t nbytes, uint8_t * buffer, void *ud)
@@ -46,13 +58,22 @@ int ignored_input_cb(uint8_t nbytes, uint8_t * buffer, void *ud)
 	return 0;
 }
 
+static int daemon_midi_write(struct daemon_t *daemon,
+			     struct ctlra_event_t *e, uint8_t *msg)
+{
+#ifdef HAVE_JACK
+	if(jack)
+		return daemon_jack_write(jack, e->timestamp, msg, 3);
+#endif
+	return ctlra_midi_output_write(daemon->midi, 3, msg);
+}
+
 void demo_event_func(struct ctlra_dev_t* dev,
                      uint32_t num_events,
                      struct ctlra_event_t** events,
                      void *userdata)
 {
 	struct daemon_t *daemon = userdata;
-	struct ctlra_midi_t *midi = daemon->midi;
 	uint8_t msg[3] = {0};
 
 	for(uint32_t i = 0; i < num_events; i++) {
@@ -63,7 +84,7 @@ void demo_event_func(struct ctlra_dev_t* dev,
 			msg[0] = e->button.pressed ? 0x90 : 0x80;
 			msg[1] = 60 + e->button.id;
 			msg[2] = e->button.pressed ? 0x70 : 0;
-			ret = ctlra_midi_output_write(midi, 3, msg);
+			ret = daemon_midi_write(daemon, e, msg);
 			break;
 
 		case CTLRA_EVENT_ENCODER:
@@ -73,7 +94,7 @@ void demo_event_func(struct ctlra_dev_t* dev,
 			msg[0] = 0xb0;
 			msg[1] = e->slider.id;
 			msg[2] = (int)(e->slider.value * 127.f);
-			ret = ctlra_midi_output_write(midi, 3, msg);
+			ret = daemon_midi_write(daemon, e, msg);
 			break;
 
 		case CTLRA_EVENT_GRID: {
@@ -87,7 +108,7 @@ void demo_event_func(struct ctlra_dev_t* dev,
 			msg[1] = new_pos + 36; /* GM kick drum note */
 			msg[2] = e->grid.pressed ?
 					e->grid.pressure * 127 : 0;
-			ret = ctlra_midi_output_write(midi, 3, msg);
+			ret = daemon_midi_write(daemon, e, msg);
 			break;
 		}
 		default:
@@ -108,30 +129,34 @@ void remove_dev_func(struct ctlra_dev_t *dev, int unexpected_removal,
 		     void *userdata)
 {
 	struct daemon_t *daemon = userdata;
-	ctlra_midi_destroy(daemon->midi);
+	if(daemon->midi)
+		ctlra_midi_destroy(daemon->midi);
 	free(daemon);
 }
 
-int accept_dev_func(const struct ctlra_dev_info_t *info,
-                    ctlra_event_func *event_func,
-                    ctlra_feedback_func *feedback_func,
-                    ctlra_remove_dev_func *remove_func,
-                    void **userdata_for_event_func,
-                    void *userdata)
+int accept_dev_func(struct ctlra_t *ctlra,
+		    const struct ctlra_dev_info_t *info,
+		    struct ctlra_dev_t *dev,
+		    void *userdata)
 {
+	struct ctlra_midi_client_t *client = userdata;
 	printf("daemon: accepting %s %s\n", info->vendor, info->device);
-	*event_func = demo_event_func;
-	*feedback_func = demo_feedback_func;
-	*remove_func = remove_dev_func;
 
-	/* TODO: open MIDI output, store pointer in device */
 	struct daemon_t *daemon = calloc(1, sizeof(struct daemon_t));
 	if(!daemon)
 		goto fail;
 
-	daemon->midi = ctlra_midi_open(info->device,
-				       ignored_input_cb,
-				       0x0);
+	/* each device gets a port pair on the shared client, or writes
+	 * to the JACK port when there is no client */
+	if(client) {
+		daemon->midi = ctlra_midi_open_port(client, info->device,
+						    ignored_input_cb, 0x0);
+		if(!daemon->midi)
+			goto fail;
+		/* queue output, flushed once per iteration in the
+		 * feedback func */
+		ctlra_midi_output_buffered(daemon->midi, 256);
+	}
 
 	daemon->info = *info;
 	if(info->control_count[CTLRA_EVENT_GRID] > 0) {
@@ -144,10 +169,10 @@ int accept_dev_func(const struct ctlra_dev_info_t *info,
 			daemon->grid_col = atoi(col);
 	}
 
-	if(!daemon->midi)
-		goto fail;
-
-	*userdata_for_event_func = daemon;
+	ctlra_dev_set_event_func(dev, demo_event_func);
+	ctlra_dev_set_feedback_func(dev, demo_feedback_func);
+	ctlra_dev_set_remove_func(dev, remove_dev_func);
+	ctlra_dev_set_callback_userdata(dev, daemon);
 
 	return 1;
 fail:
@@ -158,12 +183,28 @@ fail:
 	return 0;
 }
 
-int main()
+int main(int argc, char **argv)
 {
 	signal(SIGINT, sighndlr);
 
+	struct ctlra_midi_client_t *client = 0;
+	if(argc > 1 && strcmp(argv[1], "-j") == 0) {
+#ifdef HAVE_JACK
+		jack = daemon_jack_open("ctlra");
+		if(!jack)
+			return -1;
+#else
+		printf("daemon: built without JACK support\n");
+		return -1;
+#endif
+	} else {
+		client = ctlra_midi_client_create("ctlra");
+		if(!client)
+			return -1;
+	}
+
 	struct ctlra_t *ctlra = ctlra_create(NULL);
-	int num_devs = ctlra_probe(ctlra, accept_dev_func, 0x0);
+	int num_devs = ctlra_probe(ctlra, accept_dev_func, client);
 	printf("daemon: connected devices: %d\n", num_devs);
 
 	while(!done) {
@@ -172,6 +213,12 @@ int main()
 	}
 
 	ctlra_exit(ctlra);
+	if(client)
+		ctlra_midi_client_destroy(client);
+#ifdef HAVE_JACK
+	if(jack)
+		daemon_jack_close(jack);
+#endif
 
 	return 0;
 }
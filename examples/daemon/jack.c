@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <jack/jack.h>
+#include <jack/midiport.h>
+#include <jack/ringbuffer.h>
+
+#include "jack.h"
+
+/* Events are queued from the ctlra thread with the JACK frame time they
+ * happened at, and written by the process callback one period later at
+ * the same offset within the period. This gives a constant latency of
+ * one period, instead of every event landing on the start of a period */
+
+#define RING_EVENTS 1024
+
+struct daemon_jack_event_t {
+	jack_nframes_t frame;
+	uint8_t size;
+	uint8_t data[3];
+};
+
+struct daemon_jack_t {
+	jack_client_t *client;
+	jack_port_t *port;
+	jack_ringbuffer_t *ring;
+};
+
+static int
+daemon_jack_process(jack_nframes_t nframes, void *arg)
+{
+	struct daemon_jack_t *j = arg;
+	void *buf = jack_port_get_buffer(j->port, nframes);
+	jack_midi_clear_buffer(buf);
+
+	jack_nframes_t start = jack_last_frame_time(j->client);
+	jack_nframes_t last = 0;
+	struct daemon_jack_event_t ev;
+
+	while (jack_ringbuffer_read_space(j->ring) >= sizeof(ev)) {
+		jack_ringbuffer_peek(j->ring, (char *)&ev, sizeof(ev));
+
+		/* frame counts wrap, the difference does not */
+		int32_t offset = (int32_t)(ev.frame + nframes - start);
+		if (offset >= (int32_t)nframes)
+			break; /* belongs to a later period */
+		if (offset < (int32_t)last)
+			offset = last; /* late, or out of order */
+
+		jack_midi_event_write(buf, offset, ev.data, ev.size);
+		last = offset;
+		jack_ringbuffer_read_advance(j->ring, sizeof(ev));
+	}
+
+	return 0;
+}
+
+struct daemon_jack_t *daemon_jack_open(const char *name)
+{
+	struct daemon_jack_t *j = calloc(1, sizeof(*j));
+	if (!j)
+		return 0;
+
+	j->client = jack_client_open(name, JackNoStartServer, 0);
+	if (!j->client) {
+		fprintf(stderr, "daemon: failed to connect to JACK\n");
+		goto fail;
+	}
+
+	j->ring = jack_ringbuffer_create(RING_EVENTS *
+					 sizeof(struct daemon_jack_event_t));
+	if (!j->ring)
+		goto fail;
+	jack_ringbuffer_mlock(j->ring);
+
+	j->port = jack_port_register(j->client, "midi_out",
+				     JACK_DEFAULT_MIDI_TYPE,
+				     JackPortIsOutput, 0);
+	if (!j->port)
+		goto fail;
+
+	jack_set_process_callback(j->client, daemon_jack_process, j);
+	if (jack_activate(j->client))
+		goto fail;
+
+	return j;
+fail:
+	if (j->client)
+		jack_client_close(j->client);
+	if (j->ring)
+		jack_ringbuffer_free(j->ring);
+	free(j);
+	return 0;
+}
+
+int daemon_jack_write(struct daemon_jack_t *j, uint64_t time_ns,
+		      const uint8_t *msg, uint8_t size)
+{
+	struct daemon_jack_event_t ev = {
+		.size = size > 3 ? 3 : size,
+	};
+	memcpy(ev.data, msg, ev.size);
+
+	/* the JACK clock is CLOCK_MONOTONIC in microseconds on Linux */
+	if (time_ns)
+		ev.frame = jack_time_to_frames(j->client, time_ns / 1000);
+	else
+		ev.frame = jack_frame_time(j->client);
+
+	if (jack_ringbuffer_write_space(j->ring) < sizeof(ev))
+		return -1;
+	jack_ringbuffer_write(j->ring, (const char *)&ev, sizeof(ev));
+	return 0;
+}
+
+void daemon_jack_close(struct daemon_jack_t *j)
+{
+	jack_deactivate(j->client);
+	jack_client_close(j->client);
+	jack_ringbuffer_free(j->ring);
+	free(j);
+}
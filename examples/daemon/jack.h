@@ -0,0 +1,20 @@
+#ifndef CTLRA_DAEMON_JACK_H
+#define CTLRA_DAEMON_JACK_H
+
+#include <stdint.h>
+
+struct daemon_jack_t;
+
+/* Open a JACK client with a single MIDI output port */
+struct daemon_jack_t *daemon_jack_open(const char *name);
+
+/* Queue a MIDI message for the JACK output. *time_ns* is the time the
+ * input arrived on CLOCK_MONOTONIC, or 0 to use the current time. Not
+ * realtime safe, but lock-free with respect to the process callback.
+ * Returns -1 if the queue is full. */
+int daemon_jack_write(struct daemon_jack_t *j, uint64_t time_ns,
+		      const uint8_t *msg, uint8_t size);
+
+void daemon_jack_close(struct daemon_jack_t *j);
+
+#endif /* CTLRA_DAEMON_JACK_H */
@@ -61,11 +61,10 @@ void simple_feedback_func(struct ctlra_dev_t *dev, void *d)
 
 	/* raw LED API for Grid */
 	if(info.control_count[CTLRA_EVENT_GRID]) {
-		for(int i = 0; i < 16; i++) {
-			int id = info.grid_info[0].info.params[0] + i;
-			uint32_t col = grid[i].colour * (grid[i].pressed > 0);
-			ctlra_dev_light_set(dev, id, col);
-		}
+		uint32_t cols[16];
+		for(int i = 0; i < 16; i++)
+			cols[i] = grid[i].colour * (grid[i].pressed > 0);
+		ctlra_dev_grid_set(dev, 0, cols);
 	}
 
 	/* API for feedback used second - overwrites raw API */
@@ -192,6 +192,7 @@ int main(int argc, char **argv)
 
 	struct ctlra_create_opts_t opts = {
 		.screen_redraw_target_fps = 15,
+		.feedback_max_fps = 30,
 	};
 
 	struct ctlra_t *ctlra = ctlra_create(&opts);
@@ -0,0 +1,679 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/input.h>
+#include <linux/uhid.h>
+
+#include "ctlra.h"
+
+/* A rig of virtual controllers, to run the whole stack from the kernel
+ * HID core through the hidraw transport and drivers to the event
+ * callback without any hardware.
+ *
+ * Each controller is a HID device created through /dev/uhid, with the
+ * VID:PID and input report format of a supported device. Input reports
+ * are streamed into them at a fixed rate, toggling one button, or are
+ * replayed from a file. Whatever ctlra writes back is counted, and can
+ * be recorded. Ctlra probes the virtual devices with the
+ * flags_hidraw_virtual option.
+ *
+ * The latency printed is from writing a report to /dev/uhid until the
+ * event callback sees the button change. Needs write access to
+ * /dev/uhid, usually root.
+ */
+
+static volatile uint32_t done;
+
+struct rig_model_t {
+	const char *name;
+	uint16_t vid;
+	uint16_t pid;
+	/* the input report toggling a button, size includes the ID */
+	uint8_t report_id;
+	uint8_t report_size;
+	uint8_t btn_byte;
+	uint8_t btn_mask;
+};
+
+static const struct rig_model_t models[] = {
+	{"mk3",        0x17cc, 0x1600, 0x01, 42, 2, 0x01},
+	{"d2",         0x17cc, 0x1400, 0x01, 17, 5, 0x01},
+	{"f1",         0x17cc, 0x1120, 0x01, 22, 4, 0x08},
+	{"jam",        0x17cc, 0x1500, 0x01, 17, 2, 0x01},
+	{"mikro_mk2",  0x17cc, 0x1200, 0x01,  6, 1, 0x80},
+	{"spacemouse", 0x256f, 0xc632, 0x03,  7, 1, 0x01},
+};
+#define MODELS_SIZE (sizeof(models) / sizeof(models[0]))
+
+/* input reports declared in the descriptor of each model */
+#define REPORTS_MAX 8
+#define REPORT_BYTES_MAX 256
+
+struct rig_report_t {
+	uint8_t id;
+	uint16_t size;
+};
+
+struct rig_model_state_t {
+	int enabled;
+	struct rig_report_t reports[REPORTS_MAX];
+	uint32_t num_reports;
+
+	/* time each step was written, the latency of the n-th button
+	 * event of a device is measured from step n */
+	uint64_t *sent_ns;
+	uint64_t *lat_ns;
+	uint32_t lat_count;
+	uint32_t devices;
+	uint64_t events;
+	uint64_t outputs;
+	uint64_t output_bytes;
+};
+static struct rig_model_state_t state[MODELS_SIZE];
+
+/* a virtual device */
+struct rig_vdev_t {
+	int model;
+	int fd;
+};
+static struct rig_vdev_t *vdevs;
+static uint32_t num_vdevs;
+
+/* a device as ctlra sees it, the callback userdata */
+struct rig_dev_t {
+	int model;
+	uint32_t step;
+	int pressed;
+};
+
+/* a line of the replay file */
+struct rig_line_t {
+	int model;
+	uint16_t size;
+	uint8_t data[REPORT_BYTES_MAX];
+};
+static struct rig_line_t *lines;
+static uint32_t num_lines;
+
+static uint32_t num_steps = 10000;
+static uint32_t rate = 1000;
+static uint32_t copies = 1;
+static uint32_t iter_sleep_us = 1000;
+static FILE *record;
+
+/* steps written so far, and set once streaming finished */
+static uint32_t steps;
+static volatile uint32_t inject_done;
+static uint64_t start_ns;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void sighndlr(int signal)
+{
+	done = 1;
+	printf("\n");
+}
+
+static int model_find(const char *name, size_t len)
+{
+	for(uint32_t i = 0; i < MODELS_SIZE; i++)
+		if(strlen(models[i].name) == len &&
+		   strncmp(models[i].name, name, len) == 0)
+			return i;
+	return -1;
+}
+
+static void model_add_report(int m, uint8_t id, uint16_t size)
+{
+	struct rig_model_state_t *s = &state[m];
+	for(uint32_t i = 0; i < s->num_reports; i++) {
+		if(s->reports[i].id == id) {
+			if(size > s->reports[i].size)
+				s->reports[i].size = size;
+			return;
+		}
+	}
+	if(s->num_reports < REPORTS_MAX)
+		s->reports[s->num_reports++] = (struct rig_report_t){id, size};
+}
+
+/* A vendor defined collection, with one input report of bytes per
+ * report ID. The HID core drops reports the descriptor lacks */
+static uint16_t rig_descriptor(int m, uint8_t *d)
+{
+	uint16_t i = 0;
+	d[i++] = 0x06; d[i++] = 0x00; d[i++] = 0xff; /* usage page vendor */
+	d[i++] = 0x09; d[i++] = 0x01;                /* usage */
+	d[i++] = 0xa1; d[i++] = 0x01;                /* collection app */
+	for(uint32_t r = 0; r < state[m].num_reports; r++) {
+		uint16_t count = state[m].reports[r].size - 1;
+		d[i++] = 0x85; d[i++] = state[m].reports[r].id;
+		d[i++] = 0x09; d[i++] = 0x01;
+		d[i++] = 0x15; d[i++] = 0x00;        /* logical min 0 */
+		d[i++] = 0x26; d[i++] = 0xff;        /* logical max 255 */
+		d[i++] = 0x00;
+		d[i++] = 0x75; d[i++] = 0x08;        /* 8 bits each */
+		d[i++] = 0x96;                       /* report count */
+		d[i++] = count & 0xff; d[i++] = count >> 8;
+		d[i++] = 0x81; d[i++] = 0x02;        /* input data var */
+	}
+	d[i++] = 0xc0;
+	return i;
+}
+
+static int rig_vdev_create(struct rig_vdev_t *v, int m, uint32_t idx)
+{
+	v->model = m;
+	v->fd = open("/dev/uhid", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+	if(v->fd < 0) {
+		printf("uhid_rig: open /dev/uhid: %s\n", strerror(errno));
+		return -1;
+	}
+
+	struct uhid_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_CREATE2;
+	snprintf((char *)ev.u.create2.name, sizeof(ev.u.create2.name),
+		 "ctlra rig %s", models[m].name);
+	/* read back by ctlra as the serial */
+	snprintf((char *)ev.u.create2.uniq, sizeof(ev.u.create2.uniq),
+		 "ctlra-rig-%d-%u", getpid(), idx);
+	ev.u.create2.rd_size = rig_descriptor(m, ev.u.create2.rd_data);
+	ev.u.create2.bus = BUS_USB;
+	ev.u.create2.vendor = models[m].vid;
+	ev.u.create2.product = models[m].pid;
+
+	if(write(v->fd, &ev, sizeof(ev)) < 0) {
+		printf("uhid_rig: create %s: %s\n", models[m].name,
+		       strerror(errno));
+		close(v->fd);
+		return -1;
+	}
+	return 0;
+}
+
+static void rig_vdev_destroy(struct rig_vdev_t *v)
+{
+	struct uhid_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.type = UHID_DESTROY;
+	if(write(v->fd, &ev, sizeof(ev)) < 0)
+		printf("uhid_rig: destroy: %s\n", strerror(errno));
+	close(v->fd);
+}
+
+static int rig_vdev_input(struct rig_vdev_t *v, const uint8_t *data,
+			  uint16_t size)
+{
+	struct uhid_event ev;
+	ev.type = UHID_INPUT2;
+	ev.u.input2.size = size;
+	memcpy(ev.u.input2.data, data, size);
+	size_t len = offsetof(struct uhid_event, u.input2.data) + size;
+	return write(v->fd, &ev, len) < 0 ? -errno : 0;
+}
+
+static void rig_record_output(struct rig_vdev_t *v,
+			      const struct uhid_output_req *out)
+{
+	uint32_t idx = v - vdevs;
+	fprintf(record, "%.6f %s.%u", (now_ns() - start_ns) / 1e9,
+		models[v->model].name, idx);
+	for(uint32_t i = 0; i < out->size; i++)
+		fprintf(record, " %02x", out->data[i]);
+	fprintf(record, "\n");
+}
+
+/* Handle one event from the kernel, mostly ctlra writing reports */
+static void rig_vdev_event(struct rig_vdev_t *v)
+{
+	struct uhid_event ev;
+	if(read(v->fd, &ev, sizeof(ev)) <= 0)
+		return;
+
+	struct rig_model_state_t *s = &state[v->model];
+	struct uhid_event reply;
+	memset(&reply, 0, sizeof(reply));
+
+	switch(ev.type) {
+	case UHID_OUTPUT:
+		s->outputs++;
+		s->output_bytes += ev.u.output.size;
+		if(record)
+			rig_record_output(v, &ev.u.output);
+		break;
+	/* the kernel waits for a reply to these */
+	case UHID_GET_REPORT:
+		reply.type = UHID_GET_REPORT_REPLY;
+		reply.u.get_report_reply.id = ev.u.get_report.id;
+		reply.u.get_report_reply.err = EIO;
+		if(write(v->fd, &reply, sizeof(reply)) < 0)
+			printf("uhid_rig: get report reply: %s\n",
+			       strerror(errno));
+		break;
+	case UHID_SET_REPORT:
+		reply.type = UHID_SET_REPORT_REPLY;
+		reply.u.set_report_reply.id = ev.u.set_report.id;
+		if(write(v->fd, &reply, sizeof(reply)) < 0)
+			printf("uhid_rig: set report reply: %s\n",
+			       strerror(errno));
+		break;
+	default:
+		break;
+	}
+}
+
+/* Handle the events of all virtual devices until *deadline* */
+static void rig_service(struct pollfd *pfds, uint64_t deadline)
+{
+	for(;;) {
+		uint64_t now = now_ns();
+		if(now >= deadline)
+			return;
+		uint64_t wait = deadline - now;
+		struct timespec ts = {
+			.tv_sec = wait / 1000000000ull,
+			.tv_nsec = wait % 1000000000ull,
+		};
+		int n = ppoll(pfds, num_vdevs, &ts, 0);
+		for(uint32_t i = 0; n > 0 && i < num_vdevs; i++)
+			if(pfds[i].revents & POLLIN)
+				rig_vdev_event(&vdevs[i]);
+	}
+}
+
+static void rig_write_model(int m, const uint8_t *data, uint16_t size)
+{
+	for(uint32_t i = 0; i < num_vdevs; i++) {
+		if(vdevs[i].model != m)
+			continue;
+		int ret = rig_vdev_input(&vdevs[i], data, size);
+		if(ret)
+			printf("uhid_rig: input %s: %s\n", models[m].name,
+			       strerror(-ret));
+	}
+}
+
+static void *rig_inject(void *arg)
+{
+	struct pollfd *pfds = calloc(num_vdevs, sizeof(*pfds));
+	if(!pfds) {
+		inject_done = 1;
+		return 0;
+	}
+	for(uint32_t i = 0; i < num_vdevs; i++) {
+		pfds[i].fd = vdevs[i].fd;
+		pfds[i].events = POLLIN;
+	}
+
+	const uint64_t period = 1000000000ull / rate;
+	uint64_t next = now_ns();
+	uint32_t total = lines ? num_lines : num_steps;
+
+	for(uint32_t k = 0; k < total && !done; k++) {
+		rig_service(pfds, next);
+
+		if(lines) {
+			struct rig_line_t *l = &lines[k];
+			rig_write_model(l->model, l->data, l->size);
+		} else {
+			/* press on even steps, release on odd */
+			for(uint32_t m = 0; m < MODELS_SIZE; m++) {
+				if(!state[m].enabled)
+					continue;
+				uint8_t buf[REPORT_BYTES_MAX] = {0};
+				buf[0] = models[m].report_id;
+				if(!(k & 1))
+					buf[models[m].btn_byte] =
+						models[m].btn_mask;
+				state[m].sent_ns[k] = now_ns();
+				rig_write_model(m, buf, models[m].report_size);
+			}
+		}
+		__atomic_store_n(&steps, k + 1, __ATOMIC_RELEASE);
+		next += period;
+	}
+
+	/* collect the last events and writes */
+	rig_service(pfds, now_ns() + 200000000ull);
+	free(pfds);
+	inject_done = 1;
+	return 0;
+}
+
+static void rig_event_func(struct ctlra_dev_t* dev, uint32_t num_events,
+			   struct ctlra_event_t** events, void *userdata)
+{
+	struct rig_dev_t *d = userdata;
+	struct rig_model_state_t *s = &state[d->model];
+	uint64_t now = now_ns();
+
+	for(uint32_t i = 0; i < num_events; i++) {
+		s->events++;
+		if(events[i]->type != CTLRA_EVENT_BUTTON)
+			continue;
+
+		d->pressed = events[i]->button.pressed;
+		ctlra_dev_feedback_dirty(dev);
+
+		if(lines)
+			continue;
+		uint32_t step = d->step++;
+		if(step < __atomic_load_n(&steps, __ATOMIC_ACQUIRE))
+			s->lat_ns[s->lat_count++] = now - s->sent_ns[step];
+	}
+}
+
+/* light up on press, so the writes back follow the input */
+static void rig_feedback_func(struct ctlra_dev_t *dev, void *userdata)
+{
+	struct rig_dev_t *d = userdata;
+	ctlra_dev_light_set(dev, 0, d->pressed ? 0xffffffff : 0);
+	ctlra_dev_light_flush(dev, 0);
+}
+
+static void rig_remove_func(struct ctlra_dev_t *dev, int unexpected_removal,
+			    void *userdata)
+{
+	free(userdata);
+}
+
+static int rig_accept(struct ctlra_t *ctlra,
+		      const struct ctlra_dev_info_t *info,
+		      struct ctlra_dev_t *dev, void *userdata)
+{
+	int m = -1;
+	for(uint32_t i = 0; i < MODELS_SIZE; i++)
+		if(state[i].enabled && info->vendor_id == models[i].vid &&
+		   info->device_id == models[i].pid)
+			m = i;
+	if(m < 0)
+		return 0;
+
+	struct rig_dev_t *d = calloc(1, sizeof(*d));
+	if(!d)
+		return 0;
+	d->model = m;
+	state[m].devices++;
+
+	ctlra_dev_set_event_func(dev, rig_event_func);
+	ctlra_dev_set_feedback_func(dev, rig_feedback_func);
+	ctlra_dev_set_remove_func(dev, rig_remove_func);
+	ctlra_dev_set_callback_userdata(dev, d);
+	return 1;
+}
+
+/* Each line is the model name and the bytes of one report in hex,
+ * the report ID first. Lines starting with # are ignored */
+static int rig_load_replay(const char *path)
+{
+	FILE *f = fopen(path, "r");
+	if(!f) {
+		printf("uhid_rig: open %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	char buf[1024];
+	uint32_t lineno = 0;
+	while(fgets(buf, sizeof(buf), f)) {
+		lineno++;
+		char *p = buf + strspn(buf, " \t");
+		if(*p == '#' || *p == '\n' || *p == 0)
+			continue;
+
+		size_t len = strcspn(p, " \t\n");
+		int m = model_find(p, len);
+		if(m < 0) {
+			printf("uhid_rig: %s:%u: unknown model\n", path, lineno);
+			fclose(f);
+			return -1;
+		}
+
+		struct rig_line_t *tmp = realloc(lines, (num_lines + 1) *
+						 sizeof(*lines));
+		if(!tmp) {
+			fclose(f);
+			return -1;
+		}
+		lines = tmp;
+		struct rig_line_t *l = &lines[num_lines];
+		l->model = m;
+		l->size = 0;
+
+		p += len;
+		char *end;
+		while(l->size < REPORT_BYTES_MAX) {
+			unsigned long v = strtoul(p, &end, 16);
+			if(end == p)
+				break;
+			l->data[l->size++] = v;
+			p = end;
+		}
+		if(l->size < 2) {
+			printf("uhid_rig: %s:%u: no report\n", path, lineno);
+			fclose(f);
+			return -1;
+		}
+
+		state[m].enabled = 1;
+		model_add_report(m, l->data[0], l->size);
+		num_lines++;
+	}
+
+	fclose(f);
+	return num_lines ? 0 : -1;
+}
+
+/* Wait for the hidraw nodes of all virtual devices to show up */
+static int rig_wait_nodes(uint32_t timeout_ms)
+{
+	char uniq[64];
+	int len = snprintf(uniq, sizeof(uniq), "HID_UNIQ=ctlra-rig-%d-",
+			   getpid());
+
+	for(uint32_t t = 0; t < timeout_ms; t += 10) {
+		uint32_t found = 0;
+		DIR *dir = opendir("/sys/class/hidraw");
+		struct dirent *d;
+		while(dir && (d = readdir(dir))) {
+			char path[512];
+			char line[128];
+			snprintf(path, sizeof(path),
+				 "/sys/class/hidraw/%s/device/uevent",
+				 d->d_name);
+			FILE *f = fopen(path, "r");
+			if(!f)
+				continue;
+			while(fgets(line, sizeof(line), f))
+				if(strncmp(line, uniq, len) == 0)
+					found++;
+			fclose(f);
+		}
+		if(dir)
+			closedir(dir);
+		if(found >= num_vdevs)
+			return 0;
+		usleep(10000);
+	}
+	return -1;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void rig_print_stats(double seconds)
+{
+	printf("%-11s %4s %8s %8s %8s %8s %8s %8s %8s\n", "model", "devs",
+	       "events", "writes", "min us", "p50 us", "p99 us", "max us",
+	       "ev/s");
+	for(uint32_t m = 0; m < MODELS_SIZE; m++) {
+		struct rig_model_state_t *s = &state[m];
+		if(!s->enabled)
+			continue;
+		printf("%-11s %4u %8lu %8lu", models[m].name, s->devices,
+		       (unsigned long)s->events, (unsigned long)s->outputs);
+		if(s->lat_count) {
+			qsort(s->lat_ns, s->lat_count, sizeof(uint64_t),
+			      cmp_u64);
+			uint64_t *l = s->lat_ns;
+			uint32_t n = s->lat_count;
+			printf(" %8.1f %8.1f %8.1f %8.1f", l[0] / 1e3,
+			       l[n / 2] / 1e3, l[(n * 99) / 100] / 1e3,
+			       l[n - 1] / 1e3);
+		} else {
+			printf(" %8s %8s %8s %8s", "-", "-", "-", "-");
+		}
+		printf(" %8.0f\n", s->events / seconds);
+	}
+}
+
+static void usage(void)
+{
+	printf("usage: ctlra_uhid_rig [options]\n"
+	       "  -d <models>  comma separated, default all of:\n"
+	       "               ");
+	for(uint32_t i = 0; i < MODELS_SIZE; i++)
+		printf("%s%s", models[i].name,
+		       i + 1 < MODELS_SIZE ? "," : "\n");
+	printf("  -c <n>       virtual devices of each model, default 1\n"
+	       "  -n <n>       input reports to write, default 10000\n"
+	       "  -r <hz>      reports written per second, default 1000\n"
+	       "  -s <us>      sleep between ctlra_idle_iter(), default 1000\n"
+	       "  -f <file>    replay the reports of <file> instead\n"
+	       "  -o <file>    record the reports ctlra writes to <file>\n");
+}
+
+int main(int argc, char **argv)
+{
+	const char *devices = 0;
+	const char *replay = 0;
+	int opt;
+	while((opt = getopt(argc, argv, "d:c:n:r:s:f:o:h")) != -1) {
+		switch(opt) {
+		case 'd': devices = optarg; break;
+		case 'c': copies = atoi(optarg); break;
+		case 'n': num_steps = atoi(optarg); break;
+		case 'r': rate = atoi(optarg); break;
+		case 's': iter_sleep_us = atoi(optarg); break;
+		case 'f': replay = optarg; break;
+		case 'o':
+			record = fopen(optarg, "w");
+			if(!record) {
+				printf("uhid_rig: open %s: %s\n", optarg,
+				       strerror(errno));
+				return -1;
+			}
+			break;
+		default:
+			usage();
+			return opt == 'h' ? 0 : -1;
+		}
+	}
+	if(!copies || !num_steps || !rate) {
+		usage();
+		return -1;
+	}
+
+	if(replay) {
+		if(rig_load_replay(replay))
+			return -1;
+	} else {
+		const char *p = devices ? devices : "";
+		while(devices && *p) {
+			size_t len = strcspn(p, ",");
+			int m = model_find(p, len);
+			if(m < 0) {
+				printf("uhid_rig: unknown model %.*s\n",
+				       (int)len, p);
+				return -1;
+			}
+			state[m].enabled = 1;
+			p += len + (p[len] == ',');
+		}
+		for(uint32_t m = 0; m < MODELS_SIZE; m++) {
+			if(devices && !state[m].enabled)
+				continue;
+			state[m].enabled = 1;
+			model_add_report(m, models[m].report_id,
+					 models[m].report_size);
+			state[m].sent_ns = calloc(num_steps, sizeof(uint64_t));
+			state[m].lat_ns = calloc((uint64_t)num_steps * copies,
+						 sizeof(uint64_t));
+			if(!state[m].sent_ns || !state[m].lat_ns)
+				return -1;
+		}
+	}
+
+	signal(SIGINT, sighndlr);
+
+	vdevs = calloc(MODELS_SIZE * copies, sizeof(*vdevs));
+	if(!vdevs)
+		return -1;
+	for(uint32_t m = 0; m < MODELS_SIZE; m++) {
+		for(uint32_t c = 0; state[m].enabled && c < copies; c++) {
+			if(rig_vdev_create(&vdevs[num_vdevs], m, num_vdevs))
+				goto out;
+			num_vdevs++;
+		}
+	}
+	if(rig_wait_nodes(2000)) {
+		printf("uhid_rig: hidraw nodes did not appear\n");
+		goto out;
+	}
+
+	struct ctlra_create_opts_t opts = {
+		.flags_feedback_on_dirty = 1,
+		.flags_hidraw_virtual = 1,
+		.debug_level = CTLRA_DEBUG_ERROR,
+		.screen_redraw_target_fps = 30,
+	};
+	struct ctlra_t *ctlra = ctlra_create(&opts);
+	int num_devs = ctlra_probe(ctlra, rig_accept, 0);
+	printf("uhid_rig: %u virtual devices, %d connected\n", num_vdevs,
+	       num_devs);
+
+	pthread_t inject;
+	start_ns = now_ns();
+	if(pthread_create(&inject, 0, rig_inject, 0)) {
+		ctlra_exit(ctlra);
+		goto out;
+	}
+
+	while(!inject_done) {
+		ctlra_idle_iter(ctlra);
+		if(iter_sleep_us)
+			usleep(iter_sleep_us);
+	}
+	pthread_join(inject, 0);
+
+	rig_print_stats((now_ns() - start_ns) / 1e9);
+	ctlra_exit(ctlra);
+
+out:
+	for(uint32_t i = 0; i < num_vdevs; i++)
+		rig_vdev_destroy(&vdevs[i]);
+	free(vdevs);
+	free(lines);
+	if(record)
+		fclose(record);
+	return 0;
+}